@@ -10,6 +10,14 @@
 typedef size_t blkdev_handle_t;
 #define BLKDEV_HANDLE_NULL 0
 
+// Scatter list entry
+// Memory for a number of consecutive blocks of a request
+typedef struct
+{
+    uint8_t *buf; // Buffer (n * BLOCK_SIZE bytes)
+    uint32_t n;   // Number of blocks
+} blkdev_sg_t;
+
 // Representation of a block device
 typedef struct _blkdev_t
 {
@@ -25,10 +33,93 @@ typedef struct _blkdev_t
     bool (*read_blk)(struct _blkdev_t *, uint8_t *, uint32_t); // (drvstate, buffer, blkid) -> success
     // Write block
     bool (*write_blk)(struct _blkdev_t *, const uint8_t *, uint32_t); // (drvstate, buffer, blkid) -> success
+    // Read contiguous blocks into a scatter list (optional)
+    bool (*read_blks)(struct _blkdev_t *, const blkdev_sg_t *, uint32_t, uint32_t); // (drvstate, sg list, sg entries, start blkid) -> success
+    // Write contiguous blocks from a scatter list (optional)
+    bool (*write_blks)(struct _blkdev_t *, const blkdev_sg_t *, uint32_t, uint32_t); // (drvstate, sg list, sg entries, start blkid) -> success
     // Check if media was changed
     bool (*media_changed)(struct _blkdev_t *); // (drvstate) -> true: media chagned
 } blkdev_t;
 
+// Cached block buffer
+// Obtained with blkdev_get_buf(), must be given back with blkdev_release_buf()
+typedef struct _blkdev_buf_t
+{
+    uint8_t *data; // Block contents (BLOCK_SIZE bytes)
+
+    // Cache bookkeeping (private to the blkdev subsystem)
+    blkdev_handle_t handle;
+    uint32_t block;
+    uint32_t refs; // Number of users of the buffer
+    bool valid;    // Buffer holds the contents of handle:block
+    bool dirty;    // Contents not yet written to the device
+    bool writing;  // Write to the device in progress
+    bool reading;  // Prefetch from the device in progress
+    struct _blkdev_buf_t *hash_next;
+    struct _blkdev_buf_t *lru_prev;
+    struct _blkdev_buf_t *lru_next;
+} blkdev_buf_t;
+
+// Block request operation
+typedef enum
+{
+    BLKDEV_REQ_READ,
+    BLKDEV_REQ_WRITE,
+} blkdev_op_t;
+
+typedef struct _blkdev_req_t blkdev_req_t;
+
+// Request completion callback
+// Runs in the context which dispatched the request, must not block
+typedef void (*blkdev_req_cb_t)(blkdev_req_t *req, bool success);
+
+// Asynchronous block request
+// Filled by the caller, then submitted with blkdev_submit()
+// The request and its scatter list must stay valid until it completes
+struct _blkdev_req_t
+{
+    blkdev_op_t op;
+    uint32_t start;        // First block
+    const blkdev_sg_t *sg; // Scatter list
+    uint32_t n_sg;         // Number of scatter list entries
+    blkdev_req_cb_t cb;    // Completion callback (can be NULL)
+    void *data;            // Caller data
+
+    // Request state (private to the blkdev subsystem)
+    volatile bool done;
+    bool success;
+    uint32_t n;                // Number of blocks
+    uint32_t group_n;          // Blocks of the merged group it heads
+    uint32_t group_sg;         // Scatter list entries of the group
+    uint64_t submit_time;      // System time at submission (ms)
+    void *queue;               // Queue the request was submitted to
+    struct _blkdev_req_t *next;   // Next group in the queue
+    struct _blkdev_req_t *merged; // Next request in the merged group
+};
+
+// Request queue statistics (all devices)
+typedef struct
+{
+    uint32_t depth;         // Requests currently queued
+    uint32_t max_depth;     // Highest number of queued requests
+    uint32_t completed;     // Completed requests
+    uint32_t merged;        // Requests merged into an adjacent one
+    uint32_t dispatches;    // Driver requests issued
+    uint64_t total_latency; // Sum of submission to completion times (ms)
+    uint32_t max_latency;   // Longest submission to completion time (ms)
+} blkdev_queue_stats_t;
+
+// Buffer cache statistics
+typedef struct
+{
+    uint32_t hits;         // Blocks found in the cache
+    uint32_t misses;       // Blocks read from the device
+    uint32_t evictions;    // Valid blocks dropped to make room
+    uint32_t flushed;      // Dirty blocks written to the device
+    uint32_t write_errors; // Dirty blocks lost to write errors
+    uint32_t prefetched;   // Blocks read ahead of use
+} blkdev_cache_stats_t;
+
 // Initialize block device subsystem
 void blkdev_init();
 
@@ -48,6 +139,14 @@ bool blkdev_register(blkdev_t dev);
  */
 blkdev_handle_t blkdev_get_handle(const char *major);
 
+/*
+ * Get the size of a block device
+ * #### Parameters:
+ *   - handle: block device handle
+ * #### Returns: number of blocks, 0 if the handle is not valid
+ */
+uint32_t blkdev_get_nblocks(const blkdev_handle_t handle);
+
 /*
  * Release handle to block device
  * #### Parameters:
@@ -66,8 +165,79 @@ void blkdev_release_handle(blkdev_handle_t handle);
 bool blkdev_read(uint8_t *buf, const blkdev_handle_t handle,
                  const uint32_t block);
 
+/*
+ * Get the cached buffer of a block, reading it from the device if needed
+ * The buffer stays valid and is not evicted until it is released,
+ * so its contents can be used in place
+ * #### Parameters:
+ *   - handle: block device handle
+ *   - block: logical block ID
+ * #### Returns: buffer, NULL on failure or if all buffers are in use
+ */
+blkdev_buf_t *blkdev_get_buf(const blkdev_handle_t handle, const uint32_t block);
+
+/*
+ * Get a cached buffer for a block which is going to be overwritten
+ * Like blkdev_get_buf(), but the block isn't read from the device if it
+ * isn't cached. The caller must fill the whole buffer and mark it dirty
+ * #### Parameters:
+ *   - handle: block device handle
+ *   - block: logical block ID
+ * #### Returns: buffer, NULL on failure
+ */
+blkdev_buf_t *blkdev_get_new_buf(const blkdev_handle_t handle, const uint32_t block);
+
+/*
+ * Mark a cached buffer as modified
+ * The block is written to the device later, when the cache is flushed
+ * #### Parameters:
+ *   - buf: buffer obtained with blkdev_get_buf() or blkdev_get_new_buf()
+ */
+void blkdev_mark_dirty(blkdev_buf_t *buf);
+
+/*
+ * Write all modified cached blocks of a device
+ * Waits until no block is left modified, blocks modified again while
+ * being written are written once more
+ * #### Parameters:
+ *   - handle: block device handle
+ * #### Returns: true if all blocks were written successfully
+ */
+bool blkdev_sync(const blkdev_handle_t handle);
+
+/*
+ * Write all modified cached blocks of all devices
+ * #### Returns: true if all blocks were written successfully
+ */
+bool blkdev_sync_all();
+
+/*
+ * Release a buffer obtained with blkdev_get_buf()
+ * #### Parameters:
+ *   - buf: buffer
+ */
+void blkdev_release_buf(blkdev_buf_t *buf);
+
+/*
+ * Start reading contiguous blocks into the buffer cache, without waiting
+ * The reads are queued like other requests, and are dispatched when the
+ * CPU is idle or when one of the blocks is needed.
+ * Blocks which are already cached are skipped, and prefetching stops
+ * early if only a few clean buffers are left to reuse
+ * #### Parameters:
+ *   - handle: block device handle
+ *   - start: logical block ID of the first block
+ *   - n: number of blocks
+ * #### Returns: number of blocks, from the first one, which are cached
+ *   or queued for reading
+ */
+uint32_t blkdev_prefetch(const blkdev_handle_t handle, const uint32_t start,
+                         const uint32_t n);
+
 /*
  * Read n contiguous blocks from block device
+ * Blocks which are not cached are read straight from the device,
+ * without being added to the cache
  * #### Parameters:
  *   - buf: buffer to read into
  *   - handle: block device handle
@@ -78,6 +248,45 @@ bool blkdev_read(uint8_t *buf, const blkdev_handle_t handle,
 bool blkdev_read_n(uint8_t *buf, const blkdev_handle_t handle,
                    const uint32_t start, const uint32_t n);
 
+/*
+ * Read contiguous blocks from block device into a scatter list
+ * The blocks are read with a single driver request when the driver
+ * supports it. The buffer cache is not used.
+ * #### Parameters:
+ *   - handle: block device handle
+ *   - start: logical block ID to start reading from
+ *   - sg: scatter list
+ *   - n_sg: number of entries in the scatter list
+ * #### Returns: true on success
+ */
+bool blkdev_read_sg(const blkdev_handle_t handle, const uint32_t start,
+                    const blkdev_sg_t *sg, const uint32_t n_sg);
+
+/*
+ * Write contiguous blocks to block device from a scatter list
+ * Cached copies of the blocks are updated.
+ * #### Parameters:
+ *   - handle: block device handle
+ *   - start: logical block ID to start writing to
+ *   - sg: scatter list
+ *   - n_sg: number of entries in the scatter list
+ * #### Returns: true on success
+ */
+bool blkdev_write_sg(const blkdev_handle_t handle, const uint32_t start,
+                     const blkdev_sg_t *sg, const uint32_t n_sg);
+
+/*
+ * Write n contiguous blocks to block device
+ * #### Parameters:
+ *   - buf: buffer to write
+ *   - handle: block device handle
+ *   - start: logical block ID to start writing to
+ *   - n: number of blocks to write
+ * #### Returns: true on success
+ */
+bool blkdev_write_n(const uint8_t *buf, const blkdev_handle_t handle,
+                    const uint32_t start, const uint32_t n);
+
 /*
  * Write block to block device
  * #### Parameters:
@@ -91,11 +300,55 @@ bool blkdev_write(const uint8_t *buf, const blkdev_handle_t handle,
 
 /*
  * Check if block device media was changed
+ * If so, cached blocks are dropped, along with unwritten modifications
  * #### Parameters:
  *   - handle: block device handle
  * #### Returns: true if media changed
  */
 bool blkdev_media_changed(const blkdev_handle_t handle);
 
+/*
+ * Queue an asynchronous request on a block device
+ * Requests are sorted in C-SCAN order by block number and merged with
+ * adjacent requests of the same kind. They are dispatched to the driver
+ * while someone waits with blkdev_wait(), or when the CPU is idle.
+ * #### Parameters:
+ *   - handle: block device handle
+ *   - req: request
+ * #### Returns: false if the request is invalid (it isn't queued)
+ */
+bool blkdev_submit(const blkdev_handle_t handle, blkdev_req_t *req);
+
+/*
+ * Wait for a submitted request to complete,
+ * dispatching queued requests in the meantime
+ * #### Parameters:
+ *   - req: submitted request
+ * #### Returns: true if the request succeeded
+ */
+bool blkdev_wait(blkdev_req_t *req);
+
+/*
+ * Dispatch a queued request, if any
+ * Modified blocks are queued for writing once the flush delay expires
+ * To be called when the CPU has nothing better to do
+ * #### Returns: true if a request was dispatched
+ */
+bool blkdev_run_queues();
+
+/*
+ * Get request queue statistics
+ * #### Parameters:
+ *   - out: pointer to the structure that will hold the statistics
+ */
+void blkdev_get_queue_stats(blkdev_queue_stats_t *out);
+
+/*
+ * Get buffer cache statistics
+ * #### Parameters:
+ *   - out: pointer to the structure that will hold the statistics
+ */
+void blkdev_get_cache_stats(blkdev_cache_stats_t *out);
+
 // Debug registered devices
 void blkdev_debug_devices();
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #define BOOT_INFO_PHYSMMAP_MAX_ENTRIES 32
+#define BOOT_INFO_MODULES_MAX 4
 
 // Entry in the physical memory map of the boot_info struct
 struct physmmap_entry
@@ -18,12 +19,24 @@ struct physmmap_entry
 };
 typedef struct physmmap_entry physmmap_entry_t;
 
+// Module loaded by the bootloader
+struct boot_module
+{
+    uint32_t addr; // Physical address
+    uint32_t size; // Size in bytes
+};
+typedef struct boot_module boot_module_t;
+
 // Boot info struct
 struct boot_info
 {
     // Physical memory map
     physmmap_entry_t physmmap[BOOT_INFO_PHYSMMAP_MAX_ENTRIES];
     uint32_t physmmap_n;
+
+    // Boot modules, their memory is never allocated
+    boot_module_t modules[BOOT_INFO_MODULES_MAX];
+    uint32_t modules_n;
 };
 typedef struct boot_info boot_info_t;
 
@@ -4,6 +4,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Fixed userspace address of the time page
+// (page aligned, below the process stack)
+#define CLOCK_TIME_PAGE_ADDR 0xBFFF0000
+
+// Time page shared read-only with userspace
+// The kernel makes seq odd while updating the page, so readers
+// must retry if seq is odd or changes across the read
+typedef struct
+{
+    volatile uint32_t seq;
+    volatile uint64_t system_time;       // System clock (ms)
+    volatile uint32_t local_time_offset; // Local time - system time (s)
+} clock_time_page_t;
+
 // Timer handle
 typedef int timer_handle_t;
 
@@ -25,6 +39,13 @@ void clock_init();
  */
 uint64_t clock_get_system();
 
+/*
+ * Get time the CPU spent idle since boot in milliseconds
+ * NOTE: sampled at every clock tick
+ * #### Returns: uint64_t milliseconds
+ */
+uint64_t clock_get_idle();
+
 /*
  * Get current local time seconds
  * #### Returns: uint32_t seconds
@@ -40,6 +61,20 @@ uint32_t clock_get_local();
  */
 void clock_set_local(uint32_t time);
 
+/*
+ * Map the time page read-only into the current user VAS
+ * at CLOCK_TIME_PAGE_ADDR
+ * #### Returns: false on failure
+ */
+bool clock_map_time_page();
+
+/*
+ * Unmap the time page from the current user VAS
+ * NOTE: must be called before the UVAS is destroyed,
+ *       so that the shared page is not freed with it
+ */
+void clock_unmap_time_page();
+
 /*
  * Block until specified time has elapsed
  * #### Parameters:
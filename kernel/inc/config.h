@@ -11,4 +11,35 @@
 #define DEBUG_SYSCALL 0
 #define DEBUG_INT 0
 #define DEBUG_PROC 0
-#define DEBUG_ELF 0
\ No newline at end of file
+#define DEBUG_SCHED 0
+#define DEBUG_FPU 0
+#define DEBUG_ELF 0
+
+// Load executables page by page on first access
+#define ELF_DEMAND_PAGING 1
+
+// Number of exited processes kept for reuse by exec
+#define PROC_POOL_SIZE 4
+
+// Number of physical pages zeroed in advance while the CPU is idle
+#define ZERO_POOL_SIZE 32
+
+// Number of blocks kept in the block device buffer cache
+#define BLKDEV_CACHE_SIZE 32
+
+// Number of path components kept in the VFS lookup cache
+#define VFS_DCACHE_SIZE 64
+
+// Delay before modified cached blocks are written back (ms)
+#define BLKDEV_FLUSH_DELAY 2000
+
+// Number of FAT sectors cached for each mounted FAT filesystem
+#define FAT_CACHE_SIZE 8
+
+// Blocks read ahead of sequential file reads
+// The window starts at the minimum and doubles while reads stay sequential
+#define VFS_READAHEAD_MIN 4
+#define VFS_READAHEAD_MAX 16
+
+// Maximum number of pages of file data in each mounted tmpfs
+#define TMPFS_MAX_PAGES 256
\ No newline at end of file
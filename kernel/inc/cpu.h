@@ -9,4 +9,18 @@ static inline void pause()
     __asm__("pause");
 }
 
+// Read time stamp counter
+static inline uint64_t rdtsc()
+{
+    uint64_t tsc;
+    __asm__ volatile("rdtsc" : "=A"(tsc));
+    return tsc;
+}
+
+// Compiler memory barrier
+static inline void barrier()
+{
+    __asm__ volatile("" ::: "memory");
+}
+
 #endif
\ No newline at end of file
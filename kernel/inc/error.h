@@ -19,6 +19,7 @@
 #define E_NOTPERM -14  // Not permitted
 #define E_INVREQ -15   // Invalid request
 #define E_MDCHNG -16   // Media changed
+#define E_NOSPC -17    // No space left on device
 
 // Get message string for an error
 char *error_get_message(int32_t err);
\ No newline at end of file
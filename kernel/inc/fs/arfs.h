@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+ * Register read-only archive filesystem driver
+ * The device is either a block device, which is loaded into memory
+ * on mount, or "mod<n>" for the n-th module loaded by the bootloader,
+ * which is used in place
+ * Images are built with scripts/mkarfs.py
+ */
+void arfs_init();
@@ -0,0 +1,7 @@
+#pragma once
+
+/*
+ * Register tmpfs filesystem driver
+ * tmpfs keeps files in memory, the device passed to mount is ignored
+ */
+void tmpfs_init();
@@ -22,6 +22,16 @@ typedef uint32_t fopts;
 // File open options
 #define FOPT_DIR (1 << 0)   // Want directory from open()
 #define FOPT_WRITE (1 << 1) // Want to be able to write to file
+#define FOPT_CREATE (1 << 2) // Create the file if it doesn't exist
+                             // (with FOPT_WRITE, or FOPT_DIR for a directory)
+
+// Origin of a file seek
+typedef enum
+{
+    VFS_SEEK_SET = 0, // Start of the file
+    VFS_SEEK_CUR = 1, // Current position
+    VFS_SEEK_END = 2, // End of the file
+} vfs_seek_t;
 
 // Inode type
 typedef enum
@@ -38,6 +48,15 @@ typedef struct
     uint32_t size;               // Size of file
 } dirent_t;
 
+// Directory read position, kept for each open file
+// Lets the filesystem resume a readdir() where the previous one stopped
+typedef struct
+{
+    uint32_t offset; // Offset of the next entry IN ENTRIES
+    uint32_t block;  // Position of the next entry, defined by the filesystem
+    uint32_t index;
+} vfs_dir_cursor_t;
+
 // VFS inode
 // Represents a file in the virtual file system
 typedef struct _vfs_inode_t vfs_inode_t;
@@ -55,23 +74,49 @@ struct _vfs_inode_t
     // Unique identifiying information
     uint32_t id; // Unique identifier inside the mount point
 
+    // References held by the VFS (open files, lookup cache)
+    // Managed by the VFS, the inode is destroyed when they drop to 0
+    // Filesystems construct inodes with no references
+    uint32_t ref_count;
+
     // Read data from inode
     // uint32_t read(vfs_inode_t *inode, uint8_t *buf, uint32_t offset, uint32_t length)
     int64_t (*read)(vfs_inode_t *, uint8_t *, uint32_t, uint32_t);
 
+    // Read whole blocks of the file directly into a buffer (optional)
+    // Contiguous blocks on the device are read with a single request
+    // uint32_t read_blocks(vfs_inode_t *inode, uint8_t *buf, uint32_t block, uint32_t n)
+    // Returns the number of blocks read
+    int64_t (*read_blocks)(vfs_inode_t *, uint8_t *, uint32_t, uint32_t);
+
+    // Start reading blocks of the file into the cache, without waiting (optional)
+    // Blocks past the end of the file are ignored
+    // int32_t readahead(vfs_inode_t *inode, uint32_t block, uint32_t n)
+    int32_t (*readahead)(vfs_inode_t *, uint32_t, uint32_t);
+
     // Write data to inode
-    // uint32_t write(vfs_inode_t *inode, uint8_t *buf, uint32_t offset, uint32_t length
-    int64_t (*write)(vfs_inode_t *, uint8_t *, uint32_t, uint32_t);
-    //
+    // The file grows if the data goes past its end
+    // uint32_t write(vfs_inode_t *inode, const uint8_t *buf, uint32_t offset, uint32_t length)
+    // Returns the number of bytes written
+    int64_t (*write)(vfs_inode_t *, const uint8_t *, uint32_t, uint32_t);
+
     // List dirents children of inode
-    // uint32_t readdir(vfs_inode_t *inode, dirent_t *buf, uint32_t offset, uint32_t n);
+    // The cursor can be used to continue from the previous call if
+    // its offset is not past the requested one, and must be updated
+    // uint32_t readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+    //                  dirent_t *buf, uint32_t offset, uint32_t n);
     // Returns the number of dirents read (if less than n, no more dirents to read)
-    int64_t (*readdir)(vfs_inode_t *, dirent_t *, uint32_t, uint32_t);
+    int64_t (*readdir)(vfs_inode_t *, vfs_dir_cursor_t *, dirent_t *, uint32_t, uint32_t);
 
     // Lookup child in directory inode by name
     // vfs_inode_t *lookup(vfs_inode_t *inode, vfs_inode_t**res, char *name)
     int32_t (*lookup)(vfs_inode_t *, vfs_inode_t **, const char *);
 
+    // Create an empty file or directory in directory inode (optional)
+    // int32_t create(vfs_inode_t *inode, vfs_inode_t **res, const char *name,
+    //                vfs_inode_type_t type)
+    int32_t (*create)(vfs_inode_t *, vfs_inode_t **, const char *, vfs_inode_type_t);
+
     // Destroy inode
     // Deallocate inode and any private data
     // void destroy(vfs_inode_t *inode)
@@ -90,6 +135,15 @@ struct _vfs_superblock_t
     // Also deallocates the vfs_superblock_t object
     // void destroy(vfs_inode_t *inode)
     void (*unmount)(vfs_superblock_t *);
+
+    // Check if the underlying media has changed (optional)
+    // Cached lookups for the mountpoint are dropped when it has
+    // bool changed(vfs_superblock_t *sb)
+    bool (*changed)(vfs_superblock_t *);
+
+    // Write modified data of the filesystem to the device (optional)
+    // int32_t sync(vfs_superblock_t *sb)
+    int32_t (*sync)(vfs_superblock_t *);
 };
 
 // Filesystem type
@@ -131,6 +185,7 @@ int32_t vfs_mount(const char *dev, mount_point_t mp, const char *fs);
 
 /*
  * Unmount filesystem
+ * Modified data is written to the device first
  * #### Parameters
  *   - mp: mount point number
  * #### Returns
@@ -138,12 +193,21 @@ int32_t vfs_mount(const char *dev, mount_point_t mp, const char *fs);
  */
 int32_t vfs_unmount(mount_point_t mp);
 
+/*
+ * Write modified data of all mounted filesystems to their devices
+ * #### Returns
+ *   0 on success, otherwise a negative value indicating the error
+ */
+int32_t vfs_sync();
+
 //////// File handling functions
 
 /*
  * Open VFS file
  * If FOPT_DIR is not passed, fails if it finds a directory,
  * else fail if it is a file.
+ * With FOPT_CREATE, a missing file is created empty, or a missing
+ * directory if FOPT_DIR is passed too.
  * #### Parameters
  *   - path: file path
  *   - opt: file open options
@@ -184,3 +248,57 @@ int64_t vfs_readdir(vfs_file_handle_t file, dirent_t *buf, uint32_t offset, uint
  *    If the number returned is < n, there are no more bytes to read
  */
 int64_t vfs_read(vfs_file_handle_t file, uint8_t *buf, uint32_t offset, uint32_t n);
+
+/*
+ * Read data from the current position of a file, and advance it
+ * Sequential reads make the following blocks be read ahead
+ * #### Parameters
+ *  - file: VFS file handle of the file
+ *  - buf: buffer to read into
+ *  - n: max number of bytes to read
+ * #### Returns
+ *    number of bytes read (>= 0) on success, else error
+ *    If the number returned is < n, there are no more bytes to read
+ */
+int64_t vfs_read_next(vfs_file_handle_t file, uint8_t *buf, uint32_t n);
+
+/*
+ * Set the current position of a file
+ * The position can be past the end of the file
+ * #### Parameters
+ *  - file: VFS file handle of the file
+ *  - offset: offset in bytes from the origin
+ *  - whence: origin
+ * #### Returns
+ *    new position (>= 0) on success, else error
+ */
+int64_t vfs_seek(vfs_file_handle_t file, int64_t offset, vfs_seek_t whence);
+
+/*
+ * Read whole blocks from a file straight into a buffer, without
+ * going through the block buffer cache
+ * #### Parameters
+ *  - file: VFS file handle of the file
+ *  - buf: buffer to read into (at least n * BLOCK_SIZE bytes)
+ *  - block: index of the first block of the file to read
+ *  - n: number of blocks to read
+ * #### Returns
+ *    number of blocks read (>= 0) on success, else error
+ *    E_NOIMPL if the filesystem doesn't support block reads
+ *    NOTE: the part of the last block past the end of the file
+ *    is undefined
+ */
+int64_t vfs_read_blocks(vfs_file_handle_t file, uint8_t *buf, uint32_t block, uint32_t n);
+
+
+/*
+ * Write data to a file
+ * #### Parameters
+ *  - file: VFS file handle of the file, opened with FOPT_WRITE
+ *  - buf: buffer to write from
+ *  - offset: offset from the start of the file in bytes, at most the file size
+ *  - n: number of bytes to write
+ * #### Returns
+ *    number of bytes written (>= 0) on success, else error
+ */
+int64_t vfs_write(vfs_file_handle_t file, const uint8_t *buf, uint32_t offset, uint32_t n);
\ No newline at end of file
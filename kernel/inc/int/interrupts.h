@@ -59,6 +59,12 @@ void interrupts_unregister_irq(uint8_t irq, void (*handler)());
  */
 interrupt_context_t *interrupt_get_cur_ctx();
 
+/*
+ * Set pointer to the current interrupt context
+ * NOTE: only to be used when switching between kernel stacks
+ */
+void interrupt_set_cur_ctx(interrupt_context_t *ctx);
+
 // Enable hardware interrupts
 static inline void sti()
 {
@@ -71,4 +77,19 @@ static inline void cli()
     __asm__("cli");
 }
 
+// Disable hardware interrupts, saving the previous state
+// Returns: EFLAGS before disabling interrupts
+static inline uint32_t cli_save()
+{
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags)::"memory");
+    return flags;
+}
+
+// Restore interrupt state saved with cli_save()
+static inline void restore_flags(uint32_t flags)
+{
+    __asm__ volatile("push %0; popf" ::"r"(flags) : "memory", "cc");
+}
+
 #endif
\ No newline at end of file
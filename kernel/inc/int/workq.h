@@ -0,0 +1,71 @@
+#ifndef _INT_WORKQ_H
+#define _INT_WORKQ_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deferred work queues
+// Interrupt handlers enqueue work items, which are then executed with
+// interrupts enabled at the end of the outermost interrupt handler,
+// or from the idle loop
+typedef enum
+{
+    WORKQ_TIMER = 0, // Timer callbacks
+    WORKQ_KBD = 1,   // Keyboard data processing
+    WORKQ_N,
+} workq_id_t;
+
+// Work queue statistics
+// NOTE: latencies are measured with the system clock resolution
+typedef struct
+{
+    uint32_t executed;      // Work items executed
+    uint32_t dropped;       // Work items dropped because the queue was full
+    uint32_t max_pending;   // Maximum number of pending items
+    uint64_t total_latency; // Sum of enqueue to execution latencies (ms)
+    uint32_t max_latency;   // Maximum enqueue to execution latency (ms)
+} workq_stats_t;
+
+/*
+ * Initialize deferred work queues
+ */
+void workq_init();
+
+/*
+ * Enqueue work item
+ * Can be called from interrupt handlers
+ * #### Parameters:
+ *   - queue: work queue
+ *   - func: function to execute
+ *   - data: pointer that gets passed to the function
+ * #### Returns: false if the queue is full
+ */
+bool workq_enqueue(workq_id_t queue, void (*func)(void *), void *data);
+
+/*
+ * Execute all pending work items
+ * Does nothing if the work queues are already being run
+ * NOTE: must be called with interrupts disabled. Interrupts are enabled
+ *       while executing the work items, and disabled again on return
+ */
+void workq_run();
+
+/*
+ * Check if there are pending work items
+ */
+bool workq_pending();
+
+/*
+ * Check if work items are being executed further down the stack
+ */
+bool workq_running();
+
+/*
+ * Get statistics of a work queue
+ * #### Parameters:
+ *   - queue: work queue
+ *   - stats: pointer to the struct where the statistics will be copied
+ */
+void workq_get_stats(workq_id_t queue, workq_stats_t *stats);
+
+#endif
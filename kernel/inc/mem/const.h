@@ -28,8 +28,16 @@
 
 // CR0 bits
 #define CR0_PE 0x1
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
 #define CR0_PG 0x80000000
 
+// CR4 bits
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
 // GDT segment offsets
 #define GDT_SEGMENT_KCODE 0x0008
 #define GDT_SEGMENT_KDATA 0x0010
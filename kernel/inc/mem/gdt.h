@@ -1,9 +1,19 @@
 #ifndef _MEM_GDT_H
 #define _MEM_GDT_H 1
 
+#include <stdint.h>
+
 /*
  * Set up Global Descriptor Table
  */
 void setup_gdt();
 
+/*
+ * Set the stack used by the CPU when entering the kernel
+ * from userspace (TSS ESP0)
+ * #### Parameters:
+ *   - esp0: kernel stack top
+ */
+void gdt_set_kernel_stack(uint32_t esp0);
+
 #endif
\ No newline at end of file
@@ -49,6 +49,7 @@ extern "C"
 
     /*
      * Make a page of virtual memory available for user
+     * The new pages are filled with zeroes
      * DOESN't fail if a page is already mapped
      * #### Parameters:
      *   - void *vaddr: virtual address (page aligned)
@@ -58,6 +59,17 @@ extern "C"
      */
     bool mem_make_avail(void *vaddr, uint32_t n);
 
+    /*
+     * Same as mem_make_avail(), but the contents of the new pages
+     * are undefined. The caller must overwrite them completely
+     * #### Parameters:
+     *   - void *vaddr: virtual address (page aligned)
+     *   - uint32_t n: number of pages
+     * #### Returns:
+     *    false on failure
+     */
+    bool mem_make_avail_uninit(void *vaddr, uint32_t n);
+
 #ifdef __cplusplus
 }
 #endif
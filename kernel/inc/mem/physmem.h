@@ -68,6 +68,51 @@ extern "C"
      */
     void *physmem_alloc_isadma(uint32_t n);
 
+    // Zeroed page pool statistics
+    typedef struct
+    {
+        uint32_t hits;   // Zeroed allocations served by the pool
+        uint32_t misses; // Zeroed allocations that had to zero the page
+        uint32_t free;   // Pages currently in the pool
+    } physmem_zero_stats_t;
+
+    /*
+     * Allocate a physical memory page filled with zeroes
+     * Takes a page from the pre-zeroed pool, and only zeroes
+     * the page synchronously if the pool is empty
+     * #### Returns:
+     *     void *: physical address of the page or
+     *             PHYSMEM_NULL (0xFFFFFFFF) on failure
+     */
+    void *physmem_alloc_zeroed();
+
+    /*
+     * Take a page from the pre-zeroed pool
+     * Doesn't map anything into the VAS, so it can be used while
+     * allocating page tables
+     * #### Returns:
+     *     void *: physical address of the page or
+     *             PHYSMEM_NULL (0xFFFFFFFF) if the pool is empty
+     */
+    void *physmem_alloc_prezeroed();
+
+    /*
+     * Zero a free page and add it to the pre-zeroed pool
+     * To be called when the CPU has nothing better to do
+     * #### Returns:
+     *     bool: true if a page was added, false if the pool is full
+     *           or out of memory
+     */
+    bool physmem_refill_zeroed();
+
+    /*
+     * Get zeroed page pool statistics
+     * #### Parameters:
+     *   - physmem_zero_stats_t *out: pointer to the structure
+     *                                that will hold the statistics
+     */
+    void physmem_get_zero_stats(physmem_zero_stats_t *out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -38,6 +38,20 @@ void vmem_purge_pagetabs();
  */
 bool vmem_map(void *paddr, void *vaddr, uint32_t n);
 
+/*
+ * Maps contiguous pages from a physical address to a virtual address
+ * as read-only for userspace, allocating new page tables if needed
+ * #### Parameters:
+ *  - void *paddr: physical address of first page (page aligned)
+ *  - void *vaddr: virtual address of first page (page aligned)
+ *  - uint32_t n: number of pages
+ * #### Returns:
+ *    bool: true if succesful
+ * #### Notes:
+ *    this function fails if page table allocation fails
+ */
+bool vmem_map_user_ro(void *paddr, void *vaddr, uint32_t n);
+
 /*
  * Maps contiguous pages from a physical address to a virtual address,
  * but doesn't allocate new page tables
@@ -220,6 +234,14 @@ bool vmem_validate_user_ptr(void *ptr, uint32_t size);
 // (doesn't cross into the KVAS)
 bool vmem_validate_user_ptr_mapped(void *ptr, uint32_t size);
 
+/*
+ * Set function used by vmem_validate_user_ptr_mapped() to load
+ * pages which are valid but not yet present (demand paging)
+ * #### Parameters:
+ *   - handler: returns true if the page was loaded
+ */
+void vmem_set_page_in_handler(bool (*handler)(void *vaddr));
+
 /*
  * Calculate number of pages from address range size
  * #### Parameters:
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "fs/vfs.h"
+#include "proc/proc.h"
 
 /*
  * Load an ELF executable into the current UVAS
@@ -12,4 +13,51 @@
  *    0 on success, error number on failure
  *  NOTE: doesn't clean up any allocated memory in the UVAS on failure
  */
-int32_t elf_load(vfs_file_handle_t file, void **entry);
\ No newline at end of file
+int32_t elf_load(vfs_file_handle_t file, void **entry);
+
+/*
+ * Prepare an ELF executable for demand paging
+ * Nothing is loaded: the segments are recorded in the region table
+ * of the process, and their pages are read on first access
+ * #### Parameters:
+ *   - file: file handle of the executable
+ *           On success, the file is owned by the process
+ *   - pcb: process the executable is loaded for
+ *   - entry: pointer to entry point pointer, will be set to
+ *            the entry point of the program
+ *  #### Returns:
+ *    0 on success, error number on failure
+ */
+int32_t elf_load_demand(vfs_file_handle_t file, proc_cb_t *pcb, void **entry);
+
+/*
+ * Load the page containing an address from the executable of a process
+ * The address space of the process must be the current one
+ * #### Parameters:
+ *   - pcb: process
+ *   - vaddr: address in the page to load
+ *  #### Returns:
+ *    0 on success, E_INVREQ if the address doesn't belong to
+ *    any segment, other errors on failure
+ */
+int32_t elf_page_in(proc_cb_t *pcb, void *vaddr);
+
+/*
+ * Load an ELF image into kernel memory, laid out as it will be
+ * mapped in user space starting at a fixed base address
+ * Used for shared libraries, which are loaded once and mapped
+ * into every process that requests them
+ * #### Parameters:
+ *   - file: file handle of the image
+ *   - base: user space address the image is linked at
+ *   - max_pages: maximum size of the image
+ *   - image: set to the kernel pages holding the image
+ *   - n_pages: set to the number of pages of the image
+ *   - writable: array of max_pages flags, set for the pages which
+ *               belong to writable segments
+ *  #### Returns:
+ *    0 on success, error number on failure
+ */
+int32_t elf_load_image(vfs_file_handle_t file, uint32_t base,
+                       uint32_t max_pages, uint8_t **image,
+                       uint32_t *n_pages, bool *writable);
@@ -0,0 +1,42 @@
+#ifndef _PROC_FPU_H
+#define _PROC_FPU_H 1
+
+#include <stdbool.h>
+
+#include "proc/proc.h"
+
+// Lazy FPU/SSE context switching
+// The FPU registers are only saved and restored when a process other than
+// the one that last used them executes an FPU instruction, which traps
+// with #NM because CR0.TS is set on every process switch.
+// Processes that never use the FPU don't get a save area at all.
+
+/*
+ * Detect and enable the FPU, and SSE if supported
+ */
+void fpu_init();
+
+/*
+ * Prepare the FPU for switching to a process
+ * Must be called with interrupts disabled
+ * #### Parameters:
+ *   - next: process that is about to run
+ */
+void fpu_switch(proc_cb_t *next);
+
+/*
+ * Handle Device Not Available exception (#NM)
+ * Loads the FPU context of the current process
+ * #### Returns: true if the exception was handled,
+ *               false if the FPU can't be used
+ */
+bool fpu_handle_nm();
+
+/*
+ * Release the FPU context of a process
+ * #### Parameters:
+ *   - pcb: process
+ */
+void fpu_release(proc_cb_t *pcb);
+
+#endif
@@ -7,8 +7,31 @@
 #include "proc/ctx.h"
 #include "mem/vmem.h"
 #include "fs/vfs.h"
+#include "waitq.h"
 
 #define MAX_FILES 16
+#define PROC_KSTACK_PAGES 4 // Size of the per-process kernel stack
+#define PROC_STACK_PAGES 4  // Size of the userspace stack
+#define PROC_REGIONS_MAX 8  // Maximum number of demand paged regions
+
+// Process states
+typedef enum
+{
+    PROC_RUNNING, // Currently executing
+    PROC_READY,   // In the ready queue
+    PROC_WAITING, // Blocked, waiting to be woken up
+    PROC_ZOMBIE,  // Exited, waiting to be freed
+} proc_state_t;
+
+// Region of the UVAS backed by the executable file
+// Pages are read from the file the first time they are accessed
+typedef struct
+{
+    uint32_t start, end; // Page aligned address range
+    uint32_t vaddr;      // Start of the segment
+    uint32_t offset;     // File offset of the segment
+    uint32_t filesz;     // Number of bytes backed by the file
+} proc_region_t;
 
 typedef struct
 {
@@ -36,24 +59,107 @@ typedef struct _proc_cb_t
 
     // Open files
     proc_file_t files[MAX_FILES];
+
+    // Scheduling
+    proc_state_t state;
+    struct _proc_cb_t *sched_next; // Next process in the ready queue
+    void *kstack;                  // Kernel stack (lowest address)
+    uint32_t kstack_esp;           // Saved kernel stack pointer
+
+    // Wait queue the process is sleeping on, NULL if none
+    waitq_t *wait_queue;
+    struct _proc_cb_t *wait_next; // Next process sleeping on a wait queue
+    volatile bool wait_woken;     // Wait queue was signaled
+    uint64_t wait_deadline;       // System time of the timeout, 0 if none
+
+    // Process waiting for this one to exit (exec() parent)
+    struct _proc_cb_t *waiter;
+    int32_t child_status; // Exit status of the waited for child
+
+    // Demand paging
+    vfs_file_handle_t exe_file; // Executable file, -1 if not kept open
+    proc_region_t regions[PROC_REGIONS_MAX];
+    uint32_t n_regions;
+    void *fault_addr; // Address of the last page fault
+
+    // FPU/SSE save area, allocated on first FPU use
+    void *fpu_area;
+
+    // User stack pages kept while the PCB is in the recycling pool
+    void *stack_pages[PROC_STACK_PAGES];
+    bool stack_saved;
+
+    uint64_t create_tsc; // Time stamp counter at creation
+
+    bool terminate_lock; // Process can't be terminated
+    bool kill_pending;   // Terminate when returning to userspace
 } proc_cb_t;
 
+// Process management statistics
+// NOTE: latencies are measured in CPU cycles
+typedef struct
+{
+    uint32_t exec_count; // Processes created
+    uint64_t exec_total; // Sum of creation to start latencies
+    uint64_t exec_max;   // Maximum creation to start latency
+    uint32_t exit_count; // Processes exited
+    uint64_t exit_total; // Sum of exit latencies
+    uint64_t exit_max;   // Maximum exit latency
+    uint32_t pool_hits;   // Processes created from recycled objects
+    uint32_t pool_misses; // Processes created from scratch
+    uint32_t pool_free;   // Recycled objects currently in the pool
+} proc_stats_t;
+
 /*
  * Initialize process management
  */
 void proc_init();
 
 /*
- * Add process to the top of the stack
- * Does address space switching
+ * Create a new process, child of the current one
+ * Switches to the address space of the new process, so that the
+ * executable can be loaded into it. The process doesn't run until
+ * proc_start() is called
+ * #### Parameters:
+ *   - child: pointer to the variable that will hold the new process
+ * #### Returns: negative value on error
  */
-int32_t proc_push();
+int32_t proc_create(proc_cb_t **child);
 
 /*
- * Remove process from the top of the process stack
- * Does address space switching
+ * Start a process created with proc_create()
+ * Switches back to the address space of the current process and
+ * adds the new process to the ready queue
+ * #### Parameters:
+ *   - pcb: process to start
  */
-int32_t proc_pop();
+void proc_start(proc_cb_t *pcb);
+
+/*
+ * Destroy a process created with proc_create() which was never started
+ * Must be called from within the address space of the process
+ * #### Parameters:
+ *   - pcb: process to destroy
+ */
+void proc_abort(proc_cb_t *pcb);
+
+/*
+ * Wait for a started child process to exit
+ * The child becomes the foreground process until it exits
+ * #### Parameters:
+ *   - pcb: child process
+ * #### Returns: exit status of the child
+ */
+int32_t proc_wait(proc_cb_t *pcb);
+
+/*
+ * Terminate the current process
+ * Never returns on success
+ * #### Parameters:
+ *   - status: exit status passed to the waiting parent, if any
+ * #### Returns: negative value on error
+ */
+int32_t proc_exit(int32_t status);
 
 /*
  * Get current process
@@ -61,11 +167,54 @@ int32_t proc_pop();
  */
 proc_cb_t *proc_cur();
 
+/*
+ * Set current process
+ * NOTE: only to be used by the scheduler
+ */
+void proc_set_cur(proc_cb_t *pcb);
+
+/*
+ * Get foreground process
+ * (the last process started with exec)
+ */
+proc_cb_t *proc_fg();
+
+/*
+ * Free the resources of a process which has exited
+ * NOTE: only to be used by the scheduler
+ */
+void proc_free(proc_cb_t *pcb);
+
+/*
+ * Load a not yet present page of the current process on demand
+ * #### Parameters:
+ *   - vaddr: faulting address
+ * #### Returns: true if the page was loaded, false if the address
+ *               is not valid for the process
+ */
+bool proc_page_in(void *vaddr);
+
+/*
+ * Get process management statistics
+ * #### Parameters:
+ *   - out: pointer to the structure that will hold the statistics
+ */
+void proc_get_stats(proc_stats_t *out);
+
+/*
+ * Get top of the kernel stack of a process
+ */
+static inline uint32_t proc_kstack_top(proc_cb_t *pcb)
+{
+    return (uint32_t)pcb->kstack + PROC_KSTACK_PAGES * MEM_PAGE_SIZE;
+}
+
 /**
  * Set up CPU context for process execution
+ * pcb: process
  * entry: entrypoint of the process
  */
-void proc_setup_cpu_ctx(void *entry);
+void proc_setup_cpu_ctx(proc_cb_t *pcb, void *entry);
 
 /*
  * Open file system call
@@ -87,6 +236,21 @@ void syscall_readdir(proc_cb_t *pcb);
  */
 void syscall_read(proc_cb_t *pcb);
 
+/*
+ * Read from current position system call
+ */
+void syscall_read_next(proc_cb_t *pcb);
+
+/*
+ * Seek system call
+ */
+void syscall_seek(proc_cb_t *pcb);
+
+/*
+ * Write system call
+ */
+void syscall_write(proc_cb_t *pcb);
+
 /*
  * Check if the process can terminate
  */
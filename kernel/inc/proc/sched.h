@@ -0,0 +1,96 @@
+#ifndef _PROC_SCHED_H
+#define _PROC_SCHED_H 1
+
+#include <stdbool.h>
+
+#include "proc/proc.h"
+#include "int/interrupts.h"
+
+// Round-robin preemptive scheduler
+// Processes are preempted by the timer only while executing in userspace.
+// Kernel code runs until it yields, and system calls are serialized
+// by the kernel lock, which stays held while a system call waits on a
+// device (console input and delays release it)
+
+/*
+ * Initialize scheduler
+ * #### Parameters:
+ *   - init: init process, which becomes the running process
+ */
+void sched_init(proc_cb_t *init);
+
+/*
+ * Add a new process to the ready queue
+ * The process will start executing its CPU context in userspace
+ * #### Parameters:
+ *   - pcb: new process
+ */
+void sched_add(proc_cb_t *pcb);
+
+/*
+ * Add a waiting process back to the ready queue
+ * Can be called from interrupt handlers
+ * #### Parameters:
+ *   - pcb: process to wake up
+ */
+void sched_wake(proc_cb_t *pcb);
+
+/*
+ * Give the CPU to the next ready process, if any
+ * The current process stays ready
+ */
+void sched_yield();
+
+/*
+ * Put the current process in the waiting state and run other processes
+ * until it is woken up by sched_wake()
+ * If no process is ready, the CPU idles until one is woken up
+ * NOTE: may enable interrupts
+ */
+void sched_block();
+
+/*
+ * Switch away from the current process for the last time
+ * The process is freed once another process is running
+ * NOTE: never returns
+ */
+void sched_exit();
+
+/*
+ * Check if other processes are ready to run
+ */
+bool sched_others_ready();
+
+/*
+ * Let other ready processes run, or halt the CPU until the next
+ * interrupt if there are none
+ * Used by kernel code polling for an event. Code waiting for an
+ * interrupt should sleep on a wait queue instead, which takes the
+ * process off the ready queue
+ */
+void sched_idle();
+
+/*
+ * Called at the end of an interrupt that is returning to userspace
+ * Handles pending terminations and preemption
+ * #### Parameters:
+ *   - ctx: interrupt context
+ */
+void sched_user_return(interrupt_context_t *ctx);
+
+/*
+ * Acquire the kernel lock, running other processes while it is held
+ */
+void sched_lock_kernel();
+
+/*
+ * Release the kernel lock
+ */
+void sched_unlock_kernel();
+
+/*
+ * Check if the current process holds the kernel lock
+ */
+bool sched_holds_kernel();
+
+#endif
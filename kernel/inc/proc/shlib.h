@@ -0,0 +1,44 @@
+#ifndef _PROC_SHLIB_H
+#define _PROC_SHLIB_H 1
+
+#include <stdint.h>
+
+// Shared library support
+// Executables can request a shared library through a PT_INTERP segment
+// holding its path. The library is linked at the fixed address SHLIB_ADDR
+// and executables are linked against its symbols, so no relocation is
+// needed at exec: the image is loaded from disk once, its read-only pages
+// are mapped into every process that requests it and only its writable
+// pages are copied.
+
+// Fixed userspace address of the shared library
+// (page aligned, below the time page)
+#define SHLIB_ADDR 0xB0000000
+
+// Maximum size of the shared library image
+#define SHLIB_MAX_PAGES 64
+
+// Maximum length of the shared library path
+#define SHLIB_PATH_MAX 64
+
+/*
+ * Map a shared library into the current UVAS at SHLIB_ADDR
+ * The library is loaded the first time it is requested.
+ * Only a single shared library is supported.
+ * #### Parameters:
+ *   - path: absolute path of the library
+ * #### Returns:
+ *   0 on success, E_NOIMPL if a different library is already loaded,
+ *   other errors on failure
+ */
+int32_t shlib_map(const char *path);
+
+/*
+ * Unmap the shared pages of the shared library from the current UVAS
+ * Private (writable) pages are left in place.
+ * NOTE: must be called before the UVAS is destroyed,
+ *       so that the shared pages are not freed with it
+ */
+void shlib_unmap();
+
+#endif
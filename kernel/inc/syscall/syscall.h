@@ -12,4 +12,8 @@ void dishon_exit_from_int(interrupt_context_t *int_ctx);
 // Trigger dishonorable exit from system call context
 void dishon_exit_from_syscall();
 
+// Handle page fault in userspace, loading the page on demand
+// or terminating the process
+void page_fault_from_int(interrupt_context_t *int_ctx, void *addr);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#ifndef _WAITQ_H
+#define _WAITQ_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Wait without a timeout
+#define WAITQ_FOREVER 0
+
+// Wait queue
+// Code waiting for an event sleeps on the wait queue with the CPU halted,
+// until an interrupt handler signals it
+// Any number of processes can sleep on a wait queue, signaling it
+// wakes all of them
+typedef struct
+{
+    volatile bool signaled;
+} waitq_t;
+
+/*
+ * Initialize wait queue to the non-signaled state
+ * #### Parameters:
+ *   - wq: wait queue
+ */
+void waitq_init(waitq_t *wq);
+
+/*
+ * Reset wait queue to the non-signaled state
+ * Must be called before starting the operation that will
+ * signal the wait queue, so that the signal isn't missed
+ * #### Parameters:
+ *   - wq: wait queue
+ */
+void waitq_clear(waitq_t *wq);
+
+/*
+ * Signal wait queue, waking up all waiters
+ * The wait queue stays signaled until it is cleared, so that
+ * waits started afterwards return immediately
+ * Can be called from interrupt handlers
+ * #### Parameters:
+ *   - wq: wait queue
+ */
+void waitq_signal(waitq_t *wq);
+
+/*
+ * Sleep until the wait queue is signaled
+ * A waiter that has been woken up returns even if the wait queue is
+ * cleared before it gets to run
+ * NOTE: enables interrupts
+ * #### Parameters:
+ *   - wq: wait queue
+ *   - timeout: maximum time to wait (ms), WAITQ_FOREVER for no timeout
+ * #### Returns: false if the timeout elapsed
+ */
+bool waitq_wait(waitq_t *wq, uint32_t timeout);
+
+/*
+ * Wake up processes whose wait has timed out
+ * Called by the clock on every tick
+ * #### Parameters:
+ *   - time: current system time (ms)
+ */
+void waitq_check_timeouts(uint64_t time);
+
+/*
+ * Halt the CPU until the next interrupt, counting the time
+ * spent halted as idle time
+ * If there is pending deferred work, it is executed instead,
+ * and so is zeroing a page for the zeroed page pool
+ * When called from idle or deferred work, it only halts
+ * NOTE: enables interrupts, the work is executed with interrupts enabled
+ *       even if they were disabled by the caller
+ */
+void cpu_idle();
+
+/*
+ * Check if the CPU is currently halted in cpu_idle()
+ * Meant to be called from interrupt handlers
+ */
+bool cpu_is_idle();
+
+/*
+ * Check if idle or deferred work is running further down the stack
+ * Code running inside it can't switch processes
+ */
+bool cpu_in_idle_work();
+
+/*
+ * Make the next cpu_idle() return without halting, because
+ * a process has become ready to run or a wait queue was signaled
+ * Can be called from interrupt handlers
+ */
+void cpu_wake();
+
+#endif
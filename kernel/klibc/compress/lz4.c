@@ -0,0 +1,77 @@
+#include "compress/lz4.h"
+
+#include <stdbool.h>
+#include "string.h"
+
+#define MIN_MATCH 4
+#define LEN_EXTENDED 15
+
+// Internal functions
+static bool read_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len);
+
+int32_t lz4_decompress(const uint8_t *src, uint32_t src_n,
+                       uint8_t *dst, uint32_t dst_n)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_n;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_n;
+
+    while (ip < iend)
+    {
+        // Token: literal length (high nibble), match length (low nibble)
+        uint8_t token = *ip++;
+
+        // Copy literals
+        uint32_t len = token >> 4;
+        if (len == LEN_EXTENDED && !read_length(&ip, iend, &len))
+            return -1;
+        if (len > (uint32_t)(iend - ip) || len > (uint32_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        // Match offset (little endian)
+        if (iend - ip < 2)
+            return -1;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst))
+            return -1;
+
+        // Match length
+        len = token & 0xF;
+        if (len == LEN_EXTENDED && !read_length(&ip, iend, &len))
+            return -1;
+        len += MIN_MATCH;
+        if (len > (uint32_t)(oend - op))
+            return -1;
+
+        // Copy match byte by byte, as it can overlap the output
+        const uint8_t *match = op - offset;
+        while (len--)
+            *op++ = *match++;
+    }
+
+    return op - dst;
+}
+
+// Read the extension bytes of a literal or match length
+static bool read_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return true;
+}
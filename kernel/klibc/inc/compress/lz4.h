@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// LZ4 block format decompressor
+// (raw blocks, without the LZ4 frame header)
+
+/*
+ * Decompress an LZ4 block
+ * #### Parameters:
+ *   - src: compressed data
+ *   - src_n: size of the compressed data
+ *   - dst: output buffer
+ *   - dst_n: size of the output buffer
+ * #### Returns:
+ *   number of bytes written to dst, -1 if the data is malformed
+ *   or doesn't fit in the output buffer
+ */
+int32_t lz4_decompress(const uint8_t *src, uint32_t src_n,
+                       uint8_t *dst, uint32_t dst_n);
@@ -2,6 +2,7 @@
 #define _STRING_H 1
 
 #include <stddef.h>
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C"
 {
@@ -15,6 +16,10 @@ extern "C"
     int strcmp(const char *p1, const char *p2);
     char *strcpy(char *dst, const char *src);
 
+    // FNV-1a hash of a string, for hash tables
+    // The seed is mixed into the initial value, 0 for a plain string hash
+    uint32_t strhash(const char *str, uint32_t seed);
+
 #ifdef __cplusplus
 }
 #endif
@@ -90,4 +90,16 @@ char *strcpy(char *dst, const char *src)
     uint32_t n = strlen(src);
     memcpy(dst, src, n + 1);
     return dst;
-}
\ No newline at end of file
+}
+
+uint32_t strhash(const char *str, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    while (*str)
+    {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
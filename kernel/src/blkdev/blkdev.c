@@ -6,6 +6,10 @@
 #include "mem/kalloc.h"
 #include "panic.h"
 #include "log.h"
+#include "clock.h"
+#include "proc/sched.h"
+#include "int/interrupts.h"
+#include "mem/const.h"
 
 // Configure debugging
 #if DEBUG_BLKDEV == 1
@@ -15,6 +19,16 @@
 // Maximum number of active block device handles
 #define MAX_HANDLES 4
 
+// Number of hash buckets of the buffer cache (power of 2)
+#define CACHE_BUCKETS 64
+
+// Maximum number of scatter list entries of a merged request group
+#define MERGE_SG_MAX 32
+
+// Number of clean buffers prefetching leaves for blocks which are
+// actually needed
+#define PREFETCH_RESERVE 4
+
 // Node in the device list
 typedef struct
 {
@@ -22,6 +36,11 @@ typedef struct
 
     // There currently is a handle to this device
     bool used;
+
+    // Request queue
+    // Groups of merged requests, sorted by starting block
+    blkdev_req_t *queue;
+    uint32_t queue_pos; // Block after the last dispatched group
 } devlst_entry_t;
 
 // Device handle slot
@@ -36,15 +55,74 @@ static devlst_entry_t *find_by_major(const char *major);
 static blkdev_handle_t find_handle();
 static inline size_t handle_to_index(const blkdev_handle_t handle);
 static inline blkdev_handle_t slot_to_handle(size_t idx);
+static devlst_entry_t *handle_entry(const blkdev_handle_t handle);
+static bool dev_read(devlst_entry_t *entry, uint8_t *buf, uint32_t block);
+static bool dev_rw_sync(devlst_entry_t *entry, blkdev_op_t op, uint32_t start,
+                        const blkdev_sg_t *sg, uint32_t n_sg);
+static bool driver_rw(blkdev_t *dev, blkdev_op_t op, uint32_t start,
+                      const blkdev_sg_t *sg, uint32_t n_sg);
+static uint32_t sg_blocks(const blkdev_sg_t *sg, uint32_t n_sg);
+static void queue_insert(devlst_entry_t *entry, blkdev_req_t *req);
+static bool queue_dispatch(devlst_entry_t *entry);
+static void complete_req(blkdev_req_t *req, bool success, uint64_t now);
+static void cache_init();
+static inline size_t cache_hash(blkdev_handle_t handle, uint32_t block);
+static blkdev_buf_t *cache_lookup(blkdev_handle_t handle, uint32_t block);
+static blkdev_buf_t *cache_lookup_ready(blkdev_handle_t handle, uint32_t block);
+static void cache_unhash(blkdev_buf_t *buf);
+static void lru_remove(blkdev_buf_t *buf);
+static void lru_insert_head(blkdev_buf_t *buf);
+static void lru_insert_tail(blkdev_buf_t *buf);
+static void cache_invalidate(blkdev_handle_t handle);
+static void cache_discard_dirty(blkdev_handle_t handle);
+static blkdev_buf_t *cache_alloc(blkdev_handle_t handle, uint32_t block);
+static blkdev_buf_t *cache_take();
+static uint32_t cache_count_clean();
+static void cache_insert(blkdev_buf_t *buf, blkdev_handle_t handle, uint32_t block);
+static bool flush(blkdev_handle_t handle);
+static bool flush_submit(blkdev_handle_t handle, bool *pending);
+static bool flush_wait(blkdev_handle_t handle);
+static void flush_done(blkdev_req_t *req, bool success);
+static void flush_timer_cb(void *data);
+static void prefetch_done(blkdev_req_t *req, bool success);
 
 // Global objects
 dllist_t dev_list;                  // Registered devices list
 handle_slot_t handles[MAX_HANDLES]; // Block device handles
 
+// Buffer cache
+// Unused buffers are kept in LRU order: eviction takes from the head,
+// released buffers go to the tail. Invalid buffers are put at the head
+// so that they are reused first
+static blkdev_buf_t cache_bufs[BLKDEV_CACHE_SIZE];
+static blkdev_buf_t *cache_buckets[CACHE_BUCKETS];
+static blkdev_buf_t *lru_head = NULL, *lru_tail = NULL;
+static blkdev_cache_stats_t cache_stats;
+
+// Asynchronous buffer requests (write-back and prefetch)
+// Each buffer has its own request, adjacent ones are merged by the queue
+static blkdev_req_t buf_reqs[BLKDEV_CACHE_SIZE];
+static blkdev_sg_t buf_sg[BLKDEV_CACHE_SIZE];
+
+// Write-back of dirty buffers
+// The timer flags the flush, which is started right away if no kernel
+// code was interrupted, or else when the CPU is idle
+static bool flush_timer_set = false;
+static volatile bool flush_pending = false;
+
+// Request queues
+// Drivers aren't reentrant, so only one request is handed to a driver
+// at a time, across all devices
+static bool dispatching = false;
+static blkdev_queue_stats_t queue_stats;
+
 void blkdev_init()
 {
     // Initialize device list
     dllist_init(&dev_list);
+
+    // Initialize buffer cache
+    cache_init();
 }
 
 bool blkdev_register(blkdev_t dev)
@@ -61,6 +139,8 @@ bool blkdev_register(blkdev_t dev)
     // Set entry
     entry->dev = dev;
     entry->used = false;
+    entry->queue = NULL;
+    entry->queue_pos = 0;
 
     // Add to device list
     dllist_insert_tail(&dev_list, (void *)entry);
@@ -98,12 +178,36 @@ blkdev_handle_t blkdev_get_handle(const char *major)
     return handle;
 }
 
+uint32_t blkdev_get_nblocks(const blkdev_handle_t handle)
+{
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
+        return 0;
+
+    return entry->dev.nblocks;
+}
+
 void blkdev_release_handle(blkdev_handle_t handle)
 {
     if (handle == BLKDEV_HANDLE_NULL)
         return;
 
     size_t idx = handle_to_index(handle);
+
+    // Write back modified blocks
+    blkdev_sync(handle);
+
+    // Complete outstanding requests
+    devlst_entry_t *entry = handles[idx].devlst_entry;
+    while (entry->queue)
+    {
+        if (dispatching || !queue_dispatch(entry))
+            sched_idle();
+    }
+
+    // Cached blocks can't be matched to the handle anymore
+    cache_invalidate(handle);
+
     handles[idx].used = false;
     handles[idx].devlst_entry->used = false;
 
@@ -115,17 +219,22 @@ void blkdev_release_handle(blkdev_handle_t handle)
 bool blkdev_read(uint8_t *buf, const blkdev_handle_t handle,
                  const uint32_t block)
 {
-    if (handle == BLKDEV_HANDLE_NULL)
+    blkdev_buf_t *cbuf = blkdev_get_buf(handle, block);
+    if (!cbuf)
         return false;
 
-    size_t idx = handle_to_index(handle);
+    memcpy(buf, cbuf->data, BLOCK_SIZE);
+    blkdev_release_buf(cbuf);
 
-    // Check handle validity
-    if (idx >= MAX_HANDLES || !handles[idx].used)
-        return false;
+    return true;
+}
 
-    // Get device
-    blkdev_t *dev = &handles[idx].devlst_entry->dev;
+blkdev_buf_t *blkdev_get_buf(const blkdev_handle_t handle, const uint32_t block)
+{
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
+        return NULL;
+    blkdev_t *dev = &entry->dev;
 
 #ifdef DEBUG
     kprintf("[BLKDEV] Device %s (handle %d), read block %d\n", dev->major, handle, block);
@@ -133,57 +242,325 @@ bool blkdev_read(uint8_t *buf, const blkdev_handle_t handle,
 
     // Check block in range
     if (block >= dev->nblocks)
-        return false;
+        return NULL;
 
-    // Check if device supports reading
-    if (dev->read_blk == NULL)
+    // Cache hit
+    blkdev_buf_t *buf = cache_lookup_ready(handle, block);
+    if (buf)
+    {
+        if (buf->refs++ == 0)
+            lru_remove(buf);
+        cache_stats.hits++;
+        return buf;
+    }
+
+    if (!(buf = cache_alloc(handle, block)))
+        return NULL;
+    cache_stats.misses++;
+
+    // Read block from the device
+    if (!dev_read(entry, buf->data, block))
+    {
+        cache_unhash(buf);
+        buf->valid = false;
+        blkdev_release_buf(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+blkdev_buf_t *blkdev_get_new_buf(const blkdev_handle_t handle, const uint32_t block)
+{
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
+        return NULL;
+
+    // Check block in range
+    if (block >= entry->dev.nblocks)
+        return NULL;
+
+    // Cached contents are going to be overwritten anyway
+    blkdev_buf_t *buf = cache_lookup_ready(handle, block);
+    if (buf)
+    {
+        if (buf->refs++ == 0)
+            lru_remove(buf);
+        return buf;
+    }
+
+    return cache_alloc(handle, block);
+}
+
+void blkdev_mark_dirty(blkdev_buf_t *buf)
+{
+    if (!buf->valid)
+        return;
+
+    buf->dirty = true;
+
+    // Writes made before the timer expires are flushed together
+    if (!flush_timer_set)
+    {
+        if (clock_set_timer(BLKDEV_FLUSH_DELAY, TIMER_ONESHOT, flush_timer_cb, NULL) >= 0)
+            flush_timer_set = true;
+        else
+            flush_pending = true;
+    }
+}
+
+bool blkdev_sync(const blkdev_handle_t handle)
+{
+    if (!handle_entry(handle))
         return false;
 
-    // Perform read operation
-    return dev->read_blk(dev, buf, block);
+    return flush(handle);
+}
+
+bool blkdev_sync_all()
+{
+    return flush(BLKDEV_HANDLE_NULL);
+}
+
+void blkdev_release_buf(blkdev_buf_t *buf)
+{
+    if (!buf || !buf->refs)
+        return;
+
+    if (--buf->refs)
+        return;
+
+    // Most recently used
+    if (buf->valid)
+        lru_insert_tail(buf);
+    else
+        lru_insert_head(buf);
+}
+
+uint32_t blkdev_prefetch(const blkdev_handle_t handle, const uint32_t start,
+                         const uint32_t n)
+{
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry || start >= entry->dev.nblocks)
+        return 0;
+
+    // Clamp with device size
+    uint32_t end = n > entry->dev.nblocks - start ? entry->dev.nblocks : start + n;
+
+    // Don't write back modified blocks just to read ahead
+    uint32_t avail = cache_count_clean();
+
+    uint32_t block;
+    for (block = start; block < end; block++)
+    {
+        if (cache_lookup(handle, block))
+            continue;
+
+        if (avail <= PREFETCH_RESERVE)
+            break;
+        avail--;
+
+        blkdev_buf_t *buf = cache_take();
+        if (!buf)
+            break;
+        cache_insert(buf, handle, block);
+
+        // The buffer is held until the read completes
+        size_t idx = buf - cache_bufs;
+        blkdev_req_t *req = &buf_reqs[idx];
+        buf_sg[idx].buf = buf->data;
+        buf_sg[idx].n = 1;
+        req->op = BLKDEV_REQ_READ;
+        req->start = block;
+        req->sg = &buf_sg[idx];
+        req->n_sg = 1;
+        req->cb = prefetch_done;
+        req->data = buf;
+        buf->reading = true;
+        if (!blkdev_submit(handle, req))
+        {
+            buf->reading = false;
+            cache_unhash(buf);
+            buf->valid = false;
+            blkdev_release_buf(buf);
+            break;
+        }
+
+        cache_stats.prefetched++;
+    }
+
+    return block - start;
 }
 
 bool blkdev_read_n(uint8_t *buf, const blkdev_handle_t handle,
                    const uint32_t start, const uint32_t n)
 {
-    for (uint32_t i = 0; i < n; i++)
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
+        return false;
+    blkdev_t *dev = &entry->dev;
+
+    // Check blocks in range
+    if (start >= dev->nblocks || n > dev->nblocks - start)
+        return false;
+
+    uint32_t i = 0;
+    while (i < n)
     {
-        if (!blkdev_read(buf + i * BLOCK_SIZE, handle, start + i))
+        // Don't let bulk reads wipe out the cache,
+        // only use blocks which are already in it
+        blkdev_buf_t *cbuf = cache_lookup_ready(handle, start + i);
+        if (cbuf)
+        {
+            memcpy(buf + i * BLOCK_SIZE, cbuf->data, BLOCK_SIZE);
+            cache_stats.hits++;
+            i++;
+            continue;
+        }
+
+        // Read run of blocks which are not cached with a single request
+        uint32_t run = 1;
+        while (i + run < n && !cache_lookup(handle, start + i + run))
+            run++;
+
+        blkdev_sg_t sg = {.buf = buf + i * BLOCK_SIZE, .n = run};
+        if (!dev_rw_sync(entry, BLKDEV_REQ_READ, start + i, &sg, 1))
             return false;
+
+        i += run;
     }
 
     return true;
 }
 
-bool blkdev_write(const uint8_t *buf, const blkdev_handle_t handle,
-                  const uint32_t block)
+bool blkdev_read_sg(const blkdev_handle_t handle, const uint32_t start,
+                    const blkdev_sg_t *sg, const uint32_t n_sg)
 {
-    if (handle == BLKDEV_HANDLE_NULL)
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
         return false;
 
-    size_t idx = handle_to_index(handle);
-
-    // Check handle validity
-    if (idx >= MAX_HANDLES || !handles[idx].used)
+    // Check blocks in range
+    uint32_t n = sg_blocks(sg, n_sg);
+    if (start >= entry->dev.nblocks || n > entry->dev.nblocks - start)
         return false;
 
-    // Get device
-    blkdev_t *dev = &handles[idx].devlst_entry->dev;
+    return dev_rw_sync(entry, BLKDEV_REQ_READ, start, sg, n_sg);
+}
+
+bool blkdev_write_sg(const blkdev_handle_t handle, const uint32_t start,
+                     const blkdev_sg_t *sg, const uint32_t n_sg)
+{
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
+        return false;
+    blkdev_t *dev = &entry->dev;
 
 #ifdef DEBUG
-    kprintf("[BLKDEV] Device %s (handle %d), write block %d\n", dev->major, handle, block);
+    kprintf("[BLKDEV] Device %s (handle %d), write from block %d\n", dev->major, handle, start);
 #endif
 
-    // Check block in range
-    if (block >= dev->nblocks)
+    // Check blocks in range
+    uint32_t n = sg_blocks(sg, n_sg);
+    if (start >= dev->nblocks || n > dev->nblocks - start)
         return false;
 
-    // Check if device supports writing
-    if (dev->write_blk == NULL)
+    // Perform write operation
+    if (!dev_rw_sync(entry, BLKDEV_REQ_WRITE, start, sg, n_sg))
+        return false;
+
+    // Keep cached copies up to date
+    uint32_t block = start;
+    for (uint32_t i = 0; i < n_sg; i++)
+    {
+        for (uint32_t j = 0; j < sg[i].n; j++, block++)
+        {
+            blkdev_buf_t *cbuf = cache_lookup_ready(handle, block);
+            if (cbuf)
+            {
+                memcpy(cbuf->data, sg[i].buf + j * BLOCK_SIZE, BLOCK_SIZE);
+                cbuf->dirty = false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool blkdev_write_n(const uint8_t *buf, const blkdev_handle_t handle,
+                    const uint32_t start, const uint32_t n)
+{
+    // The scatter list is only read from on writes
+    blkdev_sg_t sg = {.buf = (uint8_t *)buf, .n = n};
+    return blkdev_write_sg(handle, start, &sg, 1);
+}
+
+bool blkdev_write(const uint8_t *buf, const blkdev_handle_t handle,
+                  const uint32_t block)
+{
+    return blkdev_write_n(buf, handle, block, 1);
+}
+
+bool blkdev_submit(const blkdev_handle_t handle, blkdev_req_t *req)
+{
+    devlst_entry_t *entry = handle_entry(handle);
+    if (!entry)
+        return false;
+
+    // Check blocks in range
+    req->n = sg_blocks(req->sg, req->n_sg);
+    if (!req->n || req->start >= entry->dev.nblocks ||
+        req->n > entry->dev.nblocks - req->start)
+        return false;
+
+    queue_insert(entry, req);
+    return true;
+}
+
+bool blkdev_wait(blkdev_req_t *req)
+{
+    devlst_entry_t *entry = req->queue;
+
+    while (!req->done)
+    {
+        // Another request is in the hands of a driver,
+        // let it finish
+        if (dispatching || !queue_dispatch(entry))
+            sched_idle();
+    }
+
+    return req->success;
+}
+
+bool blkdev_run_queues()
+{
+    if (dispatching)
         return false;
 
-    // Perform read operation
-    return dev->write_blk(dev, buf, block);
+    // Flush delay expired
+    if (flush_pending)
+    {
+        bool pending;
+        flush_pending = false;
+        flush_submit(BLKDEV_HANDLE_NULL, &pending);
+    }
+
+    dllist_node_t *cur = dllist_head(&dev_list);
+    while (cur != NULL)
+    {
+        devlst_entry_t *entry = dllist_data(cur);
+        if (queue_dispatch(entry))
+            return true;
+
+        cur = dllist_next(cur);
+    }
+
+    return false;
+}
+
+void blkdev_get_queue_stats(blkdev_queue_stats_t *out)
+{
+    *out = queue_stats;
 }
 
 bool blkdev_media_changed(const blkdev_handle_t handle)
@@ -204,8 +581,18 @@ bool blkdev_media_changed(const blkdev_handle_t handle)
     if (dev->media_changed == NULL)
         return false;
 
-    // Perform read operation
-    return dev->media_changed(dev);
+    // Cached blocks belong to the old media
+    if (!dev->media_changed(dev))
+        return false;
+
+    cache_discard_dirty(handle);
+    cache_invalidate(handle);
+    return true;
+}
+
+void blkdev_get_cache_stats(blkdev_cache_stats_t *out)
+{
+    *out = cache_stats;
 }
 
 /* Internal functions */
@@ -250,6 +637,599 @@ static inline blkdev_handle_t slot_to_handle(size_t idx)
     return idx + 1;
 }
 
+// Get the device list entry of a handle, NULL if the handle is not valid
+static devlst_entry_t *handle_entry(const blkdev_handle_t handle)
+{
+    if (handle == BLKDEV_HANDLE_NULL)
+        return NULL;
+
+    size_t idx = handle_to_index(handle);
+
+    // Check handle validity
+    if (idx >= MAX_HANDLES || !handles[idx].used)
+        return NULL;
+
+    return handles[idx].devlst_entry;
+}
+
+// Read a block from the device
+static bool dev_read(devlst_entry_t *entry, uint8_t *buf, uint32_t block)
+{
+    blkdev_sg_t sg = {.buf = buf, .n = 1};
+    return dev_rw_sync(entry, BLKDEV_REQ_READ, block, &sg, 1);
+}
+
+// Synchronous wrapper over the request queue
+// The blocks must have been checked to be in range
+static bool dev_rw_sync(devlst_entry_t *entry, blkdev_op_t op, uint32_t start,
+                        const blkdev_sg_t *sg, uint32_t n_sg)
+{
+    blkdev_req_t req = {
+        .op = op,
+        .start = start,
+        .sg = sg,
+        .n_sg = n_sg,
+        .cb = NULL,
+        .data = NULL,
+    };
+    req.n = sg_blocks(sg, n_sg);
+
+    queue_insert(entry, &req);
+    return blkdev_wait(&req);
+}
+
+// Hand a request to the driver
+// Falls back to one driver call per block if the driver doesn't
+// support multi-block operations
+static bool driver_rw(blkdev_t *dev, blkdev_op_t op, uint32_t start,
+                      const blkdev_sg_t *sg, uint32_t n_sg)
+{
+    if (op == BLKDEV_REQ_READ && dev->read_blks)
+        return dev->read_blks(dev, sg, n_sg, start);
+    if (op == BLKDEV_REQ_WRITE && dev->write_blks)
+        return dev->write_blks(dev, sg, n_sg, start);
+
+    // Check if device supports the operation
+    if ((op == BLKDEV_REQ_READ && dev->read_blk == NULL) ||
+        (op == BLKDEV_REQ_WRITE && dev->write_blk == NULL))
+        return false;
+
+    for (uint32_t i = 0; i < n_sg; i++)
+    {
+        for (uint32_t j = 0; j < sg[i].n; j++, start++)
+        {
+            uint8_t *buf = sg[i].buf + j * BLOCK_SIZE;
+            if (op == BLKDEV_REQ_READ ? !dev->read_blk(dev, buf, start)
+                                      : !dev->write_blk(dev, buf, start))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Total number of blocks in a scatter list
+static uint32_t sg_blocks(const blkdev_sg_t *sg, uint32_t n_sg)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < n_sg; i++)
+        n += sg[i].n;
+
+    return n;
+}
+
+// Add a request to the queue of a device, merging it with an adjacent
+// group of requests of the same kind if possible
+static void queue_insert(devlst_entry_t *entry, blkdev_req_t *req)
+{
+    req->done = false;
+    req->success = false;
+    req->next = NULL;
+    req->merged = NULL;
+    req->group_n = req->n;
+    req->group_sg = req->n_sg;
+    req->submit_time = clock_get_system();
+    req->queue = entry;
+
+    if (++queue_stats.depth > queue_stats.max_depth)
+        queue_stats.max_depth = queue_stats.depth;
+
+    // Find position in the queue
+    // Requests for the same block stay in submission order
+    blkdev_req_t *prev = NULL, *cur = entry->queue;
+    while (cur && cur->start <= req->start)
+    {
+        prev = cur;
+        cur = cur->next;
+    }
+
+    // Append to the previous group
+    if (prev && prev->op == req->op && prev->start + prev->group_n == req->start &&
+        prev->group_sg + req->n_sg <= MERGE_SG_MAX)
+    {
+        blkdev_req_t *last = prev;
+        while (last->merged)
+            last = last->merged;
+
+        last->merged = req;
+        prev->group_n += req->n;
+        prev->group_sg += req->n_sg;
+        queue_stats.merged++;
+        return;
+    }
+
+    // Prepend to the next group
+    if (cur && cur->op == req->op && req->start + req->n == cur->start &&
+        cur->group_sg + req->n_sg <= MERGE_SG_MAX)
+    {
+        req->merged = cur;
+        req->next = cur->next;
+        req->group_n += cur->group_n;
+        req->group_sg += cur->group_sg;
+        queue_stats.merged++;
+    }
+    else
+        req->next = cur;
+
+    if (prev)
+        prev->next = req;
+    else
+        entry->queue = req;
+}
+
+// Hand the next group of requests of a device to its driver
+// C-SCAN: groups are served in increasing block order starting from
+// the end of the last one, wrapping around to the lowest block.
+// For the FDC, block order is cylinder order
+// Returns false if the queue is empty
+static bool queue_dispatch(devlst_entry_t *entry)
+{
+    // Find next group at or after the current position
+    blkdev_req_t *prev = NULL, *group = entry->queue;
+    while (group && group->start < entry->queue_pos)
+    {
+        prev = group;
+        group = group->next;
+    }
+
+    // Wrap around
+    if (!group)
+    {
+        prev = NULL;
+        group = entry->queue;
+    }
+
+    if (!group)
+        return false;
+
+    // Remove group from the queue
+    if (prev)
+        prev->next = group->next;
+    else
+        entry->queue = group->next;
+    entry->queue_pos = group->start + group->group_n;
+
+    // Join the scatter lists of merged requests
+    const blkdev_sg_t *sg = group->sg;
+    uint32_t n_sg = group->n_sg;
+    blkdev_sg_t group_sg[MERGE_SG_MAX];
+    if (group->merged)
+    {
+        n_sg = 0;
+        for (blkdev_req_t *req = group; req; req = req->merged)
+        {
+            for (uint32_t i = 0; i < req->n_sg; i++)
+                group_sg[n_sg++] = req->sg[i];
+        }
+        sg = group_sg;
+    }
+
+#ifdef DEBUG
+    kprintf("[BLKDEV] Dispatch %s: blocks %u-%u\n", entry->dev.major,
+            group->start, group->start + group->group_n - 1);
+#endif
+
+    dispatching = true;
+    bool success = driver_rw(&entry->dev, group->op, group->start, sg, n_sg);
+    dispatching = false;
+    queue_stats.dispatches++;
+
+    // Complete all requests of the group
+    uint64_t now = clock_get_system();
+    blkdev_req_t *req = group;
+    while (req)
+    {
+        blkdev_req_t *next = req->merged;
+        complete_req(req, success, now);
+        req = next;
+    }
+
+    return true;
+}
+
+// Mark request as complete and notify the submitter
+// The request may be freed by the callback
+static void complete_req(blkdev_req_t *req, bool success, uint64_t now)
+{
+    uint32_t latency = now - req->submit_time;
+    queue_stats.depth--;
+    queue_stats.completed++;
+    queue_stats.total_latency += latency;
+    if (latency > queue_stats.max_latency)
+        queue_stats.max_latency = latency;
+
+    req->success = success;
+    req->done = true;
+
+    if (req->cb)
+        req->cb(req, success);
+}
+
+// Allocate cache buffers and put them all in the LRU list
+static void cache_init()
+{
+    uint8_t *data = kalloc(BLKDEV_CACHE_SIZE * BLOCK_SIZE);
+    if (!data)
+        panic("BLKDEV_INIT_NOMEM", "Out of memory while allocating the buffer cache");
+
+    for (size_t i = 0; i < BLKDEV_CACHE_SIZE; i++)
+    {
+        blkdev_buf_t *buf = &cache_bufs[i];
+        buf->data = data + i * BLOCK_SIZE;
+        buf->valid = false;
+        buf->dirty = false;
+        buf->writing = false;
+        buf->reading = false;
+        buf->refs = 0;
+        buf->hash_next = NULL;
+        lru_insert_tail(buf);
+    }
+}
+
+static inline size_t cache_hash(blkdev_handle_t handle, uint32_t block)
+{
+    return (block * 31 + handle) & (CACHE_BUCKETS - 1);
+}
+
+// Find the buffer holding a block, NULL if it isn't cached
+static blkdev_buf_t *cache_lookup(blkdev_handle_t handle, uint32_t block)
+{
+    blkdev_buf_t *buf = cache_buckets[cache_hash(handle, block)];
+    while (buf && (buf->handle != handle || buf->block != block))
+        buf = buf->hash_next;
+
+    return buf;
+}
+
+// Find the buffer holding a block, waiting for it to be read if it is
+// being prefetched. NULL if the block isn't cached
+static blkdev_buf_t *cache_lookup_ready(blkdev_handle_t handle, uint32_t block)
+{
+    blkdev_buf_t *buf = cache_lookup(handle, block);
+    if (buf && buf->reading)
+    {
+        blkdev_wait(&buf_reqs[buf - cache_bufs]);
+
+        // The block is dropped if the read failed
+        buf = cache_lookup(handle, block);
+    }
+
+    return buf;
+}
+
+// Remove a buffer from its hash chain
+static void cache_unhash(blkdev_buf_t *buf)
+{
+    blkdev_buf_t **cur = &cache_buckets[cache_hash(buf->handle, buf->block)];
+    while (*cur && *cur != buf)
+        cur = &(*cur)->hash_next;
+
+    if (*cur)
+        *cur = buf->hash_next;
+    buf->hash_next = NULL;
+}
+
+static void lru_remove(blkdev_buf_t *buf)
+{
+    if (buf->lru_prev)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        lru_head = buf->lru_next;
+
+    if (buf->lru_next)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        lru_tail = buf->lru_prev;
+}
+
+static void lru_insert_head(blkdev_buf_t *buf)
+{
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = buf;
+    else
+        lru_tail = buf;
+    lru_head = buf;
+}
+
+static void lru_insert_tail(blkdev_buf_t *buf)
+{
+    buf->lru_next = NULL;
+    buf->lru_prev = lru_tail;
+    if (lru_tail)
+        lru_tail->lru_next = buf;
+    else
+        lru_head = buf;
+    lru_tail = buf;
+}
+
+// Drop all cached blocks of a handle
+// Modified blocks must have been written back or discarded
+static void cache_invalidate(blkdev_handle_t handle)
+{
+    for (size_t i = 0; i < BLKDEV_CACHE_SIZE; i++)
+    {
+        blkdev_buf_t *buf = &cache_bufs[i];
+        if (!buf->valid || buf->handle != handle)
+            continue;
+
+        // Would be written back to whatever device gets the handle next
+        if (buf->dirty)
+            panic("BLKDEV_INVALIDATE_DIRTY", "Dropping modified cached block");
+
+        cache_unhash(buf);
+        buf->valid = false;
+        buf->dirty = false;
+
+        // Buffers in use are moved when they are released
+        if (!buf->refs)
+        {
+            lru_remove(buf);
+            lru_insert_head(buf);
+        }
+    }
+}
+
+// Forget the modifications of the cached blocks of a handle
+// Used when they can't be written back anymore
+static void cache_discard_dirty(blkdev_handle_t handle)
+{
+    uint32_t lost = 0;
+    for (size_t i = 0; i < BLKDEV_CACHE_SIZE; i++)
+    {
+        blkdev_buf_t *buf = &cache_bufs[i];
+        if (!buf->valid || !buf->dirty || buf->handle != handle)
+            continue;
+
+        buf->dirty = false;
+        lost++;
+    }
+
+    if (lost)
+    {
+        kprintf("[BLKDEV] Media changed, %u modified blocks lost\n", lost);
+        cache_stats.write_errors += lost;
+    }
+}
+
+// Get a buffer for a block which isn't cached, with one reference
+// Contents are undefined
+static blkdev_buf_t *cache_alloc(blkdev_handle_t handle, uint32_t block)
+{
+    blkdev_buf_t *buf = cache_take();
+
+    // All unused buffers are dirty, write them back to make room
+    if (!buf)
+    {
+        blkdev_sync_all();
+        buf = cache_take();
+    }
+
+    // The rest are held until prefetched blocks are read
+    if (!buf)
+    {
+        for (size_t i = 0; i < BLKDEV_CACHE_SIZE; i++)
+        {
+            if (cache_bufs[i].reading)
+                blkdev_wait(&buf_reqs[i]);
+        }
+
+        if (!(buf = cache_take()))
+            return NULL;
+    }
+
+    cache_insert(buf, handle, block);
+    return buf;
+}
+
+// Take the least recently used clean buffer out of the LRU list
+static blkdev_buf_t *cache_take()
+{
+    blkdev_buf_t *buf = lru_head;
+    while (buf && buf->dirty)
+        buf = buf->lru_next;
+
+    if (buf)
+        lru_remove(buf);
+
+    return buf;
+}
+
+// Number of clean buffers in the LRU list
+static uint32_t cache_count_clean()
+{
+    uint32_t n = 0;
+    for (blkdev_buf_t *buf = lru_head; buf; buf = buf->lru_next)
+    {
+        if (!buf->dirty)
+            n++;
+    }
+
+    return n;
+}
+
+// Assign a buffer taken out of the LRU list to a block, with one reference
+static void cache_insert(blkdev_buf_t *buf, blkdev_handle_t handle, uint32_t block)
+{
+    if (buf->valid)
+    {
+        cache_unhash(buf);
+        cache_stats.evictions++;
+    }
+
+    // Add to hash table
+    size_t bucket = cache_hash(handle, block);
+    buf->handle = handle;
+    buf->block = block;
+    buf->valid = true;
+    buf->dirty = false;
+    buf->refs = 1;
+    buf->hash_next = cache_buckets[bucket];
+    cache_buckets[bucket] = buf;
+}
+
+// Write back the dirty buffers of a handle, or of all handles if
+// BLKDEV_HANDLE_NULL, and wait for the writes to complete
+// Buffers modified while their write was in flight are written again
+static bool flush(blkdev_handle_t handle)
+{
+    bool success = true, pending = true;
+    while (pending)
+    {
+        if (!flush_submit(handle, &pending))
+            success = false;
+        if (!flush_wait(handle))
+            success = false;
+    }
+
+    return success;
+}
+
+// Queue writes of the dirty buffers of a handle, or of all handles if
+// BLKDEV_HANDLE_NULL. Buffers are held until their write completes
+// Buffers which are already being written are skipped, and have to be
+// submitted again once the write completes if they are still dirty
+// pending is set if any buffer was submitted or skipped
+// Returns false if a write couldn't be submitted
+static bool flush_submit(blkdev_handle_t handle, bool *pending)
+{
+    bool success = true;
+    *pending = false;
+    for (size_t i = 0; i < BLKDEV_CACHE_SIZE; i++)
+    {
+        blkdev_buf_t *buf = &cache_bufs[i];
+        if (!buf->dirty ||
+            (handle != BLKDEV_HANDLE_NULL && buf->handle != handle))
+            continue;
+
+        *pending = true;
+        if (buf->writing)
+            continue;
+
+        blkdev_req_t *req = &buf_reqs[i];
+        buf_sg[i].buf = buf->data;
+        buf_sg[i].n = 1;
+        req->op = BLKDEV_REQ_WRITE;
+        req->start = buf->block;
+        req->sg = &buf_sg[i];
+        req->n_sg = 1;
+        req->cb = flush_done;
+        req->data = buf;
+        if (!blkdev_submit(buf->handle, req))
+        {
+            success = false;
+            continue;
+        }
+
+        // Modifications made from now on need another write
+        buf->dirty = false;
+        buf->writing = true;
+        if (buf->refs++ == 0)
+            lru_remove(buf);
+    }
+
+    return success;
+}
+
+// Wait for the writes of a handle, or of all handles if
+// BLKDEV_HANDLE_NULL, to complete
+static bool flush_wait(blkdev_handle_t handle)
+{
+    bool success = true;
+    for (size_t i = 0; i < BLKDEV_CACHE_SIZE; i++)
+    {
+        blkdev_buf_t *buf = &cache_bufs[i];
+        if (!buf->writing ||
+            (handle != BLKDEV_HANDLE_NULL && buf->handle != handle))
+            continue;
+
+        if (!blkdev_wait(&buf_reqs[i]))
+            success = false;
+    }
+
+    return success;
+}
+
+// Write of a dirty buffer completed
+static void flush_done(blkdev_req_t *req, bool success)
+{
+    blkdev_buf_t *buf = req->data;
+    buf->writing = false;
+
+    if (success)
+        cache_stats.flushed++;
+    else
+    {
+        // Retrying would fail again, drop the modified block
+        kprintf("[BLKDEV] Write error, block %u lost\n", buf->block);
+        cache_stats.write_errors++;
+        if (buf->valid)
+        {
+            cache_unhash(buf);
+            buf->valid = false;
+            buf->dirty = false;
+        }
+    }
+
+    blkdev_release_buf(buf);
+}
+
+// Called by the clock subsystem from the timer work queue
+static void flush_timer_cb(void *data)
+{
+    (void)data;
+
+    flush_timer_set = false;
+    flush_pending = true;
+
+    // Kernel code only runs until it yields, so if userspace was
+    // interrupted the block layer isn't in use and the writes can be
+    // made right away. A busy CPU may not go idle for a long time
+    interrupt_context_t *ctx = interrupt_get_cur_ctx();
+    if (ctx && (ctx->cs & 3) == SEGSEL_USER)
+    {
+        while (blkdev_run_queues())
+            ;
+    }
+}
+
+// Read of a prefetched buffer completed
+static void prefetch_done(blkdev_req_t *req, bool success)
+{
+    blkdev_buf_t *buf = req->data;
+    buf->reading = false;
+
+    // Drop the block, it is read again when needed
+    if (!success && buf->valid)
+    {
+        cache_unhash(buf);
+        buf->valid = false;
+    }
+
+    blkdev_release_buf(buf);
+}
+
 void blkdev_debug_devices()
 {
     kprintf("[BLKDEV] Registered devices:\n");
@@ -15,6 +15,7 @@
 static void mb_setup_boot_info(multiboot_info_t *mbd);
 static void mb_setup_boot_info_physmmap(multiboot_memory_map_t *mmap, uint32_t n);
 static void mb_add_physmmap_entry(uint32_t start, uint32_t size);
+static void mb_setup_boot_info_modules(multiboot_module_t *mods, uint32_t n);
 
 /* Public functions */
 
@@ -22,8 +23,11 @@ void mb_read_data(multiboot_info_t *mbd_phys)
 {
     void *mmap_addr;
     uint32_t mmap_length;
+    void *mods_addr = NULL;
+    uint32_t mods_count = 0;
     multiboot_info_t *mbd;
     multiboot_memory_map_t *mmap;
+    multiboot_module_t *mods;
 
     kprintf("Reading multiboot data...\n");
 
@@ -42,6 +46,13 @@ void mb_read_data(multiboot_info_t *mbd_phys)
     mmap_addr = (void *)mbd->mmap_addr;
     mmap_length = mbd->mmap_length;
 
+    // Read module list location
+    if (mbd->flags & MULTIBOOT_INFO_MODS)
+    {
+        mods_addr = (void *)mbd->mods_addr;
+        mods_count = mbd->mods_count;
+    }
+
     // Unmap multiboot info struct from kVAS
     vmem_unmap_range_nofree(mbd, sizeof(multiboot_info_t));
 
@@ -54,6 +65,16 @@ void mb_read_data(multiboot_info_t *mbd_phys)
 
     // Unmap multiboot memory map
     vmem_unmap_range_nofree(mbd, sizeof(multiboot_info_t));
+
+    // Read module list
+    boot_info.modules_n = 0;
+    if (mods_count)
+    {
+        mods = vmem_map_range_anyk_noalloc(
+            mods_addr, sizeof(multiboot_module_t) * mods_count);
+        mb_setup_boot_info_modules(mods, mods_count);
+        vmem_unmap_range_nofree(mods, sizeof(multiboot_module_t) * mods_count);
+    }
 }
 
 /* Internal functions */
@@ -138,4 +159,17 @@ static void mb_add_physmmap_entry(uint32_t start, uint32_t size)
     // Add it to phys_mmap
     boot_info.physmmap[boot_info.physmmap_n] = new_entry;
     boot_info.physmmap_n++;
-}
\ No newline at end of file
+}
+
+/*
+ * Set up modules in boot info from multiboot module list
+ */
+static void mb_setup_boot_info_modules(multiboot_module_t *mods, uint32_t n)
+{
+    for (uint32_t i = 0; i < n && i < BOOT_INFO_MODULES_MAX; i++)
+    {
+        boot_info.modules[i].addr = mods[i].mod_start;
+        boot_info.modules[i].size = mods[i].mod_end - mods[i].mod_start;
+        boot_info.modules_n++;
+    }
+}
@@ -7,6 +7,12 @@
 #include "drivers/pit.h"
 #include "log.h"
 #include "cpu.h"
+#include "panic.h"
+#include "mem/mem.h"
+#include "mem/vmem.h"
+#include "waitq.h"
+#include "int/workq.h"
+#include "proc/sched.h"
 
 // Resolution of the system clock (in milliseconds)
 // Valid values:1 - 50
@@ -35,13 +41,16 @@ struct timer
 static void clock_handle_timer_irq();
 static void process_timers();
 static timer_t *find_timer_by_handle(timer_handle_t handle);
+static void update_time_page();
 
 // Global objects
 static volatile uint64_t system_time;
+static volatile uint64_t idle_time;
 static uint32_t local_time_offset;
 static slock_t timers_lck;
 static timer_t timers[N_TIMERS];
 static timer_handle_t next_timer_handle;
+static clock_time_page_t *time_page; // Kernel mapping of the time page
 
 /* Public functions */
 
@@ -49,8 +58,15 @@ void clock_init()
 {
     // Initialize
     system_time = 0;
+    idle_time = 0;
     local_time_offset = 0;
 
+    // Allocate time page
+    if ((time_page = mem_palloc_k(1)) == MEM_FAIL)
+        panic("CLOCK_INIT_NOMEM", "Unable to allocate the time page");
+    time_page->seq = 0;
+    update_time_page();
+
     // Set up PIT ahcnnel 0 (connected to IRQ 0)
     uint16_t pit_reset = ((uint32_t)PIT_FREQ * (uint32_t)CLOCK_RESOLUTION) / 1000;
     pit_setup_channel(PIT_CHANNEL_0, PIT_MODE_3, pit_reset);
@@ -85,15 +101,39 @@ uint32_t clock_get_local()
 
 void clock_set_local(uint32_t time)
 {
+    // Don't let the timer IRQ update the time page concurrently
+    cli();
     local_time_offset = time - system_time / 1000;
+    update_time_page();
+    sti();
+}
+
+bool clock_map_time_page()
+{
+    return vmem_map_user_ro(vmem_get_phys(time_page),
+                            (void *)CLOCK_TIME_PAGE_ADDR, 1);
+}
+
+void clock_unmap_time_page()
+{
+    vmem_unmap((void *)CLOCK_TIME_PAGE_ADDR, 1);
 }
 
 void clock_delay_ms(uint32_t time)
 {
-    uint64_t start = clock_get_system();
+    // A zero timeout would mean WAITQ_FOREVER
+    if (!time)
+        return;
 
-    while (clock_get_system() - start < time)
-        pause();
+    // Sleep on a wait queue that is never signaled until the timeout
+    waitq_t wq;
+    waitq_init(&wq);
+    waitq_wait(&wq, time);
+}
+
+uint64_t clock_get_idle()
+{
+    return idle_time;
 }
 
 timer_handle_t clock_set_timer(uint64_t duration, timer_type_t type,
@@ -178,7 +218,14 @@ static void clock_handle_timer_irq()
 {
     // Each tick is (CLOCK_RESOLUTION) milliseconds long
     system_time += CLOCK_RESOLUTION;
+    update_time_page();
 
+    // Sample idle time: if the tick arrived while the CPU was halted,
+    // the tick is counted as idle
+    if (cpu_is_idle())
+        idle_time += CLOCK_RESOLUTION;
+
+    waitq_check_timeouts(system_time);
     process_timers();
 }
 
@@ -200,8 +247,9 @@ static void process_timers()
         if (system_time - timers[i].start < timers[i].duration)
             continue;
 
-        // Call callback function
-        timers[i].func(timers[i].data);
+        // Defer callback function to the timer work queue,
+        // so that it runs with interrupts enabled
+        workq_enqueue(WORKQ_TIMER, timers[i].func, timers[i].data);
 
         if (timers[i].type == TIMER_ONESHOT)
             // Delete oneshot timer
@@ -225,4 +273,19 @@ static timer_t *find_timer_by_handle(timer_handle_t handle)
     }
 
     return NULL;
+}
+
+// Publish current time values to the time page
+static void update_time_page()
+{
+    // Odd sequence number: update in progress
+    time_page->seq++;
+    barrier();
+
+    time_page->system_time = system_time;
+    time_page->local_time_offset = local_time_offset;
+
+    // Even sequence number: page consistent
+    barrier();
+    time_page->seq++;
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "kbd/kbd.h"
 #include "cpu.h"
 #include "console/ascii.h"
+#include "waitq.h"
 
 // #define DEFAULT_COLOR_FG CONS_COL_HI_GREEN
 #define DEFAULT_COLOR_FG CONS_COL_HI_GREEN
@@ -61,7 +62,7 @@ extern uint8_t normal_table[];
 // Global objects
 static console_state_t cstate;
 static kbd_event_t kbd_event_buf;
-static bool kbd_event_received;
+static waitq_t kbd_event_wq;
 
 void console_init()
 {
@@ -83,6 +84,8 @@ void console_init()
 
 void console_init_kbd()
 {
+    waitq_init(&kbd_event_wq);
+
     // Register keyboard event handler
     kbd_register_kbd_event_recv(kbd_event_receiver);
 }
@@ -460,10 +463,9 @@ static void do_backspace()
 // Wait for a keyboard event to come in from the keyboard subsystem
 static kbd_event_t wait_key()
 {
-    // Wait for key to be pressed
-    kbd_event_received = false;
-    while (!kbd_event_received)
-        pause();
+    // Sleep until a key is pressed
+    waitq_clear(&kbd_event_wq);
+    waitq_wait(&kbd_event_wq, WAITQ_FOREVER);
 
     return kbd_event_buf;
 }
@@ -472,5 +474,5 @@ static kbd_event_t wait_key()
 static void kbd_event_receiver(kbd_event_t e)
 {
     kbd_event_buf = e;
-    kbd_event_received = true;
+    waitq_signal(&kbd_event_wq);
 }
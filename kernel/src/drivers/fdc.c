@@ -18,6 +18,7 @@
 #include "clock.h"
 #include "blkdev/blkdev.h"
 #include "drivers/isadma.h"
+#include "waitq.h"
 
 // Configure debugging
 #if DEBUG_FDC == 1
@@ -232,26 +233,37 @@ static bool cmd_recalibrate(drive_t drive);
 static bool cmd_seek(drive_t drive, uint8_t cyl);
 static bool cmd_read_track(void *buf_paddr, drive_t drive, uint8_t cyl,
                            uint8_t head);
+static bool cmd_write_sectors(void *buf_paddr, drive_t drive, uint8_t cyl,
+                              uint8_t head, uint8_t sect, uint8_t n);
 static bool reset();
 static bool blkdev_read_blk_req(blkdev_t *dev, uint8_t *buf, uint32_t block);
+static bool blkdev_read_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                                 uint32_t n_sg, uint32_t start);
+static bool blkdev_write_blk_req(blkdev_t *dev, const uint8_t *buf, uint32_t block);
+static bool blkdev_write_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                                  uint32_t n_sg, uint32_t start);
 static bool blkdev_media_changed_req(blkdev_t *dev);
 static bool do_read_track(fdc_drv_state_t *state, uint32_t cyl, uint32_t head);
+static bool do_write_sectors(fdc_drv_state_t *state, uint32_t cyl, uint32_t head,
+                             uint32_t sect, uint32_t n);
 static bool do_check_media_changed(fdc_drv_state_t *state);
-// static bool write_req(blkdev_t *dev, uint8_t *buf, uint32_t block);
 static bool access_drive(fdc_drv_state_t *state);
 static void unaccess_drive(fdc_drv_state_t *state);
 static void destroy_state(fdc_drv_state_t *state);
 static bool wait_irq6_timeout(uint32_t timeout);
 static inline void lba_to_chs(uint8_t *c, uint8_t *h, uint8_t *s,
                               uint32_t lba);
+static uint32_t sg_blocks_total(const blkdev_sg_t *sg, uint32_t n_sg);
 void irq6_handler();
 void motor_off_cb(void *data);
 
 // Global objects
-bool irq6_received;
+waitq_t irq6_wq;
 
 void fdc_init()
 {
+    waitq_init(&irq6_wq);
+
     // Register IRQ
     interrupts_register_irq(FLOPPY_IRQ, irq6_handler);
 
@@ -437,7 +449,9 @@ static void init_drive(drive_t drv)
         .nblocks = CYLS * HEADS * SECTORS,
         .drvstate = state,
         .read_blk = blkdev_read_blk_req,
-        .write_blk = NULL, // No write functionality for now
+        .write_blk = blkdev_write_blk_req,
+        .read_blks = blkdev_read_blks_req,
+        .write_blks = blkdev_write_blks_req,
         .media_changed = blkdev_media_changed_req,
     };
 
@@ -693,7 +707,7 @@ static bool cmd_specify(uint8_t srt, uint8_t hut, uint8_t hlt, bool pio_mode)
 // Recalibrate command
 static bool cmd_recalibrate(drive_t drive)
 {
-    irq6_received = false;
+    waitq_clear(&irq6_wq);
 
     // Send command
     if (!send_byte(CMD_RECALIBRATE))
@@ -725,7 +739,7 @@ static bool cmd_recalibrate(drive_t drive)
 // Seek command
 static bool cmd_seek(drive_t drive, uint8_t cyl)
 {
-    irq6_received = false;
+    waitq_clear(&irq6_wq);
 
     // Send command
     if (!send_byte(CMD_SEEK))
@@ -773,7 +787,7 @@ static bool cmd_read_track(void *buf_paddr, drive_t drive, uint8_t cyl,
     isadma_setup_channel(FLOPPY_DMA_CHAN, buf_paddr, SECTORS * BLOCK_SIZE,
                          DMA_TOMEM, DMA_SINGLE, true);
 
-    irq6_received = false;
+    waitq_clear(&irq6_wq);
 
     // Send command
     if (!send_byte(cmd_byte))
@@ -838,97 +852,86 @@ fail:
     return false;
 }
 
-// // Write sector to the floppy disk
-// // buf: buffer to write from
-// // TODO: writes don't work on QEMU
-// static bool cmd_write_sector(uint8_t *buf, drive_t drive, uint8_t cyl, uint8_t head,
-//                              uint8_t sect)
-// {
-
-//     uint8_t cmd_byte = CMD_WRITE_DATA | CMD_BIT_MF;
-
-//     // Send command
-//     if (!send_byte(cmd_byte))
-//         return false;
-
-//     uint8_t byte0 = (head << 2) | drive;
-//     uint8_t byte1 = cyl;
-//     uint8_t byte2 = head;
-//     uint8_t byte3 = sect;
-//     uint8_t byte4 = 2;    // Hard coded for 512 byte sectors
-//     uint8_t byte5 = sect; // End reading at the same sector we started
-//     uint8_t byte6 = 0x1B; // GAP1 size
-//     uint8_t byte7 = 0xFF; // Unused as byte 4 is set != 0
-
-//     // Send parameters
-//     if (!send_byte(byte0) ||
-//         !send_byte(byte1) ||
-//         !send_byte(byte2) ||
-//         !send_byte(byte3) ||
-//         !send_byte(byte4) ||
-//         !send_byte(byte5) ||
-//         !send_byte(byte6) ||
-//         !send_byte(byte7))
-//         return false;
-
-//     // Read data
-//     uint32_t bytes_written = 0;
-//     while (bytes_written < SECTOR_SIZE)
-//     {
-//         msr_t msr;
-//         // Wait for data available
-//         while (!(msr = read_msr()).rqm)
-//             pause();
-
-//         // Execution phase terminated early
-//         // Or wrong data direction
-//         if (!msr.ndma || msr.dio)
-//             break;
-
-//         // Read byte
-//         outb(PORT_FIFO, buf[bytes_written]);
-//         // Don't need io delay
-
-//         bytes_written++;
-//     }
-
-//     // Read result bytes
-//     st0_t st0;
-//     st1_t st1;
-//     st2_t st2;
-//     uint8_t endcyl, endhead, endsect, two;
-//     if (!read_data_byte(&st0.bits, CMD_TIMEOUT) ||
-//         !read_data_byte(&st1.bits, CMD_TIMEOUT) ||
-//         !read_data_byte(&st2.bits, CMD_TIMEOUT) ||
-//         !read_data_byte(&endcyl, CMD_TIMEOUT) ||
-//         !read_data_byte(&endhead, CMD_TIMEOUT) ||
-//         !read_data_byte(&endsect, CMD_TIMEOUT) ||
-//         !read_data_byte(&two, CMD_TIMEOUT))
-//         return false;
-
-// #ifdef DEBUG
-//     kprintf("[FDC] Write result:\n");
-//     kprintf("ST0: IC=%d, SE=%d, EC=%d, H=%d, DS=%x\n", st0.ic, st0.se, st0.ec, st0.h, st0.ds);
-//     kprintf("ST1: EN=%d, DE=%d, OR=%d, ND=%d, NW=%d, MA=%d\n", st1.en, st1.de, st1.or, st1.nd, st1.nd, st1.nw, st1.ma);
-//     kprintf("ST2: MD=%d, BC=%d, WC=%d, DD=%d, CM=%d\n", st2.md, st2.bc, st2.wc, st2.dd, st2.cm);
-//     kprintf("endcyl: 0x%x, endhead: 0x%x, endsect: 0x%x\n", (int)endcyl, (int)endhead, (int)endsect);
-// #endif
-
-//     // Check command result
-//     if (st0.ic != ST0_IC_SUCC)
-//         return false;
-
-//     // Check number of bytes read
-//     if (bytes_written != SECTOR_SIZE)
-//         return false;
-
-//     return true;
-// }
+// Write sectors of a track to the floppy disk
+// buf_paddr: buffer holding the first sector to write
+static bool cmd_write_sectors(void *buf_paddr, drive_t drive, uint8_t cyl,
+                              uint8_t head, uint8_t sect, uint8_t n)
+{
+    uint8_t cmd_byte = CMD_WRITE_DATA | CMD_BIT_MF;
+
+    // Set up DMA transfer
+    isadma_setup_channel(FLOPPY_DMA_CHAN, buf_paddr, n * BLOCK_SIZE,
+                         DMA_FROMMEM, DMA_SINGLE, true);
+
+    waitq_clear(&irq6_wq);
+
+    // Send command
+    if (!send_byte(cmd_byte))
+        goto fail;
+
+    uint8_t byte0 = (head << 2) | drive;
+    uint8_t byte1 = cyl;
+    uint8_t byte2 = head;
+    uint8_t byte3 = sect;         // Start writing from this sector
+    uint8_t byte4 = 2;            // Hard coded for 512 byte sectors
+    uint8_t byte5 = sect + n - 1; // Last sector to write
+    uint8_t byte6 = 0x1B;         // GAP1 size
+    uint8_t byte7 = 0xFF;         // Unused as byte 4 is set != 0
+
+    // Send parameters
+    if (!send_byte(byte0) ||
+        !send_byte(byte1) ||
+        !send_byte(byte2) ||
+        !send_byte(byte3) ||
+        !send_byte(byte4) ||
+        !send_byte(byte5) ||
+        !send_byte(byte6) ||
+        !send_byte(byte7))
+        goto fail;
+
+    if (!wait_irq6_timeout(RW_TIMEOUT))
+        goto fail;
+
+    // Read result bytes
+    st0_t st0;
+    st1_t st1;
+    st2_t st2;
+    uint8_t endcyl, endhead, endsect, two;
+    if (!read_data_byte(&st0.bits, CMD_TIMEOUT) ||
+        !read_data_byte(&st1.bits, CMD_TIMEOUT) ||
+        !read_data_byte(&st2.bits, CMD_TIMEOUT) ||
+        !read_data_byte(&endcyl, CMD_TIMEOUT) ||
+        !read_data_byte(&endhead, CMD_TIMEOUT) ||
+        !read_data_byte(&endsect, CMD_TIMEOUT) ||
+        !read_data_byte(&two, CMD_TIMEOUT))
+        goto fail;
+
+#ifdef DEBUG
+    kprintf("[FDC] Write result:\n");
+    kprintf("ST0: IC=%d, SE=%d, EC=%d, H=%d, DS=%x\n", st0.ic, st0.se, st0.ec, st0.h, st0.ds);
+    kprintf("ST1: EN=%d, DE=%d, OR=%d, ND=%d, NW=%d, MA=%d\n", st1.en, st1.de, st1.or, st1.nd, st1.nw, st1.ma);
+    kprintf("ST2: MD=%d, BC=%d, WC=%d, DD=%d, CM=%d\n", st2.md, st2.bc, st2.wc, st2.dd, st2.cm);
+    kprintf("endcyl: 0x%x, endhead: 0x%x, endsect: 0x%x\n", (int)endcyl, (int)endhead, (int)endsect);
+#endif
+
+    // Check command result
+    if (st0.ic != ST0_IC_SUCC)
+        goto fail;
+
+    // Release DMA channel
+    isadma_release_channel(FLOPPY_DMA_CHAN);
+
+    return true;
+
+fail:
+    isadma_release_channel(FLOPPY_DMA_CHAN);
+    return false;
+}
 
 // Reset FDC
 static bool reset()
 {
-    irq6_received = false;
+    waitq_clear(&irq6_wq);
 
     dor_t dor = read_dor();
 
@@ -1020,37 +1023,141 @@ static void unaccess_drive(fdc_drv_state_t *state)
 // Block device read operation
 static bool blkdev_read_blk_req(blkdev_t *dev, uint8_t *buf, uint32_t block)
 {
+    blkdev_sg_t sg = {.buf = buf, .n = 1};
+    return blkdev_read_blks_req(dev, &sg, 1, block);
+}
 
+// Block device multi-block read operation
+// The drive lock is taken and the media checked once for the whole
+// request, and each track is read at most once
+static bool blkdev_read_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                                 uint32_t n_sg, uint32_t start)
+{
     fdc_drv_state_t *state = (fdc_drv_state_t *)dev->drvstate;
 
 #ifdef DEBUG
-    kprintf("[FDC] Drive %d read block %d\n", state->drive, block);
+    kprintf("[FDC] Drive %d read from block %d\n", state->drive, start);
 #endif
 
     // Acquire drive lock
     slock_acquire(&state->drv_lck);
 
-    // Convert block address to chs
-    uint8_t cyl, head, sect;
-    lba_to_chs(&cyl, &head, &sect, block);
-
     // Check if media has changed
     // Takes care of invalidating the track cache if necessary
-    do_check_media_changed(state);
+    // The change is reported by the next media changed request
+    if (do_check_media_changed(state))
+        state->media_changed = true;
 
-    // Check if the track in the track cache is already correct
-    if (!state->track_buf_valid || state->track_buf_cyl != cyl || state->track_buf_head != head)
+    uint32_t block = start;
+    for (uint32_t i = 0; i < n_sg; i++)
     {
-        // We actually need to read from the drive
-        if (!do_read_track(state, cyl, head))
-            goto fail;
+        for (uint32_t j = 0; j < sg[i].n; j++, block++)
+        {
+            // Convert block address to chs
+            uint8_t cyl, head, sect;
+            lba_to_chs(&cyl, &head, &sect, block);
+
+            // Check if the track in the track cache is already correct
+            if (!state->track_buf_valid || state->track_buf_cyl != cyl ||
+                state->track_buf_head != head)
+            {
+                // We actually need to read from the drive
+                if (!do_read_track(state, cyl, head))
+                    goto fail;
+            }
+
+            // Copy correct sector to the caller buffer
+            // NOTE: the CHS conversion function makes sure that sect is already
+            //       in the 1-18 range
+            memcpy(sg[i].buf + j * BLOCK_SIZE,
+                   state->track_buf_vaddr + (sect - 1) * BLOCK_SIZE, BLOCK_SIZE);
+        }
     }
 
-    // Copy correct sector to the caller buffer
-    // NOTE: the CHS conversion function makes sure that sect is already
-    //       in the 1-18 range
-    memcpy(buf, state->track_buf_vaddr + (sect - 1) * BLOCK_SIZE,
-           BLOCK_SIZE);
+    // Release drive lock
+    slock_release(&state->drv_lck);
+
+    return true;
+
+fail:
+    slock_release(&state->drv_lck);
+    return false;
+}
+
+// Block device write operation
+static bool blkdev_write_blk_req(blkdev_t *dev, const uint8_t *buf, uint32_t block)
+{
+    blkdev_sg_t sg = {.buf = (uint8_t *)buf, .n = 1};
+    return blkdev_write_blks_req(dev, &sg, 1, block);
+}
+
+// Block device multi-block write operation
+// Blocks are gathered in the track buffer, and written with one
+// command per track
+static bool blkdev_write_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                                  uint32_t n_sg, uint32_t start)
+{
+    fdc_drv_state_t *state = (fdc_drv_state_t *)dev->drvstate;
+
+#ifdef DEBUG
+    kprintf("[FDC] Drive %d write from block %d\n", state->drive, start);
+#endif
+
+    // Acquire drive lock
+    slock_acquire(&state->drv_lck);
+
+    // Never write data meant for the previous media
+    if (do_check_media_changed(state))
+    {
+        state->media_changed = true;
+        goto fail;
+    }
+
+    // Position in the scatter list
+    uint32_t sg_i = 0, sg_j = 0;
+
+    uint32_t block = start;
+    uint32_t remaining = sg_blocks_total(sg, n_sg);
+    while (remaining)
+    {
+        // Convert block address to chs
+        uint8_t cyl, head, sect;
+        lba_to_chs(&cyl, &head, &sect, block);
+
+        // Write up to the end of the track
+        uint32_t n = SECTORS - sect + 1;
+        if (n > remaining)
+            n = remaining;
+
+        // The track buffer stays valid only if it holds this track,
+        // in which case it is updated with the written data
+        if (state->track_buf_cyl != cyl || state->track_buf_head != head)
+            state->track_buf_valid = false;
+
+        // Gather sectors in the track buffer
+        for (uint32_t k = 0; k < n; k++)
+        {
+            while (sg_j == sg[sg_i].n)
+            {
+                sg_i++;
+                sg_j = 0;
+            }
+
+            memcpy(state->track_buf_vaddr + (sect - 1 + k) * BLOCK_SIZE,
+                   sg[sg_i].buf + sg_j * BLOCK_SIZE, BLOCK_SIZE);
+            sg_j++;
+        }
+
+        if (!do_write_sectors(state, cyl, head, sect, n))
+        {
+            // Track buffer doesn't match the disk anymore
+            state->track_buf_valid = false;
+            goto fail;
+        }
+
+        block += n;
+        remaining -= n;
+    }
 
     // Release drive lock
     slock_release(&state->drv_lck);
@@ -1178,57 +1285,39 @@ static bool do_check_media_changed(fdc_drv_state_t *state)
     return val;
 }
 
-// // Block device write operation
-// static bool write_req(blkdev_t *dev, uint8_t *buf, uint32_t block)
-// {
-//     fdc_drv_state_t *state = (fdc_drv_state_t *)dev->drvstate;
-
-// #ifdef DEBUG
-//     kprintf("[FDC] Drive %d write block %d\n", state->drive, block);
-// #endif
-
-//     // Acquire drive lock
-//     slock_acquire(&state->drv_lck);
-
-//     // Convert block address to chs
-//     uint8_t cyl, head, sect;
-//     lba_to_chs(&cyl, &head, &sect, block);
-
-//     // Retry command many times
-//     bool write_succ = false;
-//     for (int i = 0; i < RW_RETRIES; i++)
-//     {
-//         // Set up drive for access
-//         if (!access_drive(state))
-//             goto reset;
-
-//         // Check media changed
-//         if (check_media_changed(state->drive))
-//             state->media_changed = true;
+// Write sectors of a track from the track buffer
+static bool do_write_sectors(fdc_drv_state_t *state, uint32_t cyl, uint32_t head,
+                             uint32_t sect, uint32_t n)
+{
+    void *buf_paddr = (uint8_t *)state->track_buf_paddr + (sect - 1) * BLOCK_SIZE;
 
-//         // // Seek to cylinder
-//         // if (!cmd_seek(state->drive, 0))
-//         //     goto reset;
-//         // NOTE: we don't need to seek explicitly thanks to implied seek
+    // Retry command many times
+    bool write_succ = false;
+    for (int i = 0; i < RW_RETRIES; i++)
+    {
+        // Set up drive for access
+        if (!access_drive(state))
+            goto reset;
 
-//         // Do read
-//         if (!cmd_write_sector(buf, state->drive, cyl, head, sect))
-//             goto reset;
+        // Seek to cylinder
+        if (!cmd_seek(state->drive, cyl))
+            goto reset;
 
-//         write_succ = true;
-//         break;
-//     reset:
-//         reset();
-//     }
+        // Do write
+        if (!cmd_write_sectors(buf_paddr, state->drive, cyl, head, sect, n))
+            goto reset;
 
-//     // Set up motor off timer
-//     unaccess_drive(state);
+        write_succ = true;
+        break;
+    reset:
+        reset();
+    }
 
-//     // Release drive lock
-//     slock_release(&state->drv_lck);
+    // Set up motor off timer
+    unaccess_drive(state);
 
-//     return write_succ;
-// }
+    return write_succ;
+}
 
 // Convert LBA addres to CHS
 static inline void lba_to_chs(uint8_t *c, uint8_t *h, uint8_t *s,
@@ -1239,6 +1328,16 @@ static inline void lba_to_chs(uint8_t *c, uint8_t *h, uint8_t *s,
     *s = ((lba % (HEADS * SECTORS)) % SECTORS + 1);
 }
 
+// Total number of blocks in a scatter list
+static uint32_t sg_blocks_total(const blkdev_sg_t *sg, uint32_t n_sg)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < n_sg; i++)
+        n += sg[i].n;
+
+    return n;
+}
+
 // Destroy state, handling all potential cases
 static void destroy_state(fdc_drv_state_t *state)
 {
@@ -1255,27 +1354,18 @@ static void destroy_state(fdc_drv_state_t *state)
 
 bool wait_irq6_timeout(uint32_t timeout)
 {
-    uint32_t start = clock_get_system();
-
-    // Wait for IRQ6 to be called
-    while (!irq6_received)
-    {
-        pause();
-        if (clock_get_system() - start > timeout)
-            return false;
-    }
-
-    return true;
+    // Sleep until IRQ6 is called
+    return waitq_wait(&irq6_wq, timeout);
 }
 
 void irq6_handler()
 {
-    irq6_received = true;
+    waitq_signal(&irq6_wq);
     // kprintf("IRQ6");
 }
 
 // Motor OFF callback
-// Called by the clock subsystem inside the timer interrupt handler
+// Called by the clock subsystem from the timer work queue
 void motor_off_cb(void *data)
 {
     fdc_drv_state_t *state = (fdc_drv_state_t *)data;
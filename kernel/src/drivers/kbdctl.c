@@ -8,6 +8,8 @@
 #include "panic.h"
 #include "clock.h"
 #include "cpu.h"
+#include "waitq.h"
+#include "int/workq.h"
 #include "int/interrupts.h"
 #include "drivers/ps2.h"
 #include "drivers/ps2kbd/ps2kbd.h"
@@ -31,6 +33,7 @@
 
 #define TIMEOUT 100       // (ms)
 #define POST_TIMEOUT 1000 // (ms)
+#define POLL_SPINS 1000   // Status polls before sleeping
 #define RESEND_RETRIES 10
 
 typedef enum
@@ -131,6 +134,8 @@ static void disable_port_1();
 static void disable_port_2();
 static void kbdctl_irq_port1();
 static void kbdctl_irq_port2();
+static void port1_data_work(void *data);
+static void port2_data_work(void *data);
 
 // Global driver objects
 bool use_port_1, use_port_2;
@@ -412,9 +417,19 @@ bool read_data_timeout(uint8_t *data, uint32_t timeout)
     uint32_t start = clock_get_system();
 
     // Wait for data to be available
+    // Poll briefly, as most replies arrive almost immediately,
+    // then sleep between clock ticks
+    uint32_t spins = 0;
     while (!outbuf_full())
     {
-        pause();
+        if (spins < POLL_SPINS)
+        {
+            spins++;
+            io_delay();
+            continue;
+        }
+
+        cpu_idle();
         if (clock_get_system() - start > timeout)
             return false;
     }
@@ -680,7 +695,8 @@ static void kbdctl_irq_port1()
 #ifdef DEBUG
         kprintf("data = 0x%x\n", data);
 #endif
-        port_1_driver.got_data_callback(data);
+        // Pass data to the device driver outside of the IRQ
+        workq_enqueue(WORKQ_KBD, port1_data_work, (void *)(uint32_t)data);
     }
 #ifdef DEBUG
     else
@@ -702,7 +718,8 @@ static void kbdctl_irq_port2()
 #ifdef DEBUG
         kprintf("data = 0x%x\n", data);
 #endif
-        port_2_driver.got_data_callback(data);
+        // Pass data to the device driver outside of the IRQ
+        workq_enqueue(WORKQ_KBD, port2_data_work, (void *)(uint32_t)data);
     }
 #ifdef DEBUG
     else
@@ -711,3 +728,15 @@ static void kbdctl_irq_port2()
     }
 #endif
 }
+
+// Deferred processing of data received from PS2 port 1
+static void port1_data_work(void *data)
+{
+    port_1_driver.got_data_callback((uint8_t)(uint32_t)data);
+}
+
+// Deferred processing of data received from PS2 port 2
+static void port2_data_work(void *data)
+{
+    port_2_driver.got_data_callback((uint8_t)(uint32_t)data);
+}
\ No newline at end of file
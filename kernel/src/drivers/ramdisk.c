@@ -17,6 +17,10 @@ typedef struct
 static uint8_t **allocate_blocklist(uint32_t nblocks);
 static bool blkdev_read_blk_req(blkdev_t *dev, uint8_t *buf, uint32_t block);
 static bool write_req(blkdev_t *dev, const uint8_t *buf, uint32_t block);
+static bool read_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                          uint32_t n_sg, uint32_t start);
+static bool write_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                           uint32_t n_sg, uint32_t start);
 void ramdisk_create(uint32_t id, uint32_t nblocks)
 {
     // Construct major
@@ -54,6 +58,8 @@ void ramdisk_create(uint32_t id, uint32_t nblocks)
         .nblocks = nblocks,
         .read_blk = blkdev_read_blk_req,
         .write_blk = write_req,
+        .read_blks = read_blks_req,
+        .write_blks = write_blks_req,
         .media_changed = NULL,
     };
 
@@ -116,3 +122,45 @@ static bool write_req(blkdev_t *dev, const uint8_t *buf, uint32_t block)
 
     return true;
 }
+
+static bool read_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                          uint32_t n_sg, uint32_t start)
+{
+    rd_state_t *state = (rd_state_t *)dev->drvstate;
+
+    uint32_t block = start;
+    for (uint32_t i = 0; i < n_sg; i++)
+    {
+        for (uint32_t j = 0; j < sg[i].n; j++, block++)
+        {
+            // Check if block in range
+            if (block >= state->nblocks)
+                return false;
+
+            memcpy(sg[i].buf + j * BLOCK_SIZE, state->blklst[block], BLOCK_SIZE);
+        }
+    }
+
+    return true;
+}
+
+static bool write_blks_req(blkdev_t *dev, const blkdev_sg_t *sg,
+                           uint32_t n_sg, uint32_t start)
+{
+    rd_state_t *state = (rd_state_t *)dev->drvstate;
+
+    uint32_t block = start;
+    for (uint32_t i = 0; i < n_sg; i++)
+    {
+        for (uint32_t j = 0; j < sg[i].n; j++, block++)
+        {
+            // Check if block in range
+            if (block >= state->nblocks)
+                return false;
+
+            memcpy(state->blklst[block], sg[i].buf + j * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,447 @@
+#include "fs/arfs.h"
+
+#include <string.h>
+
+#include "fs/vfs.h"
+#include "log.h"
+#include "blkdev/blkdev.h"
+#include "boot/boot_info.h"
+#include "mem/mem.h"
+#include "mem/const.h"
+#include "mem/vmem.h"
+#include "mem/kalloc.h"
+#include "error.h"
+
+// Archive images are laid out as:
+//  - header
+//  - index, one entry for each file and directory
+//  - names, NULL terminated
+//  - file data, each file contiguous
+// The root directory is the first entry. The children of each
+// directory are contiguous in the index, sorted by name, and come
+// after the directory itself
+
+#define ARFS_MAGIC "ARFS"
+#define ARFS_VERSION 1
+
+#define ARFS_TYPE_FILE 0
+#define ARFS_TYPE_DIR 1
+
+// Image header
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t index_offset;
+    uint32_t names_offset;
+    uint32_t names_size;
+    uint32_t image_size;
+} arfs_header_t;
+
+// Index entry
+typedef struct __attribute__((packed))
+{
+    uint32_t name; // Offset of the name in the names
+    uint32_t type;
+    uint32_t offset; // File: offset of the data, dir: first child entry
+    uint32_t size;   // File: size in bytes, dir: number of children
+} arfs_entry_t;
+
+// Mounted filesystem state
+typedef struct
+{
+    const uint8_t *image;
+    uint32_t image_size;
+    const arfs_entry_t *index;
+    const char *names;
+    uint32_t n_entries;
+
+    // Inodes of all entries, built on mount
+    vfs_inode_t *inodes;
+
+    // Where the image comes from
+    bool is_module;
+    uint32_t n_pages; // Pages allocated for the image, if loaded from a device
+} fs_state_t;
+
+static int32_t fs_type_mount(const char *dev, vfs_superblock_t **mount);
+static void superblock_unmount(vfs_superblock_t *superblock);
+static bool parse_module(const char *dev, uint32_t *n);
+static int32_t load_module(fs_state_t *fs_state, uint32_t n);
+static int32_t load_blkdev(fs_state_t *fs_state, const char *dev);
+static void unload_image(fs_state_t *fs_state);
+static int32_t check_image(fs_state_t *fs_state);
+static void build_inodes(fs_state_t *fs_state);
+static void inode_destroy(vfs_inode_t *inode);
+static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
+                          uint32_t offset, uint32_t n);
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n);
+static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, const char *name);
+
+void arfs_init()
+{
+    vfs_fs_type_t arfs = {
+        .name = "arfs",
+        .mount = fs_type_mount,
+    };
+
+    // Register archive filesystem driver
+    if (!vfs_register_fs_type(arfs))
+        kprintf("[ARFS] Unable to register fs type\n");
+}
+
+/* Internal functions */
+
+static int32_t fs_type_mount(const char *dev, vfs_superblock_t **superblock)
+{
+    int32_t err;
+
+    kprintf("[ARFS] Mounting device %s\n", dev);
+
+    // Allocate filesystem state
+    fs_state_t *fs_state = kalloc(sizeof(fs_state_t));
+    if (!fs_state)
+        return E_NOMEM;
+
+    // Get image into memory
+    uint32_t module;
+    if (parse_module(dev, &module))
+        err = load_module(fs_state, module);
+    else
+        err = load_blkdev(fs_state, dev);
+    if (err < 0)
+        goto fail_noimage;
+
+    if ((err = check_image(fs_state)) < 0)
+        goto fail;
+
+    // Inodes never change, build them all now so that lookups
+    // don't allocate anything
+    err = E_NOMEM;
+    if (!(fs_state->inodes = kalloc(fs_state->n_entries * sizeof(vfs_inode_t))))
+        goto fail;
+    build_inodes(fs_state);
+
+    // Allocate VFS superblock structure
+    vfs_superblock_t *sb = kalloc(sizeof(vfs_superblock_t));
+    if (!sb)
+    {
+        kfree(fs_state->inodes);
+        goto fail;
+    }
+
+    // Construct superblock
+    // The filesystem is read only, there's nothing to sync
+    sb->fs_state = fs_state;
+    sb->root = &fs_state->inodes[0];
+    sb->unmount = superblock_unmount;
+    sb->changed = NULL;
+    sb->sync = NULL;
+
+    *superblock = sb;
+    return 0;
+
+fail:
+    unload_image(fs_state);
+fail_noimage:
+    kfree(fs_state);
+    return err;
+}
+
+static void superblock_unmount(vfs_superblock_t *superblock)
+{
+    fs_state_t *fs_state = superblock->fs_state;
+
+    kfree(fs_state->inodes);
+    unload_image(fs_state);
+    kfree(fs_state);
+
+    // Free superblock
+    kfree(superblock);
+}
+
+// Check if the device name refers to a boot module ("mod<n>")
+static bool parse_module(const char *dev, uint32_t *n)
+{
+    if (dev[0] != 'm' || dev[1] != 'o' || dev[2] != 'd' || !dev[3])
+        return false;
+
+    *n = 0;
+    for (dev += 3; *dev; dev++)
+    {
+        if (*dev < '0' || *dev > '9')
+            return false;
+        *n = *n * 10 + (*dev - '0');
+    }
+
+    return true;
+}
+
+// Map a boot module into the kernel address space
+// Its memory is reserved, the image is used where the bootloader put it
+static int32_t load_module(fs_state_t *fs_state, uint32_t n)
+{
+    if (n >= boot_info.modules_n)
+        return E_NOENT;
+
+    boot_module_t *mod = &boot_info.modules[n];
+    if (mod->size < sizeof(arfs_header_t))
+        return E_NOFS;
+
+    fs_state->image = vmem_map_range_anyk((void *)mod->addr, mod->size);
+    if (!fs_state->image)
+        return E_NOMEM;
+
+    fs_state->image_size = mod->size;
+    fs_state->is_module = true;
+    fs_state->n_pages = 0;
+
+    return 0;
+}
+
+// Read the whole image from a block device into memory
+// The device isn't needed anymore afterwards
+static int32_t load_blkdev(fs_state_t *fs_state, const char *dev)
+{
+    int32_t err;
+
+    blkdev_handle_t dev_handle = blkdev_get_handle(dev);
+    if (dev_handle == BLKDEV_HANDLE_NULL)
+    {
+        kprintf("[ARFS] Unable to get handle for device %s\n", dev);
+        return E_NOENT;
+    }
+
+    // Read header to find out the size of the image
+    uint8_t block[BLOCK_SIZE];
+    if (!blkdev_read(block, dev_handle, 0))
+    {
+        err = E_IOERR;
+        goto fail;
+    }
+
+    arfs_header_t *header = (arfs_header_t *)block;
+    if (memcmp(header->magic, ARFS_MAGIC, 4) != 0 ||
+        header->image_size < sizeof(arfs_header_t))
+    {
+        err = E_NOFS;
+        goto fail;
+    }
+
+    // Image must fit in the device, and its size rounded up to
+    // pages must not overflow
+    uint64_t dev_size = (uint64_t)blkdev_get_nblocks(dev_handle) * BLOCK_SIZE;
+    if (header->image_size > dev_size ||
+        header->image_size > UINT32_MAX - (MEM_PAGE_SIZE - 1))
+    {
+        err = E_INCON;
+        goto fail;
+    }
+
+    uint32_t image_size = header->image_size;
+    uint32_t n_pages = (image_size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+    uint8_t *image = mem_palloc_k(n_pages);
+    if (image == MEM_FAIL)
+    {
+        err = E_NOMEM;
+        goto fail;
+    }
+
+    // Pages are a whole number of blocks
+    if (!blkdev_read_n(image, dev_handle, 0, (image_size + BLOCK_SIZE - 1) / BLOCK_SIZE))
+    {
+        mem_pfree(image, n_pages);
+        err = E_IOERR;
+        goto fail;
+    }
+
+    blkdev_release_handle(dev_handle);
+
+    fs_state->image = image;
+    fs_state->image_size = image_size;
+    fs_state->is_module = false;
+    fs_state->n_pages = n_pages;
+
+    return 0;
+
+fail:
+    blkdev_release_handle(dev_handle);
+    return err;
+}
+
+static void unload_image(fs_state_t *fs_state)
+{
+    // Module memory stays reserved, it can be mounted again
+    if (fs_state->is_module)
+        vmem_unmap_range_nofree((void *)fs_state->image, fs_state->image_size);
+    else
+        mem_pfree((void *)fs_state->image, fs_state->n_pages);
+}
+
+// Check that the image is an archive and that everything in the
+// index stays inside of it, so that it can be used without checks
+static int32_t check_image(fs_state_t *fs_state)
+{
+    const arfs_header_t *header = (const arfs_header_t *)fs_state->image;
+    uint32_t size = fs_state->image_size;
+
+    if (memcmp(header->magic, ARFS_MAGIC, 4) != 0 ||
+        header->version != ARFS_VERSION)
+        return E_NOFS;
+
+    // Header of a module may describe less than the whole module
+    if (header->image_size > size)
+        return E_INCON;
+    size = header->image_size;
+
+    if (header->index_offset % 4 != 0 || header->index_offset > size ||
+        header->n_entries == 0 ||
+        header->n_entries > (size - header->index_offset) / sizeof(arfs_entry_t))
+        return E_INCON;
+
+    if (header->names_offset > size || header->names_size == 0 ||
+        header->names_size > size - header->names_offset)
+        return E_INCON;
+
+    fs_state->index = (const arfs_entry_t *)(fs_state->image + header->index_offset);
+    fs_state->names = (const char *)(fs_state->image + header->names_offset);
+    fs_state->n_entries = header->n_entries;
+
+    // All names are terminated if the last one is
+    if (fs_state->names[header->names_size - 1] != '\0')
+        return E_INCON;
+
+    for (uint32_t i = 0; i < fs_state->n_entries; i++)
+    {
+        const arfs_entry_t *entry = &fs_state->index[i];
+
+        if (entry->name >= header->names_size ||
+            strlen(fs_state->names + entry->name) > FILENAME_MAX)
+            return E_INCON;
+
+        if (entry->type == ARFS_TYPE_FILE)
+        {
+            if (entry->offset > size || entry->size > size - entry->offset)
+                return E_INCON;
+        }
+        else if (entry->type == ARFS_TYPE_DIR)
+        {
+            // Children come after their directory, there can't be loops
+            if (entry->offset <= i || entry->offset > fs_state->n_entries ||
+                entry->size > fs_state->n_entries - entry->offset)
+                return E_INCON;
+        }
+        else
+            return E_INCON;
+    }
+
+    // Root must be a directory
+    if (fs_state->index[0].type != ARFS_TYPE_DIR)
+        return E_INCON;
+
+    return 0;
+}
+
+// Construct the inode of every index entry
+// The inode of an entry has the same id as its index
+static void build_inodes(fs_state_t *fs_state)
+{
+    for (uint32_t i = 0; i < fs_state->n_entries; i++)
+    {
+        const arfs_entry_t *entry = &fs_state->index[i];
+        vfs_inode_t *inode = &fs_state->inodes[i];
+        bool is_dir = entry->type == ARFS_TYPE_DIR;
+
+        strcpy(inode->name, fs_state->names + entry->name);
+        inode->size = is_dir ? 0 : entry->size;
+        inode->type = is_dir ? VFS_INTYPE_DIR : VFS_INTYPE_FILE;
+        inode->priv_data = (void *)entry;
+        inode->fs_state = fs_state;
+        inode->id = i;
+        inode->ref_count = 0;
+        inode->read = is_dir ? NULL : inode_read;
+        inode->read_blocks = NULL;
+        inode->readahead = NULL;
+        inode->write = NULL;
+        inode->readdir = is_dir ? inode_readdir : NULL;
+        inode->lookup = is_dir ? inode_lookup : NULL;
+        inode->create = NULL;
+        inode->destroy = inode_destroy;
+    }
+}
+
+// Inodes belong to the filesystem and are freed on unmount
+static void inode_destroy(vfs_inode_t *inode)
+{
+    (void)inode;
+}
+
+//// Inode functions
+// File data is contiguous in the image
+static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
+                          uint32_t offset, uint32_t n)
+{
+    fs_state_t *fs_state = inode->fs_state;
+    const arfs_entry_t *entry = inode->priv_data;
+
+    // Clamp with file size
+    if (offset >= entry->size)
+        return 0;
+    if (n > entry->size - offset)
+        n = entry->size - offset;
+
+    memcpy(buf, fs_state->image + entry->offset + offset, n);
+
+    return n;
+}
+
+// Children are contiguous in the index, the offset indexes them directly
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n)
+{
+    (void)cursor;
+    fs_state_t *fs_state = inode->fs_state;
+    const arfs_entry_t *entry = inode->priv_data;
+
+    uint32_t n_read = 0;
+    while (n_read < n && offset + n_read < entry->size)
+    {
+        vfs_inode_t *child = &fs_state->inodes[entry->offset + offset + n_read];
+
+        strcpy(buf[n_read].name, child->name);
+        buf[n_read].type = child->type;
+        buf[n_read].size = child->size;
+        n_read++;
+    }
+
+    return n_read;
+}
+
+// Children are sorted by name, binary search them
+static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, const char *name)
+{
+    fs_state_t *fs_state = inode->fs_state;
+    const arfs_entry_t *entry = inode->priv_data;
+
+    uint32_t lo = entry->offset;
+    uint32_t hi = entry->offset + entry->size;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, fs_state->names + fs_state->index[mid].name);
+
+        if (cmp == 0)
+        {
+            *res = &fs_state->inodes[mid];
+            return 0;
+        }
+        else if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return E_NOENT;
+}
@@ -9,6 +9,7 @@
 #include "panic.h"
 #include "console/console.h"
 #include "error.h"
+#include "config.h"
 
 // #define DEBUG
 
@@ -31,15 +32,51 @@ typedef struct __attribute__((packed))
     uint32_t hidden_sectors;
     uint32_t large_sector_count;
 
-    // FAT12 EBPB
-    uint8_t disk_n;
-    uint8_t _res2;
-    uint8_t signature;
-    uint32_t volume_id;
-    uint8_t volume_label[11];
-    uint8_t system_ident[8];
+    union
+    {
+        // FAT12 and FAT16 EBPB
+        struct __attribute__((packed))
+        {
+            uint8_t disk_n;
+            uint8_t _res2;
+            uint8_t signature;
+            uint32_t volume_id;
+            uint8_t volume_label[11];
+            uint8_t system_ident[8];
+        };
+
+        // FAT32 EBPB
+        struct __attribute__((packed))
+        {
+            uint32_t sectors_per_fat_32;
+            uint16_t ext_flags;
+            uint16_t fs_version;
+            uint32_t root_cluster;
+            uint16_t fsinfo_sector;
+            uint16_t backup_boot_sector;
+            uint8_t _res3[12];
+            uint8_t disk_n_32;
+            uint8_t _res4;
+            uint8_t signature_32;
+            uint32_t volume_id_32;
+            uint8_t volume_label_32[11];
+            uint8_t system_ident_32[8];
+        };
+    };
 } bpb_t;
 
+#define EXT_FLAGS_NO_MIRROR 0x80  // Only the active FAT is used
+#define EXT_FLAGS_ACTIVE_FAT 0x0F // Active FAT, if not mirrored
+
+// FAT32 FS information sector
+#define FSINFO_SIG1 0x41615252
+#define FSINFO_SIG2 0x61417272
+#define FSINFO_SIG1_OFFSET 0
+#define FSINFO_SIG2_OFFSET 484
+#define FSINFO_FREE_OFFSET 488 // Free cluster count
+#define FSINFO_NEXT_OFFSET 492 // Next free cluster hint
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
 // FAT directory entry
 typedef struct __attribute__((packed))
 {
@@ -95,6 +132,29 @@ typedef struct __attribute__((packed))
 #define ATTR_LFN (ATTR_RO | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLID)
 #define LFN_END 0x40
 
+#define DIRENTS_PER_SECTOR (BLOCK_SIZE / sizeof(fat_dir_entry_t))
+
+// FAT entry of a free cluster
+#define FAT_FREE 0
+
+// FAT type, given by the number of clusters
+typedef enum
+{
+    FAT12,
+    FAT16,
+    FAT32,
+} fat_type_t;
+
+// Cached FAT sector
+typedef struct
+{
+    uint32_t sector;   // Sector inside the FAT
+    uint32_t last_use; // Access stamp for LRU eviction
+    bool valid;
+    bool dirty; // Not yet copied to the FATs on the device
+    uint8_t *data;
+} fat_sector_t;
+
 // FAT filesystem private state
 typedef struct
 {
@@ -104,19 +164,79 @@ typedef struct
     // Did the underlying block device signal a media change?
     bool media_changed;
 
-    // Buffers
-    uint8_t *fat_cache; // FAT cache
-    uint8_t *io_buf;    // I/O buffer
+    // FAT sector cache
+    // Sectors are loaded as chains are followed
+    fat_sector_t fat_cache[FAT_CACHE_SIZE];
+    uint8_t *fat_cache_data;
+    uint32_t fat_cache_clock; // Last access stamp
 
     // Useful information
-    uint32_t data_start; // Data starting sector
-                         // Used for computing the sectors for a cluster
+    fat_type_t type;
+    uint32_t sectors_per_fat;
+    uint32_t fat_start;    // Sector of the FAT read from
+    bool fat_mirror;       // Changes go to all FATs
+    uint32_t fat_eoc;      // End of chain marker, entries from
+                           // fat_eoc - 8 up don't point to clusters
+    uint32_t root_cluster; // First cluster of the root directory (FAT32)
+    uint32_t data_start;   // Data starting sector
+                           // Used for computing the sectors for a cluster
+    uint32_t data_sectors; // Number of sectors in the data area
+    uint32_t n_clusters;   // Number of clusters usable for data
+    uint32_t free_hint;    // Cluster to start looking for free ones from
+    bool fsinfo_stale;     // FAT32 free cluster count was invalidated
 } fs_state_t;
 
+// Run of sectors contiguous on the device
+typedef struct
+{
+    uint32_t start; // First sector
+    uint32_t n;     // Number of sectors
+} extent_t;
+
+// Entry of a directory index
+// Points to the directory entry on the device, which is always read
+// back, so the index doesn't go stale when files are written
+typedef struct
+{
+    char name[FILENAME_MAX];
+    uint32_t sector; // Location of the directory entry
+    uint32_t index;
+    int32_t next; // Next entry in the hash bucket, -1 at the end
+} dir_index_entry_t;
+
+// Hash index of the entries of a directory, by name
+typedef struct
+{
+    dir_index_entry_t *entries;
+    uint32_t n_entries;
+    uint32_t max_entries;
+    int32_t *buckets;   // First entry of each bucket, -1 if empty
+    uint32_t n_buckets; // Power of 2
+} dir_index_t;
+
 // FAT filesystem inode private data
+// The sectors of the inode are described by a list of extents, which
+// is built lazily by following the cluster chain as reads advance
 typedef struct
 {
-    uint32_t *sector_list; // List of sectors
+    extent_t *extents;
+    uint32_t n_extents;    // Number of extents in the list
+    uint32_t max_extents;  // Capacity of the list
+    uint32_t n_sectors;    // Number of sectors covered by the extents
+    uint32_t first_cluster; // First cluster of the chain, 0 if empty
+    uint32_t last_cluster; // Last cluster added to the extents, 0 if none
+    uint32_t next_cluster; // Next cluster of the chain, 0 at the end
+
+    // Location of the directory entry (not for the root directory)
+    uint32_t dirent_sector;
+    uint32_t dirent_index;
+
+    // Extent of the last mapped block, to make sequential access O(1)
+    uint32_t cur_extent;
+    uint32_t cur_block; // First block of the extent
+
+    // Directory index, built by the first lookup
+    dir_index_t *index;
 } inode_private_t;
 
 #define LFN_MAX 64
@@ -133,17 +253,34 @@ typedef struct
 // Internal functions
 static int32_t fs_type_mount(const char *dev, vfs_superblock_t **mount);
 static bool read_bpb(fs_state_t *fs_state);
-static bool read_fat_cache(fs_state_t *fs_state);
+static bool read_geometry(fs_state_t *fs_state);
+static bool init_fat_cache(fs_state_t *fs_state);
 static void superblock_unmount(vfs_superblock_t *mount);
+static bool superblock_changed(vfs_superblock_t *superblock);
+static int32_t superblock_sync(vfs_superblock_t *superblock);
 static void inode_destroy(vfs_inode_t *inode);
 static bool check_fat_magically(bpb_t *bpb);
 static void destroy_fs_state(fs_state_t *state);
 static vfs_inode_t *get_root_inode(fs_state_t *fs_state);
-static int64_t inode_readdir(vfs_inode_t *inode, dirent_t *buf,
-                             uint32_t offset, uint32_t n);
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n);
 static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, const char *name);
+static int32_t inode_create(vfs_inode_t *inode, vfs_inode_t **res, const char *name,
+                            vfs_inode_type_t type);
+static int64_t inode_read_blocks(vfs_inode_t *inode, uint8_t *buf,
+                                 uint32_t block, uint32_t n);
+static int32_t inode_readahead(vfs_inode_t *inode, uint32_t block, uint32_t n);
 static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
                           uint32_t offset, uint32_t n);
+static int64_t inode_write(vfs_inode_t *inode, const uint8_t *buf,
+                           uint32_t offset, uint32_t n);
+static int32_t inode_from_dirent(fs_state_t *fs_state, const char *name,
+                                 uint32_t sector, uint32_t index, vfs_inode_t **res);
+static int32_t dirent_update(fs_state_t *fs_state, vfs_inode_t *inode);
+static int32_t dirent_find_free(fs_state_t *fs_state, vfs_inode_t *inode,
+                                uint32_t *sector, uint32_t *index);
+static bool short_name_from_name(fat_dir_entry_t *entry, const char *name);
+static bool is_short_name_char(char c);
 static void direntry_name_from_short(char *name, fat_dir_entry_t *entry);
 static void direntry_name_from_lfn(char *name, lfn_buf_t *lfn_buf);
 static void str_to_lower(char *str);
@@ -153,13 +290,33 @@ static size_t lfn_parse_chunk(char *chunk, fat_dir_entry_t *entry);
 static char lfn_to_char(uint16_t c);
 static void lfn_buf_init(lfn_buf_t *buf);
 static inline uint32_t nblocks(uint32_t size);
+static inode_private_t *alloc_inode_pdata(uint32_t start_cluster);
 static void free_inode_pdata(inode_private_t *pdata);
-static uint32_t follow_sector_chain(uint32_t *sector_list,
-                                    fs_state_t *fs_state, uint32_t start_cluster);
-static bool read_fat_entry(uint32_t *entry, fs_state_t *fs_state, uint32_t cluster);
+static int32_t map_block(fs_state_t *fs_state, inode_private_t *pdata,
+                         uint32_t block, uint32_t *sector);
+static int32_t extents_extend(fs_state_t *fs_state, inode_private_t *pdata);
+static int32_t extents_append(inode_private_t *pdata, uint32_t start, uint32_t n);
+static int32_t chain_grow(fs_state_t *fs_state, inode_private_t *pdata, uint32_t n_sectors);
+static int32_t alloc_cluster(fs_state_t *fs_state, uint32_t *cluster);
+static int32_t read_fat_entry(uint32_t *entry, fs_state_t *fs_state, uint32_t cluster);
+static int32_t write_fat_entry(fs_state_t *fs_state, uint32_t cluster, uint32_t value);
+static int32_t fat_get_bytes(fs_state_t *fs_state, uint32_t offset, uint8_t *buf, uint32_t n);
+static int32_t fat_set_bytes(fs_state_t *fs_state, uint32_t offset,
+                             const uint8_t *buf, uint32_t n);
+static fat_sector_t *fat_sector_get(fs_state_t *fs_state, uint32_t sector);
+static int32_t fat_sector_flush(fs_state_t *fs_state, fat_sector_t *sec);
+static int32_t fat_flush(fs_state_t *fs_state);
+static void fsinfo_invalidate(fs_state_t *fs_state);
+static uint32_t dirent_cluster(fs_state_t *fs_state, fat_dir_entry_t *entry);
 static bool check_media_changed(fs_state_t *fs_state);
 static uint32_t cluster_start_sector(fs_state_t *fs_state, uint32_t cluster);
-static void debug_sector_list_chain(uint32_t *sectors, uint32_t n);
+static int32_t dir_index_build(fs_state_t *fs_state, vfs_inode_t *inode,
+                               dir_index_t **res);
+static int32_t dir_index_add(dir_index_t *index, const char *name,
+                             uint32_t sector, uint32_t entry_index);
+static void dir_index_link(dir_index_t *index, uint32_t i);
+static dir_index_entry_t *dir_index_find(dir_index_t *index, const char *name);
+static void dir_index_free(dir_index_t *index);
 
 void fat_init()
 {
@@ -194,13 +351,10 @@ static int32_t fs_type_mount(const char *dev, vfs_superblock_t **superblock)
 
     // Initialize state
     fs_state->dev_handle = dev_handle;
-    fs_state->fat_cache = NULL;
-    fs_state->io_buf = NULL;
+    fs_state->fat_cache_data = NULL;
     fs_state->media_changed = false;
-
-    // Allocate read buffer
-    if (!(fs_state->io_buf = kalloc(BLOCK_SIZE)))
-        goto fail;
+    fs_state->free_hint = 2;
+    fs_state->fsinfo_stale = false;
 
     // Read BIOS parameter block
     if (!read_bpb(fs_state))
@@ -210,8 +364,12 @@ static int32_t fs_type_mount(const char *dev, vfs_superblock_t **superblock)
     if (!check_fat_magically(&fs_state->bpb))
         goto fail;
 
-    // Fill FAT cache
-    if (!read_fat_cache(fs_state))
+    // Find out FAT type and layout
+    if (!read_geometry(fs_state))
+        goto fail;
+
+    // Set up FAT cache
+    if (!init_fat_cache(fs_state))
         goto fail;
 
     // Get root directory inode
@@ -228,6 +386,8 @@ static int32_t fs_type_mount(const char *dev, vfs_superblock_t **superblock)
     sb->fs_state = fs_state;
     sb->root = root;
     sb->unmount = superblock_unmount;
+    sb->changed = superblock_changed;
+    sb->sync = superblock_sync;
 
     // Copy superblock structure pointer to caller
     *superblock = sb;
@@ -246,6 +406,11 @@ static void superblock_unmount(vfs_superblock_t *superblock)
 {
     fs_state_t *state = superblock->fs_state;
 
+    // Write back modified FAT sectors
+    // Releasing the handle flushes them to the device
+    if (!state->media_changed)
+        fat_flush(state);
+
     // Release block device handle
     blkdev_release_handle(state->dev_handle);
 
@@ -259,17 +424,42 @@ static void superblock_unmount(vfs_superblock_t *superblock)
     kfree(superblock);
 }
 
+static bool superblock_changed(vfs_superblock_t *superblock)
+{
+    return check_media_changed(superblock->fs_state);
+}
+
+static int32_t superblock_sync(vfs_superblock_t *superblock)
+{
+    fs_state_t *fs_state = superblock->fs_state;
+
+    // Modified data belongs to the old media
+    if (check_media_changed(fs_state))
+        return E_MDCHNG;
+
+    int32_t err = fat_flush(fs_state);
+    if (err < 0)
+        return err;
+
+    if (!blkdev_sync(fs_state->dev_handle))
+        return E_IOERR;
+
+    return 0;
+}
+
 // Read Bios Parameter Block values into the filesystem state
 static bool read_bpb(fs_state_t *fs_state)
 {
 
     // Read superblock
-    if (!blkdev_read(fs_state->io_buf, fs_state->dev_handle, 0))
+    blkdev_buf_t *buf = blkdev_get_buf(fs_state->dev_handle, 0);
+    if (!buf)
         return false;
 
     // Copy values into state
-    bpb_t *bpb = (bpb_t *)fs_state->io_buf;
+    bpb_t *bpb = (bpb_t *)buf->data;
     fs_state->bpb = *bpb;
+    blkdev_release_buf(buf);
 
 #ifdef DEBUG
     kprintf("[FAT] Superblock information\n");
@@ -280,23 +470,106 @@ static bool read_bpb(fs_state_t *fs_state)
     return true;
 }
 
-// Read FAT into the filesystem state
-static bool read_fat_cache(fs_state_t *fs_state)
+// Compute the layout of the filesystem from the BPB
+static bool read_geometry(fs_state_t *fs_state)
 {
-    // Find FAT starting sector
-    uint32_t fat_start = fs_state->bpb.reserved_sectors;
+    bpb_t *bpb = &fs_state->bpb;
+
+    // FAT32 has no 16 bit FAT size
+    bool fat32_bpb = bpb->sectors_per_fat == 0;
+    fs_state->sectors_per_fat = fat32_bpb ? bpb->sectors_per_fat_32
+                                          : bpb->sectors_per_fat;
+
+    // Root directory region (FAT12 and FAT16 only)
+    uint32_t root_start = bpb->reserved_sectors +
+                          bpb->n_fats * fs_state->sectors_per_fat;
+    uint32_t root_sectors = (bpb->root_entries * sizeof(fat_dir_entry_t) +
+                             BLOCK_SIZE - 1) /
+                            BLOCK_SIZE;
+
+    // Set data area information in fs state
+    fs_state->data_start = root_start + root_sectors;
+    uint32_t total_sectors = bpb->n_sectors ? bpb->n_sectors
+                                            : bpb->large_sector_count;
+    fs_state->data_sectors = total_sectors > fs_state->data_start
+                                 ? total_sectors - fs_state->data_start
+                                 : 0;
+
+    // The FAT type is only given by the number of clusters
+    uint32_t n_clusters = fs_state->data_sectors / bpb->sectors_per_cluster;
+    uint32_t entry_bits;
+    if (n_clusters < 4085)
+    {
+        fs_state->type = FAT12;
+        fs_state->fat_eoc = 0xFFF;
+        entry_bits = 12;
+    }
+    else if (n_clusters < 65525)
+    {
+        fs_state->type = FAT16;
+        fs_state->fat_eoc = 0xFFFF;
+        entry_bits = 16;
+    }
+    else
+    {
+        fs_state->type = FAT32;
+        fs_state->fat_eoc = 0x0FFFFFFF;
+        entry_bits = 32;
+    }
 
-    // Allocate FAT cache
-    if (!(fs_state->fat_cache = kalloc(fs_state->bpb.sectors_per_fat * BLOCK_SIZE)))
+    // The BPB has to agree
+    if (fat32_bpb != (fs_state->type == FAT32) || (fat32_bpb && root_sectors))
         return false;
 
-    // Read FAT into memory
-    if (!blkdev_read_n(fs_state->fat_cache, fs_state->dev_handle, fat_start,
-                       fs_state->bpb.sectors_per_fat))
+    // Clusters are also limited by the FAT size
+    uint32_t fat_entries = (uint64_t)fs_state->sectors_per_fat * BLOCK_SIZE * 8 / entry_bits;
+    if (fat_entries < 2)
+        n_clusters = 0;
+    else if (n_clusters > fat_entries - 2)
+        n_clusters = fat_entries - 2;
+    fs_state->n_clusters = n_clusters;
+
+    // FAT32 can be set to only use one of the FATs
+    uint32_t active = 0;
+    fs_state->fat_mirror = true;
+    if (fs_state->type == FAT32 && (bpb->ext_flags & EXT_FLAGS_NO_MIRROR))
+    {
+        active = bpb->ext_flags & EXT_FLAGS_ACTIVE_FAT;
+        fs_state->fat_mirror = false;
+        if (active >= bpb->n_fats)
+            return false;
+    }
+    fs_state->fat_start = bpb->reserved_sectors + active * fs_state->sectors_per_fat;
+
+    fs_state->root_cluster = 0;
+    if (fs_state->type == FAT32)
     {
-        kfree(fs_state->fat_cache);
+        fs_state->root_cluster = bpb->root_cluster;
+        if (fs_state->root_cluster < 2 || fs_state->root_cluster >= n_clusters + 2)
+            return false;
+    }
+
+#ifdef DEBUG
+    kprintf("[FAT] FAT%u, %u clusters\n", entry_bits, n_clusters);
+#endif
+
+    return true;
+}
+
+// Allocate FAT sector cache
+static bool init_fat_cache(fs_state_t *fs_state)
+{
+    if (!(fs_state->fat_cache_data = kalloc(FAT_CACHE_SIZE * BLOCK_SIZE)))
         return false;
+
+    for (size_t i = 0; i < FAT_CACHE_SIZE; i++)
+    {
+        fs_state->fat_cache[i].valid = false;
+        fs_state->fat_cache[i].dirty = false;
+        fs_state->fat_cache[i].last_use = 0;
+        fs_state->fat_cache[i].data = fs_state->fat_cache_data + i * BLOCK_SIZE;
     }
+    fs_state->fat_cache_clock = 0;
 
     return true;
 }
@@ -305,11 +578,7 @@ static bool read_fat_cache(fs_state_t *fs_state)
 static void inode_destroy(vfs_inode_t *inode)
 {
     // Free private data
-    inode_private_t *prdata = inode->priv_data;
-    kfree(prdata->sector_list);
-
-    // Free inode fields
-    kfree(inode->priv_data);
+    free_inode_pdata(inode->priv_data);
 
     // kprintf("Inode destroy!\n");
 
@@ -328,7 +597,12 @@ static bool check_fat_magically(bpb_t *bpb)
     if (bpb->bytes_per_sector != 512)
         return false;
 
-    if (bpb->signature != 0x28 && bpb->signature != 0x29)
+    if (bpb->sectors_per_cluster == 0)
+        return false;
+
+    // The EBPB of FAT32 is different
+    uint8_t signature = bpb->sectors_per_fat ? bpb->signature : bpb->signature_32;
+    if (signature != 0x28 && signature != 0x29)
         return false;
 
     return true;
@@ -337,12 +611,8 @@ static bool check_fat_magically(bpb_t *bpb)
 static void destroy_fs_state(fs_state_t *state)
 {
     // Free FAT cache
-    if (state->fat_cache)
-        kfree(state->fat_cache);
-
-    // Free IO buffer
-    if (state->io_buf)
-        kfree(state->io_buf);
+    if (state->fat_cache_data)
+        kfree(state->fat_cache_data);
 
     // Free fs state object
     kfree(state);
@@ -351,35 +621,34 @@ static void destroy_fs_state(fs_state_t *state)
 // Construct root directory inode
 static vfs_inode_t *get_root_inode(fs_state_t *fs_state)
 {
-    // Compute sector information
-    uint32_t start_sec = fs_state->bpb.reserved_sectors +
-                         (fs_state->bpb.n_fats *
-                          fs_state->bpb.sectors_per_fat);
-
-    uint32_t n_sectors = (fs_state->bpb.root_entries *
-                              sizeof(fat_dir_entry_t) +
-                          BLOCK_SIZE - 1) /
-                         BLOCK_SIZE;
+    inode_private_t *pdata;
 
-    // Set data start in fs state
-    fs_state->data_start = start_sec + n_sectors;
-
-    // Allocate space for the sector list
-    uint32_t *sector_list = kalloc(sizeof(uint32_t) * n_sectors);
-    if (!sector_list)
-        goto fail_nomem_sectlist;
-
-    // Fill sector list
-    for (uint32_t i = 0; i < n_sectors; i++)
-        sector_list[i] = start_sec + i;
-
-    // Allocate space for root private data
-    inode_private_t *pdata = kalloc(sizeof(inode_private_t));
-    if (!pdata)
-        goto fail_nomem_pdata;
+    if (fs_state->type == FAT32)
+    {
+        // The root directory is a cluster chain like any other
+        // directory, map all of it
+        if (!(pdata = alloc_inode_pdata(fs_state->root_cluster)))
+            goto fail_nomem_pdata;
 
-    // Initialize private data
-    pdata->sector_list = sector_list;
+        while (pdata->next_cluster)
+        {
+            if (extents_extend(fs_state, pdata) < 0)
+                goto fail_nomem_inode;
+        }
+    }
+    else
+    {
+        // The root directory isn't a cluster chain, but a fixed region
+        // before the data area
+        uint32_t start_sec = fs_state->bpb.reserved_sectors +
+                             fs_state->bpb.n_fats * fs_state->sectors_per_fat;
+        uint32_t n_sectors = fs_state->data_start - start_sec;
+
+        if (!(pdata = alloc_inode_pdata(0)))
+            goto fail_nomem_pdata;
+        if (extents_append(pdata, start_sec, n_sectors) < 0)
+            goto fail_nomem_inode;
+    }
 
     // Allocate VFS inode structure
     vfs_inode_t *inode = kalloc(sizeof(vfs_inode_t));
@@ -388,30 +657,36 @@ static vfs_inode_t *get_root_inode(fs_state_t *fs_state)
 
     // Fill inode fields
     inode->name[0] = '\0';
-    inode->size = n_sectors * BLOCK_SIZE;
+    inode->size = pdata->n_sectors * BLOCK_SIZE;
     inode->type = VFS_INTYPE_DIR;
     inode->priv_data = pdata;
     inode->fs_state = fs_state;
-    inode->id = 0; // Cluster 0 is reserved, use it for the root dir
+    inode->id = 0; // Sector 0 holds no directory entries, use it for the root dir
+    inode->ref_count = 0;
     inode->read = NULL;
+    inode->read_blocks = NULL;
+    inode->readahead = NULL;
     inode->write = NULL;
     inode->readdir = inode_readdir;
     inode->lookup = inode_lookup;
+    inode->create = inode_create;
     inode->destroy = inode_destroy;
 
     return inode;
 
 fail_nomem_inode:
-    kfree(pdata);
+    free_inode_pdata(pdata);
 fail_nomem_pdata:
-    kfree(sector_list);
-fail_nomem_sectlist:
     return NULL;
 }
 
 //// Inode functions
-static int64_t inode_readdir(vfs_inode_t *inode, dirent_t *buf,
-                             uint32_t offset, uint32_t n)
+// The cursor holds the sector index and the entry index inside the
+// sector of the next entry
+// It always points after a complete entry, so there is never a pending
+// long filename to keep
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n)
 {
     fs_state_t *fs_state = inode->fs_state;
     inode_private_t *pdata = inode->priv_data;
@@ -423,25 +698,39 @@ static int64_t inode_readdir(vfs_inode_t *inode, dirent_t *buf,
     // Find out number of directory sectors
     uint32_t n_sectors = inode->size / BLOCK_SIZE;
 
+    // Continue from the cursor if possible, else start over
+    if (cursor->offset > offset)
+    {
+        cursor->offset = 0;
+        cursor->block = 0;
+        cursor->index = 0;
+    }
+
     // Initialize LFN buffer
     lfn_buf_t lfn_buf;
     lfn_buf_init(&lfn_buf);
 
     // Read directory sector by sector
-    uint32_t dirs_read = 0, dirs_skipped = 0;
+    uint32_t dirs_read = 0;
     bool more_dirs = true;
-    for (size_t i = 0; (i < n_sectors) && more_dirs && (dirs_read < n); i++)
+    char name_buf[FILENAME_MAX];
+    while (cursor->block < n_sectors && more_dirs && dirs_read < n)
     {
-        uint32_t block = pdata->sector_list[i];
-
-        // Read sector into IO guuffer
-        if (!blkdev_read(fs_state->io_buf, fs_state->dev_handle, block))
+        uint32_t block;
+        int32_t err = map_block(fs_state, pdata, cursor->block, &block);
+        if (err < 0)
+            return err;
+
+        // Get cached sector
+        blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, block);
+        if (!sec_buf)
             return E_IOERR;
 
         // Read all directory entries in the sector
-        for (size_t j = 0; j < BLOCK_SIZE / sizeof(fat_dir_entry_t); j++)
+        for (; cursor->index < BLOCK_SIZE / sizeof(fat_dir_entry_t) && dirs_read < n;
+             cursor->index++)
         {
-            fat_dir_entry_t *entry = &((fat_dir_entry_t *)fs_state->io_buf)[j];
+            fat_dir_entry_t *entry = &((fat_dir_entry_t *)sec_buf->data)[cursor->index];
 
             // If first byte of entry is 0, there are no more dirctories
             if (entry->s_name[0] == 0x00)
@@ -468,172 +757,134 @@ static int64_t inode_readdir(vfs_inode_t *inode, dirent_t *buf,
 
             // Check if an LFN was read
             if (lfn_buf.n)
-                direntry_name_from_lfn(buf[dirs_read].name, &lfn_buf);
+                direntry_name_from_lfn(name_buf, &lfn_buf);
             else
-                direntry_name_from_short(buf[dirs_read].name, entry);
+                direntry_name_from_short(name_buf, entry);
 
             // Reset LFN buffer
             lfn_buf_init(&lfn_buf);
 
             // Ignore metadirectories '.' and '..'
-            if (strcmp(buf[dirs_read].name, "..") == 0 ||
-                strcmp(buf[dirs_read].name, ".") == 0)
+            if (strcmp(name_buf, "..") == 0 ||
+                strcmp(name_buf, ".") == 0)
                 continue;
 
-            kprintf("Dir: %s\n", buf[dirs_read].name);
+            // Skip entries before the requested offset
+            if (cursor->offset++ < offset)
+                continue;
 
-            if (dirs_skipped == offset)
-            {
-                buf[dirs_read].size = entry->s_size;
-                buf[dirs_read].type = (entry->attrs & ATTR_DIR) != 0;
-                dirs_read++;
-            }
-            else
-            {
-                dirs_skipped++;
-            }
+            strcpy(buf[dirs_read].name, name_buf);
+            buf[dirs_read].size = entry->s_size;
+            buf[dirs_read].type = (entry->attrs & ATTR_DIR) != 0;
+            dirs_read++;
+        }
 
-            lfn_buf_init(&lfn_buf);
+        blkdev_release_buf(sec_buf);
+
+        // Move on to the next sector
+        if (cursor->index == BLOCK_SIZE / sizeof(fat_dir_entry_t))
+        {
+            cursor->block++;
+            cursor->index = 0;
         }
     }
 
     return dirs_read;
 }
 
+// Names are looked up in an index of the directory, which is built
+// the first time and kept with the inode
 static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, const char *name)
 {
     fs_state_t *fs_state = inode->fs_state;
     inode_private_t *pdata = inode->priv_data;
 
-    // Find out number of directory sectors
-    uint32_t n_sectors = inode->size / BLOCK_SIZE;
-
     // Handle media change
     if (check_media_changed(fs_state))
-        return E_MDCHNG;
-
-    // Initialize LFN buffer
-    lfn_buf_t lfn_buf;
-    lfn_buf_init(&lfn_buf);
-
-    // Read directory sector by sector
-    uint32_t dirs_read = 0;
-    bool more_dirs = true;
-    char name_buf[FILENAME_MAX];
-    for (size_t i = 0; i < n_sectors && more_dirs; i++)
     {
-        uint32_t block = pdata->sector_list[i];
-
-        // Read sector into IO guuffer
-        if (!blkdev_read(fs_state->io_buf, fs_state->dev_handle, block))
-            return E_IOERR;
-
-        // Read all directory entries in the sector
-        for (fat_dir_entry_t *entry = (fat_dir_entry_t *)fs_state->io_buf;
-             entry < (fat_dir_entry_t *)fs_state->io_buf + BLOCK_SIZE; entry++)
+        // Index doesn't describe the media anymore
+        if (pdata->index)
         {
+            dir_index_free(pdata->index);
+            pdata->index = NULL;
+        }
 
-            // If first byte of entry is 0, there are no more dirctories
-            if (entry->s_name[0] == 0x00)
-            {
-                more_dirs = false;
-                break;
-            }
-
-            // If first byte of entry is 0xE5, the entry is unused
-            // Ignore it
-            if (entry->s_name[0] == 0xE5)
-                continue;
-
-            // Check if this is a long filename entry
-            if (entry->attrs == ATTR_LFN)
-            {
-                process_lfn_entry(&lfn_buf, entry);
-                continue;
-            }
+        return E_MDCHNG;
+    }
 
-            // Ignore Volume ID entries
-            if (entry->attrs & ATTR_VOLID)
-                continue;
+    // Index directory
+    if (!pdata->index)
+    {
+        int32_t err = dir_index_build(fs_state, inode, &pdata->index);
+        if (err < 0)
+            return err;
+    }
 
-            // Get name of entry
-            if (lfn_buf.n)
-                direntry_name_from_lfn(name_buf, &lfn_buf);
-            else
-                direntry_name_from_short(name_buf, entry);
+    dir_index_entry_t *found = dir_index_find(pdata->index, name);
+    if (!found)
+        return E_NOENT;
 
-            // Reset LFN buffer
-            lfn_buf_init(&lfn_buf);
+    return inode_from_dirent(fs_state, found->name, found->sector, found->index, res);
+}
 
-            // Ignore metadirectories '.' and '..'
-            if (strcmp(name_buf, "..") == 0 ||
-                strcmp(name_buf, ".") == 0)
-                continue;
+// Only files with valid 8.3 names can be created
+static int32_t inode_create(vfs_inode_t *inode, vfs_inode_t **res, const char *name,
+                            vfs_inode_type_t type)
+{
+    fs_state_t *fs_state = inode->fs_state;
+    inode_private_t *pdata = inode->priv_data;
 
-            // Compare entry name with requested filename
-            if (strcmp(name_buf, name) == 0)
-            {
-                // Found file!
-
-                // Check if file is a directory
-                bool is_dir = (entry->attrs & ATTR_DIR) != 0;
-
-                // Compute sector list length
-                uint32_t n = follow_sector_chain(NULL, fs_state, entry->s_fat_entry_low);
-
-                // Sanity check number of sectors
-                // Only check on files, not directories
-                if (!is_dir && n != nblocks(entry->s_size))
-                    return E_INCON;
-
-                // Allocate inode private data
-                inode_private_t *new_pdata = kalloc(sizeof(inode_private_t));
-                if (!pdata)
-                    return E_NOMEM;
-
-                // Allocate and construct sector list
-                uint32_t *sector_list = kalloc(sizeof(uint32_t) * n);
-                if (!sector_list)
-                {
-                    free_inode_pdata(pdata);
-                    return E_NOMEM;
-                }
-                follow_sector_chain(sector_list, fs_state, entry->s_fat_entry_low);
-                new_pdata->sector_list = sector_list;
-
-                // Construct inode
-                vfs_inode_t *new_inode = kalloc(sizeof(vfs_inode_t));
-                if (!new_inode)
-                {
-                    free_inode_pdata(pdata);
-                    return E_NOMEM;
-                }
-
-                strcpy(new_inode->name, name_buf);
-                // FAT directories don't have a size, round it up to the number
-                // of sectors
-                new_inode->size = is_dir ? BLOCK_SIZE * n : entry->s_size;
-                new_inode->type = is_dir ? VFS_INTYPE_DIR : VFS_INTYPE_FILE;
-                new_inode->priv_data = new_pdata;
-                new_inode->fs_state = fs_state;
-                new_inode->id = entry->s_fat_entry_low;
-                new_inode->read = is_dir ? NULL : inode_read;
-                new_inode->write = NULL;
-                new_inode->readdir = is_dir ? inode_readdir : NULL;
-                new_inode->lookup = is_dir ? inode_lookup : NULL;
-                new_inode->destroy = inode_destroy;
-
-                *res = new_inode;
-                return 0;
-            }
+    // Only files can be created
+    if (type != VFS_INTYPE_FILE)
+        return E_NOIMPL;
 
-            // has_lfn = false;
-        }
+    // Handle media change
+    if (check_media_changed(fs_state))
+        return E_MDCHNG;
 
-        return E_NOENT;
+    fat_dir_entry_t new_entry;
+    if (!short_name_from_name(&new_entry, name))
+        return E_INVREQ;
+
+    // Find place for the new entry
+    uint32_t sector, index;
+    int32_t err = dirent_find_free(fs_state, inode, &sector, &index);
+    if (err < 0)
+        return err;
+
+    // Empty file, without clusters
+    new_entry.attrs = ATTR_ARCHIVE;
+    new_entry._s_res0 = 0;
+    new_entry.s_creation_time_fine = 0;
+    new_entry.s_creation_time = 0;
+    new_entry.s_creation_date = 0;
+    new_entry.s_last_accessed_date = 0;
+    new_entry.s_fat_entry_high = 0;
+    new_entry.s_last_modified_time = 0;
+    new_entry.s_last_modified_date = 0;
+    new_entry.s_fat_entry_low = 0;
+    new_entry.s_size = 0;
+
+    blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, sector);
+    if (!sec_buf)
+        return E_IOERR;
+    ((fat_dir_entry_t *)sec_buf->data)[index] = new_entry;
+    blkdev_mark_dirty(sec_buf);
+    blkdev_release_buf(sec_buf);
+
+    // Keep directory index up to date
+    if (pdata->index && dir_index_add(pdata->index, name, sector, index) < 0)
+    {
+        dir_index_free(pdata->index);
+        pdata->index = NULL;
     }
+    else if (pdata->index)
+        dir_index_link(pdata->index, pdata->index->n_entries - 1);
 
-    return dirs_read;
+    if ((err = fat_flush(fs_state)) < 0)
+        return err;
+
+    return inode_from_dirent(fs_state, name, sector, index, res);
 }
 
 static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
@@ -646,31 +897,51 @@ static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
     if (check_media_changed(fs_state))
         return E_MDCHNG;
 
-    // Find out number of file blocks
-    uint32_t n_blocks = nblocks(inode->size);
-
-    // Compute start sector
-    uint32_t start_block = offset / BLOCK_SIZE;
+    // Clamp with file size
+    if (offset >= inode->size)
+        return 0;
+    if (n > inode->size - offset)
+        n = inode->size - offset;
 
+    // The request is split into a partial head sector, runs of whole
+    // sectors and a partial tail sector
     uint32_t bytes_read = 0;
-
-    for (uint32_t block = start_block; block < n_blocks && bytes_read < n;
-         block++)
+    while (bytes_read < n)
     {
-        uint32_t sector = pdata->sector_list[block];
+        uint32_t sector;
+        int32_t run = map_block(fs_state, pdata, offset / BLOCK_SIZE, &sector);
+        if (run < 0)
+            return run;
+
+        uint32_t int_offset = offset % BLOCK_SIZE; // Offset inside the sector
+        uint32_t whole = (n - bytes_read) / BLOCK_SIZE;
+
+        // Read whole sectors straight into the caller's buffer,
+        // one request per extent
+        if (int_offset == 0 && whole)
+        {
+            if (whole > (uint32_t)run)
+                whole = run;
+
+            if (!blkdev_read_n(buf + bytes_read, fs_state->dev_handle, sector, whole))
+                return E_IOERR;
 
-        // Read sector into IO guuffer
-        if (!blkdev_read(fs_state->io_buf, fs_state->dev_handle, sector))
+            bytes_read += whole * BLOCK_SIZE;
+            offset += whole * BLOCK_SIZE;
+            continue;
+        }
+
+        // Partial sectors go through the buffer cache
+        blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, sector);
+        if (!sec_buf)
             return E_IOERR;
 
         // Copy bytes
-        uint32_t int_offset = offset % BLOCK_SIZE;        // Offset inside the sector
         uint32_t bytes_to_copy = BLOCK_SIZE - int_offset; // How many bytes to copy
         if (bytes_to_copy > n - bytes_read)               // Clamp with buffer size
             bytes_to_copy = n - bytes_read;
-        if (bytes_to_copy > inode->size - offset) // Clamp with file size
-            bytes_to_copy = inode->size - offset;
-        memcpy(buf + bytes_read, fs_state->io_buf + int_offset, bytes_to_copy);
+        memcpy(buf + bytes_read, sec_buf->data + int_offset, bytes_to_copy);
+        blkdev_release_buf(sec_buf);
         bytes_read += bytes_to_copy;
         offset += bytes_to_copy;
     }
@@ -678,75 +949,447 @@ static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
     return bytes_read;
 }
 
-// Fill directory entry name from 8.3 directory entry
-static void direntry_name_from_short(char *name, fat_dir_entry_t *entry)
+static int64_t inode_read_blocks(vfs_inode_t *inode, uint8_t *buf,
+                                 uint32_t block, uint32_t n)
 {
-    size_t n = 0;
+    fs_state_t *fs_state = inode->fs_state;
+    inode_private_t *pdata = inode->priv_data;
 
-    // Check if there is an extension
-    bool has_ext = false;
-    for (size_t i = 0; i < 3; i++)
-    {
-        if (entry->s_ext[i] != ' ')
-            has_ext = true;
-    }
+    // Handle media change
+    if (check_media_changed(fs_state))
+        return E_MDCHNG;
 
-    // Read name field
-    for (size_t i = 0; i < 8; i++)
-    {
-        // Remove spaces (they are used as padding ?!?! Why not a
-        // non-printable character?)
-        if (entry->s_name[i] != ' ')
-        {
-            name[n] = entry->s_name[i];
-            n++;
-        }
-    }
+    // Clamp with number of file blocks
+    uint32_t n_blocks = nblocks(inode->size);
+    if (block >= n_blocks)
+        return 0;
+    if (n > n_blocks - block)
+        n = n_blocks - block;
 
-    if (has_ext)
+    uint32_t blocks_read = 0;
+    while (blocks_read < n)
     {
-        // Add extemsion separator ('.')
-        name[n] = '.';
-        n++;
-    }
+        // Find run of sectors contiguous on the device
+        uint32_t start;
+        int32_t run = map_block(fs_state, pdata, block + blocks_read, &start);
+        if (run < 0)
+            return run;
+        if ((uint32_t)run > n - blocks_read)
+            run = n - blocks_read;
+
+        // Read the whole run straight into the caller's buffer
+        if (!blkdev_read_n(buf + blocks_read * BLOCK_SIZE, fs_state->dev_handle,
+                           start, run))
+            return E_IOERR;
 
-    for (size_t i = 0; i < 3; i++)
-    {
-        // Remove spaces (they are used as padding ?!?! Why not a
-        // non-printable character?)
-        if (entry->s_ext[i] != ' ')
-        {
-            name[n] = entry->s_ext[i];
-            n++;
-        }
+        blocks_read += run;
     }
 
-    // Null-terminate name
-    name[n] = 0;
-
-    // Convert name to lowercase (Linux does this)
-    str_to_lower(name);
+    return blocks_read;
 }
 
-// Fill directory entry buffer from LFN
-static void direntry_name_from_lfn(char *name, lfn_buf_t *lfn_buf)
+// Runs of sectors contiguous on the device are prefetched with a
+// single request each
+static int32_t inode_readahead(vfs_inode_t *inode, uint32_t block, uint32_t n)
 {
-    memcpy(name, lfn_buf->name, lfn_buf->n);
-    name[lfn_buf->n] = 0;
-}
+    fs_state_t *fs_state = inode->fs_state;
+    inode_private_t *pdata = inode->priv_data;
 
-// Convert string to lowercase
-static void str_to_lower(char *str)
-{
-    while (*str)
+    // Handle media change
+    if (check_media_changed(fs_state))
+        return E_MDCHNG;
+
+    // Clamp with number of file blocks
+    uint32_t n_blocks = nblocks(inode->size);
+    if (block >= n_blocks)
+        return 0;
+    if (n > n_blocks - block)
+        n = n_blocks - block;
+
+    while (n)
     {
-        if (*str >= 'A' && *str <= 'Z')
-            *str = *str - 'A' + 'a';
-        str++;
+        uint32_t start;
+        int32_t run = map_block(fs_state, pdata, block, &start);
+        if (run < 0)
+            return run;
+        if ((uint32_t)run > n)
+            run = n;
+
+        // Out of clean buffers, the rest would not fit either
+        if (blkdev_prefetch(fs_state->dev_handle, start, run) < (uint32_t)run)
+            break;
+
+        block += run;
+        n -= run;
     }
+
+    return 0;
 }
 
-// Initialize lfn buffer
+// Data goes through the buffer cache and reaches the device when it
+// is flushed
+static int64_t inode_write(vfs_inode_t *inode, const uint8_t *buf,
+                           uint32_t offset, uint32_t n)
+{
+    fs_state_t *fs_state = inode->fs_state;
+    inode_private_t *pdata = inode->priv_data;
+
+    // Handle media change
+    if (check_media_changed(fs_state))
+        return E_MDCHNG;
+
+    // Files can't have holes
+    if (offset > inode->size || n > UINT32_MAX - offset)
+        return E_INVREQ;
+    if (!n)
+        return 0;
+
+    // Allocate clusters for the new data
+    // If the disk fills up, write as much as fits
+    int32_t err = chain_grow(fs_state, pdata, nblocks(offset + n));
+    if (err == E_NOSPC && pdata->n_sectors * BLOCK_SIZE > offset)
+        n = pdata->n_sectors * BLOCK_SIZE - offset;
+    else if (err < 0)
+        goto fail;
+
+    uint32_t bytes_written = 0;
+    while (bytes_written < n)
+    {
+        uint32_t sector;
+        int32_t run = map_block(fs_state, pdata, offset / BLOCK_SIZE, &sector);
+        if (run < 0)
+        {
+            err = run;
+            goto fail;
+        }
+
+        uint32_t int_offset = offset % BLOCK_SIZE; // Offset inside the sector
+        uint32_t bytes_to_copy = BLOCK_SIZE - int_offset;
+        if (bytes_to_copy > n - bytes_written)
+            bytes_to_copy = n - bytes_written;
+
+        // Sectors whose old contents don't matter aren't read
+        bool overwrite = int_offset == 0 &&
+                         (bytes_to_copy == BLOCK_SIZE || offset >= inode->size);
+        blkdev_buf_t *sec_buf = overwrite
+                                    ? blkdev_get_new_buf(fs_state->dev_handle, sector)
+                                    : blkdev_get_buf(fs_state->dev_handle, sector);
+        if (!sec_buf)
+        {
+            err = E_IOERR;
+            goto fail;
+        }
+
+        if (overwrite && bytes_to_copy < BLOCK_SIZE)
+            memset(sec_buf->data + bytes_to_copy, 0, BLOCK_SIZE - bytes_to_copy);
+        memcpy(sec_buf->data + int_offset, buf + bytes_written, bytes_to_copy);
+        blkdev_mark_dirty(sec_buf);
+        blkdev_release_buf(sec_buf);
+
+        bytes_written += bytes_to_copy;
+        offset += bytes_to_copy;
+        if (offset > inode->size)
+            inode->size = offset;
+    }
+
+    if ((err = dirent_update(fs_state, inode)) < 0)
+        return err;
+    if ((err = fat_flush(fs_state)) < 0)
+        return err;
+
+    return bytes_written;
+
+fail:
+    // Keep the directory entry in sync with the clusters allocated so far
+    dirent_update(fs_state, inode);
+    fat_flush(fs_state);
+    return err;
+}
+
+// Construct the inode of a directory entry
+static int32_t inode_from_dirent(fs_state_t *fs_state, const char *name,
+                                 uint32_t sector, uint32_t index, vfs_inode_t **res)
+{
+    // Read directory entry
+    blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, sector);
+    if (!sec_buf)
+        return E_IOERR;
+    fat_dir_entry_t entry = ((fat_dir_entry_t *)sec_buf->data)[index];
+    blkdev_release_buf(sec_buf);
+
+    // Allocate inode private data
+    // File extents are built as the file is read
+    inode_private_t *new_pdata = alloc_inode_pdata(dirent_cluster(fs_state, &entry));
+    if (!new_pdata)
+        return E_NOMEM;
+    new_pdata->dirent_sector = sector;
+    new_pdata->dirent_index = index;
+
+    // FAT directories don't have a size, follow the whole
+    // cluster chain to find it
+    bool is_dir = (entry.attrs & ATTR_DIR) != 0;
+    if (is_dir)
+    {
+        while (new_pdata->next_cluster)
+        {
+            int32_t err = extents_extend(fs_state, new_pdata);
+            if (err < 0)
+            {
+                free_inode_pdata(new_pdata);
+                return err;
+            }
+        }
+    }
+
+    // Construct inode
+    vfs_inode_t *new_inode = kalloc(sizeof(vfs_inode_t));
+    if (!new_inode)
+    {
+        free_inode_pdata(new_pdata);
+        return E_NOMEM;
+    }
+
+    strcpy(new_inode->name, name);
+    // Round directory size up to the number of sectors
+    new_inode->size = is_dir ? BLOCK_SIZE * new_pdata->n_sectors
+                             : entry.s_size;
+    new_inode->type = is_dir ? VFS_INTYPE_DIR : VFS_INTYPE_FILE;
+    new_inode->priv_data = new_pdata;
+    new_inode->fs_state = fs_state;
+    // The location of the directory entry is unique, unlike the first
+    // cluster, which is 0 for all empty files
+    new_inode->id = sector * DIRENTS_PER_SECTOR + index;
+    new_inode->ref_count = 0;
+    new_inode->read = is_dir ? NULL : inode_read;
+    new_inode->read_blocks = is_dir ? NULL : inode_read_blocks;
+    new_inode->readahead = is_dir ? NULL : inode_readahead;
+    new_inode->write = is_dir ? NULL : inode_write;
+    new_inode->readdir = is_dir ? inode_readdir : NULL;
+    new_inode->lookup = is_dir ? inode_lookup : NULL;
+    new_inode->create = is_dir ? inode_create : NULL;
+    new_inode->destroy = inode_destroy;
+
+    *res = new_inode;
+    return 0;
+}
+
+// Write size and first cluster of a file to its directory entry
+static int32_t dirent_update(fs_state_t *fs_state, vfs_inode_t *inode)
+{
+    inode_private_t *pdata = inode->priv_data;
+
+    blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, pdata->dirent_sector);
+    if (!sec_buf)
+        return E_IOERR;
+
+    fat_dir_entry_t *entry = &((fat_dir_entry_t *)sec_buf->data)[pdata->dirent_index];
+    entry->s_size = inode->size;
+    entry->s_fat_entry_low = pdata->first_cluster & 0xFFFF;
+    if (fs_state->type == FAT32)
+        entry->s_fat_entry_high = pdata->first_cluster >> 16;
+    entry->attrs |= ATTR_ARCHIVE;
+
+    blkdev_mark_dirty(sec_buf);
+    blkdev_release_buf(sec_buf);
+
+    return 0;
+}
+
+// Find an unused entry in a directory
+// Subdirectories are grown by a cluster if they are full, the root
+// directory has a fixed size
+static int32_t dirent_find_free(fs_state_t *fs_state, vfs_inode_t *inode,
+                                uint32_t *sector, uint32_t *index)
+{
+    inode_private_t *pdata = inode->priv_data;
+    uint32_t n_sectors = inode->size / BLOCK_SIZE;
+
+    for (uint32_t i = 0; i < n_sectors; i++)
+    {
+        uint32_t block;
+        int32_t err = map_block(fs_state, pdata, i, &block);
+        if (err < 0)
+            return err;
+
+        blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, block);
+        if (!sec_buf)
+            return E_IOERR;
+
+        // Entries after the end of the directory (0x00) are all free
+        for (uint32_t j = 0; j < DIRENTS_PER_SECTOR; j++)
+        {
+            uint8_t first = ((fat_dir_entry_t *)sec_buf->data)[j].s_name[0];
+            if (first == 0x00 || first == 0xE5)
+            {
+                blkdev_release_buf(sec_buf);
+                *sector = block;
+                *index = j;
+                return 0;
+            }
+        }
+
+        blkdev_release_buf(sec_buf);
+    }
+
+    // Root directory region of FAT12 and FAT16 can't grow
+    if (!pdata->first_cluster)
+        return E_NOSPC;
+
+    // Add a cluster to the directory
+    uint32_t spc = fs_state->bpb.sectors_per_cluster;
+    int32_t err = chain_grow(fs_state, pdata, n_sectors + spc);
+    if (err < 0)
+        return err;
+
+    // An empty cluster marks the end of the directory
+    for (uint32_t i = n_sectors; i < n_sectors + spc; i++)
+    {
+        uint32_t block;
+        if ((err = map_block(fs_state, pdata, i, &block)) < 0)
+            return err;
+
+        blkdev_buf_t *sec_buf = blkdev_get_new_buf(fs_state->dev_handle, block);
+        if (!sec_buf)
+            return E_IOERR;
+        memset(sec_buf->data, 0, BLOCK_SIZE);
+        blkdev_mark_dirty(sec_buf);
+        blkdev_release_buf(sec_buf);
+
+        if (i == n_sectors)
+            *sector = block;
+    }
+
+    inode->size = pdata->n_sectors * BLOCK_SIZE;
+    *index = 0;
+
+    return 0;
+}
+
+// Fill the 8.3 name of a directory entry
+// Returns false if the name is not a valid lowercase 8.3 name
+static bool short_name_from_name(fat_dir_entry_t *entry, const char *name)
+{
+    memset(entry->s_name, ' ', 8);
+    memset(entry->s_ext, ' ', 3);
+
+    size_t n = 0;
+    bool ext = false;
+    for (; *name; name++)
+    {
+        char c = *name;
+
+        // Start of the extension
+        if (c == '.' && !ext && n > 0)
+        {
+            ext = true;
+            n = 0;
+            continue;
+        }
+
+        // Names are shown in lowercase, so they are only accepted
+        // in lowercase, and stored in uppercase
+        if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
+        else if (!is_short_name_char(c))
+            return false;
+
+        if (n == (ext ? 3 : 8))
+            return false;
+
+        if (ext)
+            entry->s_ext[n++] = c;
+        else
+            entry->s_name[n++] = c;
+    }
+
+    // Name can't be empty, extension can't be empty if there is a '.'
+    return entry->s_name[0] != ' ' && (!ext || n > 0);
+}
+
+// Check if a character other than a letter can be part of an 8.3 name
+static bool is_short_name_char(char c)
+{
+    if (c >= '0' && c <= '9')
+        return true;
+
+    for (const char *cur = "_-~!#$%&'()@^{}"; *cur; cur++)
+    {
+        if (*cur == c)
+            return true;
+    }
+
+    return false;
+}
+
+// Fill directory entry name from 8.3 directory entry
+static void direntry_name_from_short(char *name, fat_dir_entry_t *entry)
+{
+    size_t n = 0;
+
+    // Check if there is an extension
+    bool has_ext = false;
+    for (size_t i = 0; i < 3; i++)
+    {
+        if (entry->s_ext[i] != ' ')
+            has_ext = true;
+    }
+
+    // Read name field
+    for (size_t i = 0; i < 8; i++)
+    {
+        // Remove spaces (they are used as padding ?!?! Why not a
+        // non-printable character?)
+        if (entry->s_name[i] != ' ')
+        {
+            name[n] = entry->s_name[i];
+            n++;
+        }
+    }
+
+    if (has_ext)
+    {
+        // Add extemsion separator ('.')
+        name[n] = '.';
+        n++;
+    }
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        // Remove spaces (they are used as padding ?!?! Why not a
+        // non-printable character?)
+        if (entry->s_ext[i] != ' ')
+        {
+            name[n] = entry->s_ext[i];
+            n++;
+        }
+    }
+
+    // Null-terminate name
+    name[n] = 0;
+
+    // Convert name to lowercase (Linux does this)
+    str_to_lower(name);
+}
+
+// Fill directory entry buffer from LFN
+static void direntry_name_from_lfn(char *name, lfn_buf_t *lfn_buf)
+{
+    memcpy(name, lfn_buf->name, lfn_buf->n);
+    name[lfn_buf->n] = 0;
+}
+
+// Convert string to lowercase
+static void str_to_lower(char *str)
+{
+    while (*str)
+    {
+        if (*str >= 'A' && *str <= 'Z')
+            *str = *str - 'A' + 'a';
+        str++;
+    }
+}
+
+// Initialize lfn buffer
 static void lfn_buf_init(lfn_buf_t *buf)
 {
     buf->n = 0;
@@ -862,60 +1505,637 @@ static inline uint32_t nblocks(uint32_t size)
     return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
+// Allocate inode private data for a cluster chain
+// Cluster 0 means an empty chain
+static inode_private_t *alloc_inode_pdata(uint32_t start_cluster)
+{
+    inode_private_t *pdata = kalloc(sizeof(inode_private_t));
+    if (!pdata)
+        return NULL;
+
+    pdata->extents = NULL;
+    pdata->n_extents = 0;
+    pdata->max_extents = 0;
+    pdata->n_sectors = 0;
+    pdata->first_cluster = start_cluster >= 2 ? start_cluster : 0;
+    pdata->last_cluster = 0;
+    pdata->next_cluster = pdata->first_cluster;
+    pdata->dirent_sector = 0;
+    pdata->dirent_index = 0;
+    pdata->cur_extent = 0;
+    pdata->cur_block = 0;
+    pdata->index = NULL;
+
+    return pdata;
+}
+
 static void free_inode_pdata(inode_private_t *pdata)
 {
-    if (pdata->sector_list)
-        kfree(pdata->sector_list);
+    if (pdata->extents)
+        kfree(pdata->extents);
+
+    if (pdata->index)
+        dir_index_free(pdata->index);
 
     kfree(pdata);
 }
 
-static uint32_t follow_sector_chain(uint32_t *sector_list,
-                                    fs_state_t *fs_state,
-                                    uint32_t start_cluster)
+// Find the sector of a block of an inode, extending the extent list
+// if needed
+// Returns the number of contiguous sectors starting from it,
+// E_INCON if the cluster chain is shorter
+static int32_t map_block(fs_state_t *fs_state, inode_private_t *pdata,
+                         uint32_t block, uint32_t *sector)
 {
-    uint32_t n = 0;
+    // Follow cluster chain up to the block
+    while (block >= pdata->n_sectors)
+    {
+        int32_t res = extents_extend(fs_state, pdata);
+        if (res < 0)
+            return res;
+    }
 
-    uint32_t cluster = start_cluster;
-    do
+    // Find extent containing the block, starting from the last one used
+    if (block < pdata->cur_block)
+    {
+        pdata->cur_extent = 0;
+        pdata->cur_block = 0;
+    }
+    while (block >= pdata->cur_block + pdata->extents[pdata->cur_extent].n)
     {
-        // Add current cluster to list
-        uint32_t sector = cluster_start_sector(fs_state, cluster);
-        for (uint32_t i = 0; i < fs_state->bpb.sectors_per_cluster; i++)
+        pdata->cur_block += pdata->extents[pdata->cur_extent].n;
+        pdata->cur_extent++;
+    }
+
+    extent_t *extent = &pdata->extents[pdata->cur_extent];
+    uint32_t offset = block - pdata->cur_block;
+    *sector = extent->start + offset;
+
+    return extent->n - offset;
+}
+
+// Add the next cluster of the chain to the extent list
+static int32_t extents_extend(fs_state_t *fs_state, inode_private_t *pdata)
+{
+    uint32_t cluster = pdata->next_cluster;
+    if (!cluster)
+        return E_INCON; // End of cluster chain
+
+    int32_t res = extents_append(pdata, cluster_start_sector(fs_state, cluster),
+                                 fs_state->bpb.sectors_per_cluster);
+    if (res < 0)
+        return res;
+    pdata->last_cluster = cluster;
+
+    // Follow cluster link
+    if ((res = read_fat_entry(&cluster, fs_state, cluster)) < 0)
+        return res;
+    if (cluster < 2 || cluster >= fs_state->fat_eoc - 8)
+        cluster = 0; // End of cluster chain
+
+    // A chain longer than the data area must have a loop
+    if (pdata->n_sectors >= fs_state->data_sectors)
+        cluster = 0;
+
+    pdata->next_cluster = cluster;
+    return 0;
+}
+
+// Add sectors to the extent list, growing the last extent if they
+// follow it on the device
+static int32_t extents_append(inode_private_t *pdata, uint32_t start, uint32_t n)
+{
+    extent_t *last = pdata->n_extents ? &pdata->extents[pdata->n_extents - 1] : NULL;
+    if (last && last->start + last->n == start)
+    {
+        last->n += n;
+        pdata->n_sectors += n;
+        return 0;
+    }
+
+    // Grow list
+    if (pdata->n_extents == pdata->max_extents)
+    {
+        uint32_t max = pdata->max_extents ? pdata->max_extents * 2 : 1;
+        extent_t *extents = kalloc(sizeof(extent_t) * max);
+        if (!extents)
+            return E_NOMEM;
+
+        if (pdata->extents)
         {
-            // If sector_list is NULL, count only
-            if (sector_list)
-                sector_list[n] = sector + i;
-            n++;
+            memcpy(extents, pdata->extents, sizeof(extent_t) * pdata->n_extents);
+            kfree(pdata->extents);
         }
 
-        // Follow cluster link
-        if (!read_fat_entry(&cluster, fs_state, cluster))
-            return n; // Entry out of range, stop reading
+        pdata->extents = extents;
+        pdata->max_extents = max;
+    }
 
-    } while (cluster < 0xFF7 && cluster != 0); // End of cluster chain
+    pdata->extents[pdata->n_extents].start = start;
+    pdata->extents[pdata->n_extents].n = n;
+    pdata->n_extents++;
+    pdata->n_sectors += n;
 
-    return n;
+    return 0;
+}
+
+// Make the cluster chain of an inode cover a number of sectors,
+// allocating clusters at its end
+static int32_t chain_grow(fs_state_t *fs_state, inode_private_t *pdata, uint32_t n_sectors)
+{
+    if (pdata->n_sectors >= n_sectors)
+        return 0;
+
+    // Find the end of the chain
+    while (pdata->next_cluster)
+    {
+        int32_t err = extents_extend(fs_state, pdata);
+        if (err < 0)
+            return err;
+    }
+
+    while (pdata->n_sectors < n_sectors)
+    {
+        uint32_t cluster;
+        int32_t err = alloc_cluster(fs_state, &cluster);
+        if (err < 0)
+            return err;
+
+        err = extents_append(pdata, cluster_start_sector(fs_state, cluster),
+                             fs_state->bpb.sectors_per_cluster);
+        if (err < 0)
+        {
+            write_fat_entry(fs_state, cluster, FAT_FREE);
+            return err;
+        }
+
+        // Link to the chain
+        if (pdata->last_cluster &&
+            (err = write_fat_entry(fs_state, pdata->last_cluster, cluster)) < 0)
+            return err;
+        if (!pdata->last_cluster)
+            pdata->first_cluster = cluster;
+        pdata->last_cluster = cluster;
+    }
+
+    return 0;
+}
+
+// Find a free cluster and mark it as the end of a chain
+static int32_t alloc_cluster(fs_state_t *fs_state, uint32_t *cluster)
+{
+    uint32_t n = fs_state->n_clusters;
+
+    // Search from the last allocated cluster, so that files written
+    // one after the other stay contiguous
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t cur = 2 + (fs_state->free_hint - 2 + i) % n;
+
+        uint32_t entry;
+        int32_t err = read_fat_entry(&entry, fs_state, cur);
+        if (err < 0)
+            return err;
+        if (entry != FAT_FREE)
+            continue;
+
+        if ((err = write_fat_entry(fs_state, cur, fs_state->fat_eoc)) < 0)
+            return err;
+
+        // Free cluster count is not kept up to date
+        fsinfo_invalidate(fs_state);
+
+        fs_state->free_hint = cur + 1;
+        *cluster = cur;
+        return 0;
+    }
+
+    return E_NOSPC;
+}
+
+// Read all entries of a directory into a new index
+static int32_t dir_index_build(fs_state_t *fs_state, vfs_inode_t *inode,
+                               dir_index_t **res)
+{
+    inode_private_t *pdata = inode->priv_data;
+    int32_t ret;
+
+    dir_index_t *index = kalloc(sizeof(dir_index_t));
+    if (!index)
+        return E_NOMEM;
+
+    index->entries = NULL;
+    index->n_entries = 0;
+    index->max_entries = 0;
+    index->buckets = NULL;
+
+    // Find out number of directory sectors
+    uint32_t n_sectors = inode->size / BLOCK_SIZE;
+
+    // Initialize LFN buffer
+    lfn_buf_t lfn_buf;
+    lfn_buf_init(&lfn_buf);
+
+    // Read directory sector by sector
+    bool more_dirs = true;
+    char name_buf[FILENAME_MAX];
+    for (size_t i = 0; i < n_sectors && more_dirs; i++)
+    {
+        uint32_t block;
+        if ((ret = map_block(fs_state, pdata, i, &block)) < 0)
+            goto fail;
+
+        // Get cached sector
+        blkdev_buf_t *sec_buf = blkdev_get_buf(fs_state->dev_handle, block);
+        if (!sec_buf)
+        {
+            ret = E_IOERR;
+            goto fail;
+        }
+
+        // Read all directory entries in the sector
+        for (fat_dir_entry_t *entry = (fat_dir_entry_t *)sec_buf->data;
+             entry < (fat_dir_entry_t *)(sec_buf->data + BLOCK_SIZE); entry++)
+        {
+            // If first byte of entry is 0, there are no more dirctories
+            if (entry->s_name[0] == 0x00)
+            {
+                more_dirs = false;
+                break;
+            }
+
+            // If first byte of entry is 0xE5, the entry is unused
+            // Ignore it
+            if (entry->s_name[0] == 0xE5)
+                continue;
+
+            // Check if this is a long filename entry
+            if (entry->attrs == ATTR_LFN)
+            {
+                process_lfn_entry(&lfn_buf, entry);
+                continue;
+            }
+
+            // Ignore Volume ID entries
+            if (entry->attrs & ATTR_VOLID)
+                continue;
+
+            // Get name of entry
+            if (lfn_buf.n)
+                direntry_name_from_lfn(name_buf, &lfn_buf);
+            else
+                direntry_name_from_short(name_buf, entry);
+
+            // Reset LFN buffer
+            lfn_buf_init(&lfn_buf);
+
+            // Ignore metadirectories '.' and '..'
+            if (strcmp(name_buf, "..") == 0 ||
+                strcmp(name_buf, ".") == 0)
+                continue;
+
+            if ((ret = dir_index_add(index, name_buf, block,
+                                     entry - (fat_dir_entry_t *)sec_buf->data)) < 0)
+            {
+                blkdev_release_buf(sec_buf);
+                goto fail;
+            }
+        }
+
+        blkdev_release_buf(sec_buf);
+    }
+
+    // Allocate hash buckets, about one per entry
+    index->n_buckets = 8;
+    while (index->n_buckets < index->n_entries)
+        index->n_buckets *= 2;
+
+    index->buckets = kalloc(sizeof(int32_t) * index->n_buckets);
+    if (!index->buckets)
+    {
+        ret = E_NOMEM;
+        goto fail;
+    }
+
+    for (uint32_t i = 0; i < index->n_buckets; i++)
+        index->buckets[i] = -1;
+
+    // Insert entries in buckets
+    for (uint32_t i = 0; i < index->n_entries; i++)
+        dir_index_link(index, i);
+
+    *res = index;
+    return 0;
+
+fail:
+    dir_index_free(index);
+    return ret;
+}
+
+// Append an entry to a directory index
+// It can be found once it is linked to its hash bucket
+static int32_t dir_index_add(dir_index_t *index, const char *name,
+                             uint32_t sector, uint32_t entry_index)
+{
+    // Grow entry list
+    if (index->n_entries == index->max_entries)
+    {
+        uint32_t max = index->max_entries ? index->max_entries * 2 : 16;
+        dir_index_entry_t *entries = kalloc(sizeof(dir_index_entry_t) * max);
+        if (!entries)
+            return E_NOMEM;
+
+        if (index->entries)
+        {
+            memcpy(entries, index->entries,
+                   sizeof(dir_index_entry_t) * index->n_entries);
+            kfree(index->entries);
+        }
+
+        index->entries = entries;
+        index->max_entries = max;
+    }
+
+    dir_index_entry_t *new = &index->entries[index->n_entries++];
+    strcpy(new->name, name);
+    new->sector = sector;
+    new->index = entry_index;
+
+    return 0;
+}
+
+// Insert an entry of a directory index in its hash bucket
+static void dir_index_link(dir_index_t *index, uint32_t i)
+{
+    uint32_t bucket = strhash(index->entries[i].name, 0) & (index->n_buckets - 1);
+    index->entries[i].next = index->buckets[bucket];
+    index->buckets[bucket] = i;
+}
+
+// Find entry by name in a directory index
+// Returns NULL if not found
+static dir_index_entry_t *dir_index_find(dir_index_t *index, const char *name)
+{
+    int32_t i = index->buckets[strhash(name, 0) & (index->n_buckets - 1)];
+    while (i >= 0)
+    {
+        if (strcmp(index->entries[i].name, name) == 0)
+            return &index->entries[i];
+
+        i = index->entries[i].next;
+    }
+
+    return NULL;
 }
 
-// Isolate a single FAT entry from the FAT cache
-static bool read_fat_entry(uint32_t *entry, fs_state_t *fs_state,
-                           uint32_t cluster)
+static void dir_index_free(dir_index_t *index)
 {
+    if (index->entries)
+        kfree(index->entries);
 
-    uint32_t fat_offset = cluster + (cluster / 2);
-    uint32_t fat_entry = *(uint16_t *)(fs_state->fat_cache + fat_offset);
+    if (index->buckets)
+        kfree(index->buckets);
+
+    kfree(index);
+}
 
+// Read a single FAT entry
+static int32_t read_fat_entry(uint32_t *entry, fs_state_t *fs_state,
+                              uint32_t cluster)
+{
     // Check entry in range
-    if (cluster >= fs_state->bpb.sectors_per_fat * BLOCK_SIZE)
-        return false;
+    if (cluster >= fs_state->n_clusters + 2)
+        return E_INCON;
 
-    if (cluster % 2 == 0)
-        *entry = fat_entry & 0xFFF;
-    else
-        *entry = fat_entry >> 4;
+    uint8_t b[4];
+    int32_t err;
+    switch (fs_state->type)
+    {
+    case FAT12:
+        if ((err = fat_get_bytes(fs_state, cluster + cluster / 2, b, 2)) < 0)
+            return err;
+        *entry = b[0] | b[1] << 8;
+        *entry = cluster % 2 == 0 ? *entry & 0xFFF : *entry >> 4;
+        break;
+    case FAT16:
+        if ((err = fat_get_bytes(fs_state, cluster * 2, b, 2)) < 0)
+            return err;
+        *entry = b[0] | b[1] << 8;
+        break;
+    case FAT32:
+        // The high 4 bits are reserved
+        if ((err = fat_get_bytes(fs_state, cluster * 4, b, 4)) < 0)
+            return err;
+        *entry = (b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24) & 0x0FFFFFFF;
+        break;
+    }
 
-    return true;
+    return 0;
+}
+
+// Set a single FAT entry
+// The modified sectors are copied to the FATs by fat_flush()
+static int32_t write_fat_entry(fs_state_t *fs_state, uint32_t cluster, uint32_t value)
+{
+    // Check entry in range
+    if (cluster >= fs_state->n_clusters + 2)
+        return E_INCON;
+
+    uint8_t b[4];
+    uint32_t offset;
+    uint32_t n;
+    int32_t err;
+    switch (fs_state->type)
+    {
+    case FAT12:
+        // Entries share a byte with their neighbour
+        offset = cluster + cluster / 2;
+        n = 2;
+        if ((err = fat_get_bytes(fs_state, offset, b, n)) < 0)
+            return err;
+        if (cluster % 2 == 0)
+        {
+            b[0] = value & 0xFF;
+            b[1] = (b[1] & 0xF0) | ((value >> 8) & 0x0F);
+        }
+        else
+        {
+            b[0] = (b[0] & 0x0F) | ((value << 4) & 0xF0);
+            b[1] = (value >> 4) & 0xFF;
+        }
+        break;
+    case FAT16:
+        offset = cluster * 2;
+        n = 2;
+        b[0] = value & 0xFF;
+        b[1] = (value >> 8) & 0xFF;
+        break;
+    case FAT32:
+        // Keep the reserved high 4 bits
+        offset = cluster * 4;
+        n = 4;
+        if ((err = fat_get_bytes(fs_state, offset, b, n)) < 0)
+            return err;
+        b[0] = value & 0xFF;
+        b[1] = (value >> 8) & 0xFF;
+        b[2] = (value >> 16) & 0xFF;
+        b[3] = (b[3] & 0xF0) | ((value >> 24) & 0x0F);
+        break;
+    }
+
+    return fat_set_bytes(fs_state, offset, b, n);
+}
+
+// Read bytes from the FAT through the FAT cache
+// FAT12 entries can straddle two sectors
+static int32_t fat_get_bytes(fs_state_t *fs_state, uint32_t offset, uint8_t *buf, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        fat_sector_t *sec = fat_sector_get(fs_state, (offset + i) / BLOCK_SIZE);
+        if (!sec)
+            return E_IOERR;
+
+        buf[i] = sec->data[(offset + i) % BLOCK_SIZE];
+    }
+
+    return 0;
+}
+
+// Write bytes to the FAT through the FAT cache
+static int32_t fat_set_bytes(fs_state_t *fs_state, uint32_t offset,
+                             const uint8_t *buf, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        fat_sector_t *sec = fat_sector_get(fs_state, (offset + i) / BLOCK_SIZE);
+        if (!sec)
+            return E_IOERR;
+
+        sec->data[(offset + i) % BLOCK_SIZE] = buf[i];
+        sec->dirty = true;
+    }
+
+    return 0;
+}
+
+// Get a FAT sector from the FAT cache, loading it if needed
+// The least recently used sector is replaced
+static fat_sector_t *fat_sector_get(fs_state_t *fs_state, uint32_t sector)
+{
+    fat_sector_t *victim = &fs_state->fat_cache[0];
+
+    for (size_t i = 0; i < FAT_CACHE_SIZE; i++)
+    {
+        fat_sector_t *sec = &fs_state->fat_cache[i];
+        if (sec->valid && sec->sector == sector)
+        {
+            sec->last_use = ++fs_state->fat_cache_clock;
+            return sec;
+        }
+
+        if (!sec->valid || (victim->valid && sec->last_use < victim->last_use))
+            victim = sec;
+    }
+
+    if (sector >= fs_state->sectors_per_fat)
+        return NULL;
+
+    // Modified sectors must reach the FATs before being replaced
+    if (victim->valid && victim->dirty && fat_sector_flush(fs_state, victim) < 0)
+        return NULL;
+
+    // Recently modified sectors may still be in the buffer cache only,
+    // which blkdev_read() takes into account
+    victim->valid = false;
+    if (!blkdev_read(victim->data, fs_state->dev_handle, fs_state->fat_start + sector))
+        return NULL;
+
+    victim->sector = sector;
+    victim->valid = true;
+    victim->dirty = false;
+    victim->last_use = ++fs_state->fat_cache_clock;
+
+    return victim;
+}
+
+// Copy a modified FAT sector to the FATs, through the buffer cache
+static int32_t fat_sector_flush(fs_state_t *fs_state, fat_sector_t *sec)
+{
+    uint32_t spf = fs_state->sectors_per_fat;
+    for (uint32_t i = 0; i < fs_state->bpb.n_fats; i++)
+    {
+        uint32_t block = fs_state->bpb.reserved_sectors + i * spf + sec->sector;
+        if (!fs_state->fat_mirror && block != fs_state->fat_start + sec->sector)
+            continue;
+
+        blkdev_buf_t *buf = blkdev_get_new_buf(fs_state->dev_handle, block);
+        if (!buf)
+            return E_IOERR;
+
+        memcpy(buf->data, sec->data, BLOCK_SIZE);
+        blkdev_mark_dirty(buf);
+        blkdev_release_buf(buf);
+    }
+
+    sec->dirty = false;
+    return 0;
+}
+
+// Copy all modified FAT sectors to the FATs
+static int32_t fat_flush(fs_state_t *fs_state)
+{
+    for (size_t i = 0; i < FAT_CACHE_SIZE; i++)
+    {
+        fat_sector_t *sec = &fs_state->fat_cache[i];
+        if (!sec->valid || !sec->dirty)
+            continue;
+
+        int32_t err = fat_sector_flush(fs_state, sec);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+// Mark the free cluster count of FAT32 as unknown, as it is not kept
+// up to date. Done once per mount
+static void fsinfo_invalidate(fs_state_t *fs_state)
+{
+    if (fs_state->type != FAT32 || fs_state->fsinfo_stale)
+        return;
+    fs_state->fsinfo_stale = true;
+
+    uint32_t sector = fs_state->bpb.fsinfo_sector;
+    if (sector == 0 || sector == 0xFFFF || sector >= fs_state->bpb.reserved_sectors)
+        return;
+
+    blkdev_buf_t *buf = blkdev_get_buf(fs_state->dev_handle, sector);
+    if (!buf)
+        return;
+
+    uint32_t *sig1 = (uint32_t *)(buf->data + FSINFO_SIG1_OFFSET);
+    uint32_t *sig2 = (uint32_t *)(buf->data + FSINFO_SIG2_OFFSET);
+    if (*sig1 == FSINFO_SIG1 && *sig2 == FSINFO_SIG2)
+    {
+        *(uint32_t *)(buf->data + FSINFO_FREE_OFFSET) = FSINFO_UNKNOWN;
+        *(uint32_t *)(buf->data + FSINFO_NEXT_OFFSET) = FSINFO_UNKNOWN;
+        blkdev_mark_dirty(buf);
+    }
+
+    blkdev_release_buf(buf);
+}
+
+// First cluster of a directory entry
+// The high half is only used by FAT32
+static uint32_t dirent_cluster(fs_state_t *fs_state, fat_dir_entry_t *entry)
+{
+    uint32_t cluster = entry->s_fat_entry_low;
+    if (fs_state->type == FAT32)
+        cluster |= (uint32_t)entry->s_fat_entry_high << 16;
+
+    return cluster;
 }
 
 // Check if the filesystem is in a valid state
@@ -942,13 +2162,3 @@ static uint32_t cluster_start_sector(fs_state_t *fs_state, uint32_t cluster)
     return fs_state->data_start +
            (cluster - 2) * fs_state->bpb.sectors_per_cluster; // Cluster offset
 }
-
-static void debug_sector_list_chain(uint32_t *sectors, uint32_t n)
-{
-    kprintf("Sector list: \n");
-    for (size_t i = 0; i < n; i++)
-    {
-        kprintf("%u, ", sectors[i]);
-    }
-    kprintf("\n");
-}
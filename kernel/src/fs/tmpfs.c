@@ -0,0 +1,505 @@
+#include "fs/tmpfs.h"
+
+#include <string.h>
+
+#include "fs/vfs.h"
+#include "log.h"
+#include "mem/mem.h"
+#include "mem/const.h"
+#include "mem/kalloc.h"
+#include "error.h"
+#include "config.h"
+
+// Initial number of hash buckets of a directory (power of 2)
+#define DIR_MIN_BUCKETS 8
+
+// In-memory file or directory
+// Nodes live until the filesystem is unmounted, the VFS inodes
+// pointing to them are created on lookup and can come and go
+typedef struct _tmpfs_node_t tmpfs_node_t;
+struct _tmpfs_node_t
+{
+    char name[FILENAME_MAX + 1];
+    vfs_inode_type_t type;
+    uint32_t id;
+    uint32_t size;
+
+    // File data, one page each
+    uint8_t **pages;
+    uint32_t n_pages;
+    uint32_t max_pages;
+
+    // Directory children, hashed by name
+    tmpfs_node_t **buckets;
+    uint32_t n_buckets;
+
+    // Directory children in creation order, for readdir
+    tmpfs_node_t **entries;
+    uint32_t n_entries;
+    uint32_t max_entries;
+
+    tmpfs_node_t *hash_next; // Next node in the parent's bucket
+    tmpfs_node_t *all_next;  // Next node of the filesystem
+};
+
+// Mounted filesystem state
+typedef struct
+{
+    tmpfs_node_t *root;
+    tmpfs_node_t *nodes; // All nodes, freed on unmount
+    uint32_t next_id;
+    uint32_t n_pages; // Pages of file data in use
+} fs_state_t;
+
+static int32_t fs_type_mount(const char *dev, vfs_superblock_t **mount);
+static void superblock_unmount(vfs_superblock_t *superblock);
+static vfs_inode_t *inode_from_node(fs_state_t *fs_state, tmpfs_node_t *node);
+static void inode_destroy(vfs_inode_t *inode);
+static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
+                          uint32_t offset, uint32_t n);
+static int64_t inode_write(vfs_inode_t *inode, const uint8_t *buf,
+                           uint32_t offset, uint32_t n);
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n);
+static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, const char *name);
+static int32_t inode_create(vfs_inode_t *inode, vfs_inode_t **res, const char *name,
+                            vfs_inode_type_t type);
+static tmpfs_node_t *node_alloc(fs_state_t *fs_state, const char *name,
+                                vfs_inode_type_t type);
+static void node_free(fs_state_t *fs_state, tmpfs_node_t *node);
+static int32_t node_grow(fs_state_t *fs_state, tmpfs_node_t *node, uint32_t n_pages);
+static tmpfs_node_t *dir_find(tmpfs_node_t *dir, const char *name);
+static int32_t dir_add(tmpfs_node_t *dir, tmpfs_node_t *child);
+static int32_t dir_rehash(tmpfs_node_t *dir, uint32_t n_buckets);
+
+void tmpfs_init()
+{
+    vfs_fs_type_t tmpfs = {
+        .name = "tmpfs",
+        .mount = fs_type_mount,
+    };
+
+    // Register tmpfs filesystem driver
+    if (!vfs_register_fs_type(tmpfs))
+        kprintf("[TMPFS] Unable to register fs type\n");
+}
+
+/* Internal functions */
+
+static int32_t fs_type_mount(const char *dev, vfs_superblock_t **superblock)
+{
+    (void)dev;
+
+    // Allocate filesystem state
+    fs_state_t *fs_state = kalloc(sizeof(fs_state_t));
+    if (!fs_state)
+        return E_NOMEM;
+
+    fs_state->nodes = NULL;
+    fs_state->next_id = 0;
+    fs_state->n_pages = 0;
+
+    // Create root directory, its id is 0
+    if (!(fs_state->root = node_alloc(fs_state, "", VFS_INTYPE_DIR)))
+        goto fail;
+
+    vfs_inode_t *root = inode_from_node(fs_state, fs_state->root);
+    if (!root)
+        goto fail;
+
+    // Allocate VFS superblock structure
+    vfs_superblock_t *sb = kalloc(sizeof(vfs_superblock_t));
+    if (!sb)
+    {
+        kfree(root);
+        goto fail;
+    }
+
+    // Construct superblock
+    // Everything is in memory, there's nothing to sync
+    sb->fs_state = fs_state;
+    sb->root = root;
+    sb->unmount = superblock_unmount;
+    sb->changed = NULL;
+    sb->sync = NULL;
+
+    *superblock = sb;
+    return 0;
+
+fail:
+    while (fs_state->nodes)
+    {
+        tmpfs_node_t *next = fs_state->nodes->all_next;
+        node_free(fs_state, fs_state->nodes);
+        fs_state->nodes = next;
+    }
+    kfree(fs_state);
+    return E_NOMEM;
+}
+
+static void superblock_unmount(vfs_superblock_t *superblock)
+{
+    fs_state_t *fs_state = superblock->fs_state;
+
+    // Free all nodes and their data
+    while (fs_state->nodes)
+    {
+        tmpfs_node_t *next = fs_state->nodes->all_next;
+        node_free(fs_state, fs_state->nodes);
+        fs_state->nodes = next;
+    }
+
+    kfree(fs_state);
+
+    // Destroy root inode
+    inode_destroy(superblock->root);
+
+    // Free superblock
+    kfree(superblock);
+}
+
+// Construct a VFS inode for a node
+static vfs_inode_t *inode_from_node(fs_state_t *fs_state, tmpfs_node_t *node)
+{
+    vfs_inode_t *inode = kalloc(sizeof(vfs_inode_t));
+    if (!inode)
+        return NULL;
+
+    bool is_dir = node->type == VFS_INTYPE_DIR;
+
+    strcpy(inode->name, node->name);
+    inode->size = node->size;
+    inode->type = node->type;
+    inode->priv_data = node;
+    inode->fs_state = fs_state;
+    inode->id = node->id;
+    inode->ref_count = 0;
+    inode->read = is_dir ? NULL : inode_read;
+    inode->read_blocks = NULL;
+    inode->readahead = NULL;
+    inode->write = is_dir ? NULL : inode_write;
+    inode->readdir = is_dir ? inode_readdir : NULL;
+    inode->lookup = is_dir ? inode_lookup : NULL;
+    inode->create = is_dir ? inode_create : NULL;
+    inode->destroy = inode_destroy;
+
+    return inode;
+}
+
+// The node belongs to the filesystem, only the inode is freed
+static void inode_destroy(vfs_inode_t *inode)
+{
+    kfree(inode);
+}
+
+//// Inode functions
+static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
+                          uint32_t offset, uint32_t n)
+{
+    tmpfs_node_t *node = inode->priv_data;
+
+    // Another inode of the node may have written to it
+    inode->size = node->size;
+
+    // Clamp with file size
+    if (offset >= node->size)
+        return 0;
+    if (n > node->size - offset)
+        n = node->size - offset;
+
+    uint32_t bytes_read = 0;
+    while (bytes_read < n)
+    {
+        uint32_t int_offset = offset % MEM_PAGE_SIZE; // Offset inside the page
+        uint32_t bytes_to_copy = MEM_PAGE_SIZE - int_offset;
+        if (bytes_to_copy > n - bytes_read)
+            bytes_to_copy = n - bytes_read;
+
+        memcpy(buf + bytes_read, node->pages[offset / MEM_PAGE_SIZE] + int_offset,
+               bytes_to_copy);
+
+        bytes_read += bytes_to_copy;
+        offset += bytes_to_copy;
+    }
+
+    return bytes_read;
+}
+
+static int64_t inode_write(vfs_inode_t *inode, const uint8_t *buf,
+                           uint32_t offset, uint32_t n)
+{
+    fs_state_t *fs_state = inode->fs_state;
+    tmpfs_node_t *node = inode->priv_data;
+
+    // Files can't have holes
+    if (offset > node->size || n > UINT32_MAX - offset)
+        return E_INVREQ;
+    if (!n)
+        return 0;
+
+    // Allocate pages for the new data
+    // If memory runs out, write as much as fits
+    int32_t err = node_grow(fs_state, node,
+                            (offset + n + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE);
+    if (err < 0 && node->n_pages * MEM_PAGE_SIZE > offset)
+        n = node->n_pages * MEM_PAGE_SIZE - offset;
+    else if (err < 0)
+        return err;
+
+    uint32_t bytes_written = 0;
+    while (bytes_written < n)
+    {
+        uint32_t int_offset = offset % MEM_PAGE_SIZE; // Offset inside the page
+        uint32_t bytes_to_copy = MEM_PAGE_SIZE - int_offset;
+        if (bytes_to_copy > n - bytes_written)
+            bytes_to_copy = n - bytes_written;
+
+        memcpy(node->pages[offset / MEM_PAGE_SIZE] + int_offset, buf + bytes_written,
+               bytes_to_copy);
+
+        bytes_written += bytes_to_copy;
+        offset += bytes_to_copy;
+    }
+
+    if (offset > node->size)
+        node->size = offset;
+    inode->size = node->size;
+
+    return bytes_written;
+}
+
+// Children are kept in creation order, the offset indexes them directly
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n)
+{
+    (void)cursor;
+    tmpfs_node_t *node = inode->priv_data;
+
+    uint32_t n_read = 0;
+    while (n_read < n && offset + n_read < node->n_entries)
+    {
+        tmpfs_node_t *child = node->entries[offset + n_read];
+
+        strcpy(buf[n_read].name, child->name);
+        buf[n_read].type = child->type;
+        buf[n_read].size = child->size;
+        n_read++;
+    }
+
+    return n_read;
+}
+
+static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, const char *name)
+{
+    tmpfs_node_t *child = dir_find(inode->priv_data, name);
+    if (!child)
+        return E_NOENT;
+
+    if (!(*res = inode_from_node(inode->fs_state, child)))
+        return E_NOMEM;
+
+    return 0;
+}
+
+static int32_t inode_create(vfs_inode_t *inode, vfs_inode_t **res, const char *name,
+                            vfs_inode_type_t type)
+{
+    fs_state_t *fs_state = inode->fs_state;
+    tmpfs_node_t *node = inode->priv_data;
+
+    if (!*name || strlen(name) > FILENAME_MAX)
+        return E_INVREQ;
+    if (dir_find(node, name))
+        return E_INVREQ;
+
+    // Construct inode first, so that nothing has to be undone
+    // once the node is in the directory
+    tmpfs_node_t *child = node_alloc(fs_state, name, type);
+    if (!child)
+        return E_NOMEM;
+
+    vfs_inode_t *new_inode = inode_from_node(fs_state, child);
+    if (!new_inode)
+        return E_NOMEM;
+
+    int32_t err = dir_add(node, child);
+    if (err < 0)
+    {
+        // The node stays in the list of the filesystem, and is
+        // freed on unmount
+        kfree(new_inode);
+        return err;
+    }
+
+    *res = new_inode;
+    return 0;
+}
+
+//// Node functions
+// Allocate an empty node and add it to the filesystem
+static tmpfs_node_t *node_alloc(fs_state_t *fs_state, const char *name,
+                                vfs_inode_type_t type)
+{
+    tmpfs_node_t *node = kalloc(sizeof(tmpfs_node_t));
+    if (!node)
+        return NULL;
+
+    strcpy(node->name, name);
+    node->type = type;
+    node->id = fs_state->next_id++;
+    node->size = 0;
+    node->pages = NULL;
+    node->n_pages = 0;
+    node->max_pages = 0;
+    node->buckets = NULL;
+    node->n_buckets = 0;
+    node->entries = NULL;
+    node->n_entries = 0;
+    node->max_entries = 0;
+    node->hash_next = NULL;
+
+    node->all_next = fs_state->nodes;
+    fs_state->nodes = node;
+
+    return node;
+}
+
+// Free a node and its data
+// The node must already be removed from the filesystem list
+static void node_free(fs_state_t *fs_state, tmpfs_node_t *node)
+{
+    for (uint32_t i = 0; i < node->n_pages; i++)
+        mem_pfree(node->pages[i], 1);
+    fs_state->n_pages -= node->n_pages;
+
+    if (node->pages)
+        kfree(node->pages);
+    if (node->buckets)
+        kfree(node->buckets);
+    if (node->entries)
+        kfree(node->entries);
+
+    kfree(node);
+}
+
+// Allocate pages so that the file has at least n_pages
+static int32_t node_grow(fs_state_t *fs_state, tmpfs_node_t *node, uint32_t n_pages)
+{
+    // Grow page array
+    if (n_pages > node->max_pages)
+    {
+        uint32_t new_max = node->max_pages ? node->max_pages : 1;
+        while (new_max < n_pages)
+            new_max *= 2;
+
+        uint8_t **new_pages = kalloc(new_max * sizeof(uint8_t *));
+        if (!new_pages)
+            return E_NOMEM;
+
+        if (node->pages)
+        {
+            memcpy(new_pages, node->pages, node->n_pages * sizeof(uint8_t *));
+            kfree(node->pages);
+        }
+
+        node->pages = new_pages;
+        node->max_pages = new_max;
+    }
+
+    while (node->n_pages < n_pages)
+    {
+        if (fs_state->n_pages >= TMPFS_MAX_PAGES)
+            return E_NOSPC;
+
+        uint8_t *page = mem_palloc_k(1);
+        if (page == MEM_FAIL)
+            return E_NOMEM;
+
+        node->pages[node->n_pages++] = page;
+        fs_state->n_pages++;
+    }
+
+    return 0;
+}
+
+//// Directory functions
+static tmpfs_node_t *dir_find(tmpfs_node_t *dir, const char *name)
+{
+    if (!dir->n_buckets)
+        return NULL;
+
+    tmpfs_node_t *cur = dir->buckets[strhash(name, 0) & (dir->n_buckets - 1)];
+    while (cur && strcmp(cur->name, name) != 0)
+        cur = cur->hash_next;
+
+    return cur;
+}
+
+// Add a child to a directory
+// The hash table is grown to keep at most one child per bucket on average
+static int32_t dir_add(tmpfs_node_t *dir, tmpfs_node_t *child)
+{
+    int32_t err;
+
+    // Grow entry array
+    if (dir->n_entries == dir->max_entries)
+    {
+        uint32_t new_max = dir->max_entries ? dir->max_entries * 2 : DIR_MIN_BUCKETS;
+
+        tmpfs_node_t **new_entries = kalloc(new_max * sizeof(tmpfs_node_t *));
+        if (!new_entries)
+            return E_NOMEM;
+
+        if (dir->entries)
+        {
+            memcpy(new_entries, dir->entries, dir->n_entries * sizeof(tmpfs_node_t *));
+            kfree(dir->entries);
+        }
+
+        dir->entries = new_entries;
+        dir->max_entries = new_max;
+    }
+
+    // Grow hash table
+    if (dir->n_entries + 1 > dir->n_buckets)
+    {
+        uint32_t new_n = dir->n_buckets ? dir->n_buckets * 2 : DIR_MIN_BUCKETS;
+        if ((err = dir_rehash(dir, new_n)) < 0)
+            return err;
+    }
+
+    dir->entries[dir->n_entries++] = child;
+
+    uint32_t bucket = strhash(child->name, 0) & (dir->n_buckets - 1);
+    child->hash_next = dir->buckets[bucket];
+    dir->buckets[bucket] = child;
+
+    return 0;
+}
+
+// Rebuild the hash table of a directory with a new number of buckets
+static int32_t dir_rehash(tmpfs_node_t *dir, uint32_t n_buckets)
+{
+    tmpfs_node_t **new_buckets = kalloc(n_buckets * sizeof(tmpfs_node_t *));
+    if (!new_buckets)
+        return E_NOMEM;
+
+    for (uint32_t i = 0; i < n_buckets; i++)
+        new_buckets[i] = NULL;
+
+    for (uint32_t i = 0; i < dir->n_entries; i++)
+    {
+        tmpfs_node_t *child = dir->entries[i];
+        uint32_t bucket = strhash(child->name, 0) & (n_buckets - 1);
+        child->hash_next = new_buckets[bucket];
+        new_buckets[bucket] = child;
+    }
+
+    if (dir->buckets)
+        kfree(dir->buckets);
+
+    dir->buckets = new_buckets;
+    dir->n_buckets = n_buckets;
+
+    return 0;
+}
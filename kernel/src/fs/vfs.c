@@ -1,10 +1,12 @@
 #include "fs/vfs.h"
 
+#include "config.h"
 #include "collections/dllist.h"
 #include "string.h"
 
 #include "mem/kalloc.h"
 #include "fs/path.h"
+#include "blkdev/blkdev.h"
 #include "panic.h"
 #include "error.h"
 #include "log.h"
@@ -12,6 +14,9 @@
 #define MAX_MOUNT_POINTS 16
 #define MAX_FILES 32 // Number of simultaneously open files
 
+// Number of hash buckets of the lookup cache (power of 2)
+#define DCACHE_BUCKETS 32
+
 // VFS file
 typedef struct
 {
@@ -19,24 +24,72 @@ typedef struct
     bool write;         // Is the file open for writing?
     mount_point_t mp;   // Mountpoint to which this file
 
+    // Position after the last readdir()
+    vfs_dir_cursor_t cursor;
+
+    // Position for reads without an offset
+    uint32_t pos;
+
+    // Readahead state
+    uint32_t ra_next;   // Offset a sequential read continues from
+    uint32_t ra_end;    // Block up to which reading ahead was started
+    uint32_t ra_window; // Blocks to read ahead, 0 until reads are sequential
+
     // Number of references to this file. If the references drop to 0, the inode
     // contained in the file is deallocated
     uint32_t ref_count;
 } vfs_file_t;
 
+// Lookup cache entry
+// Maps a name inside a directory to its inode
+typedef struct _dentry_t dentry_t;
+struct _dentry_t
+{
+    bool used;
+    mount_point_t mp;
+    uint32_t parent_id;          // Id of the directory inode
+    char name[FILENAME_MAX + 1]; // Name inside the directory
+    vfs_inode_t *inode;          // NULL if the name doesn't exist
+
+    dentry_t *hash_next;
+    dentry_t *lru_prev, *lru_next;
+};
+
 // Internal functions
 static vfs_fs_type_t *find_fs_type(const char *name);
 static bool is_filesystem_busy(mount_point_t mp);
 static vfs_file_handle_t find_free_file_slot();
 static int32_t find_file_by_inode_id(mount_point_t mp, uint32_t id);
-static int32_t lookup_path(vfs_inode_t **res, vfs_inode_t *root, const char *path);
+static int32_t lookup_path(vfs_inode_t **res, mount_point_t mp, const char *path,
+                           bool create, vfs_inode_type_t type);
+static bool path_is_last(const char *path);
 static void superblock_unmount(vfs_superblock_t *sb);
+static bool superblock_changed(vfs_superblock_t *sb);
+static int32_t superblock_sync(vfs_superblock_t *sb);
 static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, char *file_name);
+static int32_t inode_create(vfs_inode_t *inode, vfs_inode_t **res, char *file_name,
+                            vfs_inode_type_t type);
 static void inode_destroy(vfs_inode_t *inode);
-static int64_t inode_readdir(vfs_inode_t *inode, dirent_t *buf,
-                             uint32_t offset, uint32_t n);
+static vfs_inode_t *inode_get(vfs_inode_t *inode);
+static void inode_put(vfs_inode_t *inode);
+static void dcache_init();
+static uint32_t dcache_hash(mount_point_t mp, uint32_t parent_id, const char *name);
+static dentry_t *dcache_lookup(mount_point_t mp, uint32_t parent_id, const char *name);
+static void dcache_insert(mount_point_t mp, uint32_t parent_id,
+                          const char *name, vfs_inode_t *inode);
+static void dcache_invalidate(mount_point_t mp);
+static void dcache_drop(dentry_t *dentry);
+static void dcache_lru_remove(dentry_t *dentry);
+static void dcache_lru_insert_head(dentry_t *dentry);
+static void dcache_lru_insert_tail(dentry_t *dentry);
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n);
 static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
                           uint32_t offset, uint32_t n);
+static int64_t inode_write(vfs_inode_t *inode, const uint8_t *buf,
+                           uint32_t offset, uint32_t n);
+static void file_readahead(vfs_file_t *file, uint32_t offset, uint32_t n);
+static void file_readahead_reset(vfs_file_t *file, uint32_t offset);
 
 // Global objects
 dllist_t fs_types;
@@ -44,6 +97,13 @@ vfs_superblock_t *mount_points[MAX_MOUNT_POINTS];
 vfs_file_t open_files[MAX_FILES];
 vfs_file_handle_t next_vfs_file_handle;
 
+// Lookup cache
+// Unused entries sit at the head of the LRU list, followed by the
+// least recently used ones
+static dentry_t dcache[VFS_DCACHE_SIZE];
+static dentry_t *dcache_buckets[DCACHE_BUCKETS];
+static dentry_t *dcache_lru_head, *dcache_lru_tail;
+
 void vfs_init()
 {
     // Initialize mountpoint list
@@ -59,6 +119,8 @@ void vfs_init()
 
     // VFS file handles start from 0
     next_vfs_file_handle = 0;
+
+    dcache_init();
 }
 
 bool vfs_register_fs_type(vfs_fs_type_t fs_type)
@@ -94,6 +156,10 @@ int32_t vfs_mount(const char *dev, mount_point_t mp, const char *fs)
     if (res < 0)
         return res;
 
+    // The superblock keeps a reference to the root inode for
+    // as long as the filesystem is mounted
+    mount->root->ref_count = 1;
+
     // Set mount point
     mount_points[mp] = mount;
 
@@ -110,6 +176,14 @@ int32_t vfs_unmount(mount_point_t mp)
     if (is_filesystem_busy(mp))
         return E_BUSY;
 
+    // Write modified data
+    // Unmount anyway on failure, the device may be gone
+    if (superblock_sync(mount_points[mp]) < 0)
+        kprintf("[VFS] Unable to sync mountpoint %u\n", mp);
+
+    // Drop cached inodes of the filesystem
+    dcache_invalidate(mp);
+
     // Unmount
     superblock_unmount(mount_points[mp]);
 
@@ -119,10 +193,32 @@ int32_t vfs_unmount(mount_point_t mp)
     return 0;
 }
 
+int32_t vfs_sync()
+{
+    int32_t ret = 0;
+
+    for (mount_point_t mp = 0; mp < MAX_MOUNT_POINTS; mp++)
+    {
+        if (!mount_points[mp])
+            continue;
+
+        // Keep syncing the others on failure
+        int32_t res = superblock_sync(mount_points[mp]);
+        if (res < 0)
+            ret = res;
+    }
+
+    return ret;
+}
+
 vfs_file_handle_t vfs_open(const char *path, fopts opt)
 {
     uint32_t ret;
 
+    // Only files opened for writing can be created
+    if ((opt & FOPT_CREATE) && !(opt & FOPT_DIR) && !(opt & FOPT_WRITE))
+        return E_INVREQ;
+
     // Parse mountpoint
     mount_point_t mp;
     if (!path_parse_mountpoint(&mp, &path))
@@ -137,7 +233,8 @@ vfs_file_handle_t vfs_open(const char *path, fopts opt)
 
     // Find inode for this path
     vfs_inode_t *inode;
-    int32_t res = lookup_path(&inode, mount_points[mp]->root, path);
+    int32_t res = lookup_path(&inode, mp, path, (opt & FOPT_CREATE) != 0,
+                              (opt & FOPT_DIR) ? VFS_INTYPE_DIR : VFS_INTYPE_FILE);
     if (res < 0)
         return res;
 
@@ -165,26 +262,18 @@ vfs_file_handle_t vfs_open(const char *path, fopts opt)
     bool write = (opt & FOPT_WRITE) != 0;
 
     // Check if there is a file with the same inode
+    // Each open gets its own file, for its own position, but they share
+    // the inode
     int32_t file_handle = find_file_by_inode_id(mp, inode->id);
     if (file_handle >= 0)
     {
-        // Use file we found
-        vfs_file_t *file = &open_files[file_handle];
-
-        // Destroy this new copy of the inode, since we have the one associated
-        // with this file
-        if (inode != mount_points[mp]->root)
-            inode_destroy(inode);
-
         // Cannot open for writing a file that's already open
         // Cannot open a file that's already open for writing
-        if (write || file->write)
-            return E_BUSY;
-
-        // Increment reference count
-        file->ref_count++;
-
-        return file_handle;
+        if (write || open_files[file_handle].write)
+        {
+            ret = E_BUSY;
+            goto fail;
+        }
     }
 
     // Find a free file handle
@@ -204,15 +293,18 @@ vfs_file_handle_t vfs_open(const char *path, fopts opt)
     file->ref_count = 1;
     file->write = write;
     file->mp = mp;
+    file->cursor.offset = 0;
+    file->cursor.block = 0;
+    file->cursor.index = 0;
+    file->pos = 0;
+    file_readahead_reset(file, 0);
 
     kprintf("[VFS] Opened file: %u\n", file_handle);
 
     return file_handle;
 
 fail:
-    // Destroy new inode if it's not the root inode of the mount point
-    if (inode != mount_points[mp]->root)
-        inode_destroy(inode);
+    inode_put(inode);
     return ret;
 }
 
@@ -226,12 +318,9 @@ void vfs_close(vfs_file_handle_t file)
     // Decrement reference count
     open_files[file].ref_count--;
 
-    // When refrencs hit 0, destroy inode
+    // When refrencs hit 0, release inode
     if (open_files[file].ref_count == 0)
-    {
-        if (open_files[file].inode != mount_points[open_files[file].mp]->root)
-            inode_destroy(open_files[file].inode);
-    }
+        inode_put(open_files[file].inode);
 }
 
 int64_t vfs_readdir(vfs_file_handle_t file, dirent_t *buf, uint32_t offset, uint32_t n)
@@ -244,7 +333,7 @@ int64_t vfs_readdir(vfs_file_handle_t file, dirent_t *buf, uint32_t offset, uint
     vfs_inode_t *inode = open_files[file].inode;
 
     // Perform read
-    return inode_readdir(inode, buf, offset, n);
+    return inode_readdir(inode, &open_files[file].cursor, buf, offset, n);
 }
 
 int64_t vfs_read(vfs_file_handle_t file, uint8_t *buf, uint32_t offset, uint32_t n)
@@ -257,7 +346,99 @@ int64_t vfs_read(vfs_file_handle_t file, uint8_t *buf, uint32_t offset, uint32_t
     vfs_inode_t *inode = open_files[file].inode;
 
     // Perform read
-    return inode_read(inode, buf, offset, n);
+    int64_t res = inode_read(inode, buf, offset, n);
+    if (res > 0)
+        file_readahead(&open_files[file], offset, res);
+
+    return res;
+}
+
+int64_t vfs_read_next(vfs_file_handle_t file, uint8_t *buf, uint32_t n)
+{
+    // Check if file is valid and open
+    if (file >= MAX_FILES || open_files[file].ref_count == 0)
+        return E_NOENT;
+
+    vfs_file_t *f = &open_files[file];
+
+    // Perform read
+    int64_t res = inode_read(f->inode, buf, f->pos, n);
+    if (res > 0)
+    {
+        file_readahead(f, f->pos, res);
+        f->pos += res;
+    }
+
+    return res;
+}
+
+int64_t vfs_seek(vfs_file_handle_t file, int64_t offset, vfs_seek_t whence)
+{
+    // Check if file is valid and open
+    if (file >= MAX_FILES || open_files[file].ref_count == 0)
+        return E_NOENT;
+
+    vfs_file_t *f = &open_files[file];
+
+    int64_t pos;
+    switch (whence)
+    {
+    case VFS_SEEK_SET:
+        pos = offset;
+        break;
+    case VFS_SEEK_CUR:
+        pos = (int64_t)f->pos + offset;
+        break;
+    case VFS_SEEK_END:
+        pos = (int64_t)f->inode->size + offset;
+        break;
+    default:
+        return E_INVREQ;
+    }
+
+    // Check new position in range
+    if (pos < 0 || pos > UINT32_MAX)
+        return E_INVREQ;
+
+    f->pos = pos;
+
+    // A new stream of reads starts here
+    file_readahead_reset(f, pos);
+
+    return pos;
+}
+
+int64_t vfs_write(vfs_file_handle_t file, const uint8_t *buf, uint32_t offset, uint32_t n)
+{
+    // Check if file is valid and open
+    if (file >= MAX_FILES || open_files[file].ref_count == 0)
+        return E_NOENT;
+
+    // Check if file is open for writing
+    if (!open_files[file].write)
+        return E_NOTPERM;
+
+    // Get inode from file
+    vfs_inode_t *inode = open_files[file].inode;
+
+    // Perform write
+    return inode_write(inode, buf, offset, n);
+}
+
+int64_t vfs_read_blocks(vfs_file_handle_t file, uint8_t *buf, uint32_t block, uint32_t n)
+{
+    // Check if file is valid and open
+    if (file >= MAX_FILES || open_files[file].ref_count == 0)
+        return E_NOENT;
+
+    // Get inode from file
+    vfs_inode_t *inode = open_files[file].inode;
+
+    if (!inode->read_blocks)
+        return E_NOIMPL;
+
+    // Perform read
+    return inode->read_blocks(inode, buf, block, n);
 }
 
 /* Internal functions */
@@ -328,24 +509,71 @@ static int32_t find_file_by_inode_id(mount_point_t mp, uint32_t id)
 }
 
 // Find inode for a certain absolute path
-// Returns 0 on success
-static int32_t lookup_path(vfs_inode_t **res, vfs_inode_t *root, const char *path)
+// Path components are looked up in the cache first, the filesystem
+// is only asked on a miss
+// If create is set, a missing last component is created with the given type
+// Returns 0 on success, with a reference to the inode held for the caller
+static int32_t lookup_path(vfs_inode_t **res, mount_point_t mp, const char *path,
+                           bool create, vfs_inode_type_t type)
 {
-    vfs_inode_t *cur_inode = root;
+    vfs_superblock_t *sb = mount_points[mp];
+
+    // Cached lookups are stale if the media has changed
+    if (superblock_changed(sb))
+        dcache_invalidate(mp);
+
+    vfs_inode_t *cur_inode = inode_get(sb->root);
 
     // Follow path
-    char file_name[FILENAME_MAX];
+    char file_name[FILENAME_MAX + 1];
     while (path_parse_filename(file_name, &path))
     {
-        // Look up child inode
         vfs_inode_t *child;
-        int32_t res;
-        if ((res = inode_lookup(cur_inode, &child, file_name)) < 0)
-            return res;
 
-        // Destroy current inode (if it's not the root inode)
-        if (cur_inode != root)
-            inode_destroy(cur_inode);
+        dentry_t *dentry = dcache_lookup(mp, cur_inode->id, file_name);
+        if (dentry && dentry->inode)
+            child = inode_get(dentry->inode);
+        else
+        {
+            // Look up child inode, unless it is known not to exist
+            int32_t res = dentry ? E_NOENT
+                                 : inode_lookup(cur_inode, &child, file_name);
+
+            if (res == E_NOENT && create && path_is_last(path))
+            {
+                // Name is about to exist
+                if (dentry)
+                    dcache_drop(dentry);
+
+                res = inode_create(cur_inode, &child, file_name, type);
+            }
+            else if (res == E_NOENT && !dentry)
+                dcache_insert(mp, cur_inode->id, file_name, NULL);
+
+            if (res < 0)
+            {
+                inode_put(cur_inode);
+                return res;
+            }
+
+            // An open file may have been dropped from the cache, keep
+            // using its inode so that writes to it are seen
+            // Filesystems which keep their inodes around may return
+            // the same one, which already has references
+            int32_t open_file = find_file_by_inode_id(mp, child->id);
+            if (open_file >= 0 && open_files[open_file].inode != child)
+            {
+                inode_destroy(child);
+                child = open_files[open_file].inode;
+            }
+
+            inode_get(child);
+
+            dcache_insert(mp, cur_inode->id, file_name, child);
+        }
+
+        // Done with current inode
+        inode_put(cur_inode);
 
         cur_inode = child;
     }
@@ -356,6 +584,15 @@ static int32_t lookup_path(vfs_inode_t **res, vfs_inode_t *root, const char *pat
     return 0;
 }
 
+// Check if there are no more components after the current one
+static bool path_is_last(const char *path)
+{
+    while (*path == '/')
+        path++;
+
+    return *path == '\0';
+}
+
 static void superblock_unmount(vfs_superblock_t *sb)
 {
     if (!sb->unmount)
@@ -364,6 +601,22 @@ static void superblock_unmount(vfs_superblock_t *sb)
     sb->unmount(sb);
 }
 
+static bool superblock_changed(vfs_superblock_t *sb)
+{
+    if (!sb->changed)
+        return false;
+
+    return sb->changed(sb);
+}
+
+static int32_t superblock_sync(vfs_superblock_t *sb)
+{
+    if (!sb->sync)
+        return 0;
+
+    return sb->sync(sb);
+}
+
 static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, char *file_name)
 {
     if (!inode->lookup)
@@ -372,6 +625,15 @@ static int32_t inode_lookup(vfs_inode_t *inode, vfs_inode_t **res, char *file_na
     return inode->lookup(inode, res, file_name);
 }
 
+static int32_t inode_create(vfs_inode_t *inode, vfs_inode_t **res, char *file_name,
+                            vfs_inode_type_t type)
+{
+    if (!inode->create)
+        return E_NOTPERM;
+
+    return inode->create(inode, res, file_name, type);
+}
+
 static void inode_destroy(vfs_inode_t *inode)
 {
     if (!inode->destroy)
@@ -380,14 +642,30 @@ static void inode_destroy(vfs_inode_t *inode)
     inode->destroy(inode);
 }
 
+// Take a reference to an inode
+static vfs_inode_t *inode_get(vfs_inode_t *inode)
+{
+    inode->ref_count++;
+    return inode;
+}
+
+// Drop a reference to an inode, destroying it when none are left
+// The root inode of a mountpoint is referenced by its superblock,
+// so it is never destroyed here
+static void inode_put(vfs_inode_t *inode)
+{
+    if (--inode->ref_count == 0)
+        inode_destroy(inode);
+}
+
 // N is the number of directory entries which fit in the buffer
-static int64_t inode_readdir(vfs_inode_t *inode, dirent_t *buf,
-                             uint32_t offset, uint32_t n)
+static int64_t inode_readdir(vfs_inode_t *inode, vfs_dir_cursor_t *cursor,
+                             dirent_t *buf, uint32_t offset, uint32_t n)
 {
     if (!inode->readdir)
         return E_NOIMPL;
 
-    return inode->readdir(inode, buf, offset, n);
+    return inode->readdir(inode, cursor, buf, offset, n);
 }
 
 static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
@@ -398,3 +676,196 @@ static int64_t inode_read(vfs_inode_t *inode, uint8_t *buf,
 
     return inode->read(inode, buf, offset, n);
 }
+
+static int64_t inode_write(vfs_inode_t *inode, const uint8_t *buf,
+                           uint32_t offset, uint32_t n)
+{
+    if (!inode->write)
+        return E_NOTPERM;
+
+    return inode->write(inode, buf, offset, n);
+}
+
+// Put all lookup cache entries in the LRU list as unused
+static void dcache_init()
+{
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++)
+        dcache_buckets[i] = NULL;
+
+    dcache_lru_head = dcache_lru_tail = NULL;
+
+    for (size_t i = 0; i < VFS_DCACHE_SIZE; i++)
+    {
+        dcache[i].used = false;
+        dcache[i].inode = NULL;
+        dcache_lru_insert_tail(&dcache[i]);
+    }
+}
+
+static uint32_t dcache_hash(mount_point_t mp, uint32_t parent_id, const char *name)
+{
+    return strhash(name, mp * 31 + parent_id) & (DCACHE_BUCKETS - 1);
+}
+
+// Find a name inside a directory in the lookup cache
+// Returns NULL if the name is not cached
+static dentry_t *dcache_lookup(mount_point_t mp, uint32_t parent_id, const char *name)
+{
+    dentry_t *cur = dcache_buckets[dcache_hash(mp, parent_id, name)];
+    while (cur)
+    {
+        if (cur->mp == mp && cur->parent_id == parent_id &&
+            strcmp(cur->name, name) == 0)
+        {
+            // Mark as most recently used
+            dcache_lru_remove(cur);
+            dcache_lru_insert_tail(cur);
+            return cur;
+        }
+
+        cur = cur->hash_next;
+    }
+
+    return NULL;
+}
+
+// Add a name inside a directory to the lookup cache, reclaiming
+// the least recently used entry
+// The entry takes a reference to the inode, NULL records a missing name
+static void dcache_insert(mount_point_t mp, uint32_t parent_id,
+                          const char *name, vfs_inode_t *inode)
+{
+    dentry_t *dentry = dcache_lru_head;
+    if (dentry->used)
+        dcache_drop(dentry);
+
+    dentry->used = true;
+    dentry->mp = mp;
+    dentry->parent_id = parent_id;
+    strcpy(dentry->name, name);
+    dentry->inode = inode ? inode_get(inode) : NULL;
+
+    // Insert in hash bucket
+    uint32_t bucket = dcache_hash(mp, parent_id, name);
+    dentry->hash_next = dcache_buckets[bucket];
+    dcache_buckets[bucket] = dentry;
+
+    dcache_lru_remove(dentry);
+    dcache_lru_insert_tail(dentry);
+}
+
+// Drop all lookup cache entries of a mountpoint
+static void dcache_invalidate(mount_point_t mp)
+{
+    for (size_t i = 0; i < VFS_DCACHE_SIZE; i++)
+    {
+        if (dcache[i].used && dcache[i].mp == mp)
+            dcache_drop(&dcache[i]);
+    }
+}
+
+// Remove an entry from the lookup cache, releasing its inode
+// The entry becomes the first to be reused
+static void dcache_drop(dentry_t *dentry)
+{
+    // Remove from hash bucket
+    dentry_t **cur = &dcache_buckets[dcache_hash(dentry->mp, dentry->parent_id,
+                                                 dentry->name)];
+    while (*cur != dentry)
+        cur = &(*cur)->hash_next;
+    *cur = dentry->hash_next;
+
+    if (dentry->inode)
+        inode_put(dentry->inode);
+
+    dentry->used = false;
+    dentry->inode = NULL;
+
+    dcache_lru_remove(dentry);
+    dcache_lru_insert_head(dentry);
+}
+
+static void dcache_lru_remove(dentry_t *dentry)
+{
+    if (dentry->lru_prev)
+        dentry->lru_prev->lru_next = dentry->lru_next;
+    else
+        dcache_lru_head = dentry->lru_next;
+
+    if (dentry->lru_next)
+        dentry->lru_next->lru_prev = dentry->lru_prev;
+    else
+        dcache_lru_tail = dentry->lru_prev;
+}
+
+static void dcache_lru_insert_head(dentry_t *dentry)
+{
+    dentry->lru_prev = NULL;
+    dentry->lru_next = dcache_lru_head;
+
+    if (dcache_lru_head)
+        dcache_lru_head->lru_prev = dentry;
+    else
+        dcache_lru_tail = dentry;
+
+    dcache_lru_head = dentry;
+}
+
+static void dcache_lru_insert_tail(dentry_t *dentry)
+{
+    dentry->lru_next = NULL;
+    dentry->lru_prev = dcache_lru_tail;
+
+    if (dcache_lru_tail)
+        dcache_lru_tail->lru_next = dentry;
+    else
+        dcache_lru_head = dentry;
+
+    dcache_lru_tail = dentry;
+}
+
+// Read ahead of a stream of sequential reads, after a read of n bytes
+// at offset. The window doubles with each sequential read, and more
+// blocks are requested when less than half of it is left
+static void file_readahead(vfs_file_t *file, uint32_t offset, uint32_t n)
+{
+    vfs_inode_t *inode = file->inode;
+    if (!inode->readahead)
+        return;
+
+    // Random access, start over
+    if (offset != file->ra_next)
+    {
+        file_readahead_reset(file, offset + n);
+        return;
+    }
+    file->ra_next = offset + n;
+
+    // Grow window
+    uint32_t window = file->ra_window ? file->ra_window * 2 : VFS_READAHEAD_MIN;
+    if (window > VFS_READAHEAD_MAX)
+        window = VFS_READAHEAD_MAX;
+    file->ra_window = window;
+
+    // First block the next read needs
+    uint32_t next = file->ra_next / BLOCK_SIZE;
+    if (file->ra_end < next)
+        file->ra_end = next;
+
+    // Enough left
+    if (file->ra_end - next > window / 2)
+        return;
+
+    uint32_t end = next + window;
+    if (inode->readahead(inode, file->ra_end, end - file->ra_end) < 0)
+        return;
+    file->ra_end = end;
+}
+
+// Forget about previous reads, the next one is expected at offset
+static void file_readahead_reset(vfs_file_t *file, uint32_t offset)
+{
+    file->ra_next = offset;
+    file->ra_end = 0;
+    file->ra_window = 0;
+}
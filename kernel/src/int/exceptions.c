@@ -7,9 +7,14 @@
 #include "panic.h"
 #include "mem/vmem.h"
 #include "syscall/syscall.h"
+#include "proc/fpu.h"
+#include "mem/const.h"
 
 #define PANIC_MSG_BUF_MAX 256
 
+// Page fault error code bits
+#define PF_ERR_PRESENT (1 << 0) // Fault caused by a protection violation
+
 // Read value of CR2
 static inline uint32_t get_cr2_value()
 {
@@ -22,6 +27,18 @@ void handle_exception(interrupt_context_t *ctx)
 {
     char msg_buf[PANIC_MSG_BUF_MAX];
 
+    // Device Not Available: lazy FPU context switch
+    if (ctx->vec == 7 && fpu_handle_nm())
+        return;
+
+    // Page not present in userspace: could be demand paging
+    if (ctx->vec == 14 && (ctx->cs & 3) == SEGSEL_USER &&
+        !(ctx->errco & PF_ERR_PRESENT))
+    {
+        page_fault_from_int(ctx, (void *)get_cr2_value());
+        return;
+    }
+
     // If the exception was triggered in a user context,
     // invoke the unhonorable exit handler of the current process
     // If EIP is in the user VAS, then the offending instruction
@@ -11,6 +11,9 @@
 #include "drivers/pic.h"
 #include "clock.h"
 #include "syscall/syscall.h"
+#include "int/workq.h"
+#include "proc/sched.h"
+#include "mem/const.h"
 
 // Configure debugging
 #if DEBUG_INT == 1
@@ -52,6 +55,9 @@ void interrupts_init()
     // We are not inside an interrupt context
     cur_ctx = NULL;
 
+    // Initialize deferred work queues
+    workq_init();
+
     // Enable hardware interrupts
     sti();
 }
@@ -152,6 +158,11 @@ interrupt_context_t *interrupt_get_cur_ctx()
     return cur_ctx;
 }
 
+void interrupt_set_cur_ctx(interrupt_context_t *ctx)
+{
+    cur_ctx = ctx;
+}
+
 /* Internal functions */
 
 // Main ISR, called from vectors in vectors.S
@@ -163,6 +174,8 @@ void interrupt_handler(interrupt_context_t *ctx)
 
     // Set current interrupt context for other code
     // running in the interrupt handler to access
+    // (interrupts can nest while deferred work is running)
+    interrupt_context_t *prev_ctx = cur_ctx;
     cur_ctx = ctx;
 
     if (ctx->vec < 32)
@@ -181,8 +194,16 @@ void interrupt_handler(interrupt_context_t *ctx)
         handle_syscall(ctx);
     }
 
-    // Unset current interrupt context
-    cur_ctx = NULL;
+    // Run deferred work queued by the handlers
+    // The current interrupt context is still valid while it runs
+    workq_run();
+
+    // Returning to userspace, the current process can be preempted
+    if ((ctx->cs & 3) == SEGSEL_USER)
+        sched_user_return(ctx);
+
+    // Restore previous interrupt context
+    cur_ctx = prev_ctx;
 }
 
 // Handle hardware interrupt
@@ -0,0 +1,170 @@
+#include "int/workq.h"
+
+#include <stddef.h>
+
+#include "int/interrupts.h"
+#include "clock.h"
+
+// Maximum number of pending items in each queue
+#define WORKQ_SIZE 32
+
+// Deferred work item
+typedef struct
+{
+    void (*func)(void *);
+    void *data;
+    uint64_t enqueued; // System time of enqueuing
+} work_t;
+
+// Deferred work queue
+// Ring buffer of work items
+typedef struct
+{
+    work_t items[WORKQ_SIZE];
+    uint32_t head, n;
+    workq_stats_t stats;
+} workq_t;
+
+// Internal function prototypes
+static bool dequeue(workq_t *q, work_t *work);
+static void execute(workq_t *q, work_t *work);
+
+// Global objects
+static workq_t queues[WORKQ_N];
+static volatile bool running;
+
+/* Public functions */
+
+void workq_init()
+{
+    for (size_t i = 0; i < WORKQ_N; i++)
+    {
+        queues[i].head = 0;
+        queues[i].n = 0;
+        queues[i].stats = (workq_stats_t){0};
+    }
+
+    running = false;
+}
+
+bool workq_enqueue(workq_id_t queue, void (*func)(void *), void *data)
+{
+    workq_t *q = &queues[queue];
+
+    // Save interrupt flag, as this can be called from outside
+    // interrupt handlers
+    uint32_t flags = cli_save();
+
+    bool res = false;
+    if (q->n < WORKQ_SIZE)
+    {
+        work_t *work = &q->items[(q->head + q->n) % WORKQ_SIZE];
+        work->func = func;
+        work->data = data;
+        work->enqueued = clock_get_system();
+        q->n++;
+
+        if (q->n > q->stats.max_pending)
+            q->stats.max_pending = q->n;
+
+        res = true;
+    }
+    else
+        q->stats.dropped++;
+
+    // Restore interrupt flag
+    restore_flags(flags);
+
+    return res;
+}
+
+void workq_run()
+{
+    work_t work;
+
+    // Work queues are already being run further down the stack
+    if (running)
+        return;
+    running = true;
+
+    // Execute work items with interrupts enabled
+    // Queues are visited in priority order, starting from the first one
+    // every time an item is executed
+    sti();
+    bool done = false;
+    while (!done)
+    {
+        done = true;
+        for (size_t i = 0; i < WORKQ_N; i++)
+        {
+            if (dequeue(&queues[i], &work))
+            {
+                execute(&queues[i], &work);
+                done = false;
+                break;
+            }
+        }
+    }
+
+    cli();
+    running = false;
+}
+
+bool workq_pending()
+{
+    for (size_t i = 0; i < WORKQ_N; i++)
+    {
+        if (queues[i].n)
+            return true;
+    }
+
+    return false;
+}
+
+bool workq_running()
+{
+    return running;
+}
+
+void workq_get_stats(workq_id_t queue, workq_stats_t *stats)
+{
+    cli();
+    *stats = queues[queue].stats;
+    sti();
+}
+
+/* Internal functions */
+
+// Remove first work item from a queue
+// Returns false if the queue is empty
+static bool dequeue(workq_t *q, work_t *work)
+{
+    bool res = false;
+    cli();
+
+    if (q->n)
+    {
+        *work = q->items[q->head];
+        q->head = (q->head + 1) % WORKQ_SIZE;
+        q->n--;
+        res = true;
+    }
+
+    sti();
+    return res;
+}
+
+// Execute a work item and update the queue statistics
+static void execute(workq_t *q, work_t *work)
+{
+    uint32_t latency = clock_get_system() - work->enqueued;
+
+    work->func(work->data);
+
+    cli();
+    q->stats.executed++;
+    q->stats.total_latency += latency;
+    if (latency > q->stats.max_latency)
+        q->stats.max_latency = latency;
+    sti();
+}
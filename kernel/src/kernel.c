@@ -32,10 +32,14 @@
 #include "drivers/fdc.h"
 #include "fs/vfs.h"
 #include "fs/fat.h"
+#include "fs/tmpfs.h"
+#include "fs/arfs.h"
 #include "fs/path.h"
 #include "proc/elf.h"
+#include "proc/fpu.h"
 #include "error.h"
 #include "drivers/isadma.h"
+#include "waitq.h"
 
 const char *SYSTEM_DISK_DEV = "fd0";
 const char *SYSTEM_DISK_FS = "fat";
@@ -77,7 +81,7 @@ void kmain(multiboot_info_t *mbd)
 
     // Only reaches here when initialization failed
     while (true)
-        ;
+        cpu_idle();
 }
 
 // Initialize kernel logging
@@ -95,6 +99,7 @@ void subsystems_init()
     blkdev_init();
     vfs_init();
     isadma_init();
+    fpu_init();
 }
 
 // Initialize drivers
@@ -105,6 +110,8 @@ void drivers_init()
     sysreq_init();
     fdc_init();
     fat_init();
+    tmpfs_init();
+    arfs_init();
 }
 
 // Initialize userspace
@@ -158,7 +165,7 @@ int32_t start_init_proc()
     kprintf_suppress_console(true);
 
     // Set up CPU context for process execution
-    proc_setup_cpu_ctx(entry);
+    proc_setup_cpu_ctx(proc_cur(), entry);
 
     // Transfer control to user program
     go_userspace(&proc_cur()->cpu_ctx);
@@ -186,6 +186,11 @@ void setup_gdt()
     set_up_tss();
 }
 
+void gdt_set_kernel_stack(uint32_t esp0)
+{
+    tss.esp0 = esp0;
+}
+
 /**
  * Sets up TSS with correct interrupt stack and
  * loads the task register
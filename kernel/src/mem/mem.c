@@ -11,6 +11,9 @@
 #include "drivers/vga.h"
 #include "panic.h"
 
+// Internal functions
+static bool make_avail(void *vaddr, uint32_t n, bool zero);
+
 void mem_init(multiboot_info_t *mbd)
 {
     kprintf("[MEM] Initializing memory management...\n");
@@ -99,6 +102,20 @@ void mem_pfree(void *addr, uint32_t n)
 }
 
 bool mem_make_avail(void *vaddr, uint32_t n)
+{
+    return make_avail(vaddr, n, true);
+}
+
+bool mem_make_avail_uninit(void *vaddr, uint32_t n)
+{
+    return make_avail(vaddr, n, false);
+}
+
+/* Internal functions */
+
+// Allocate and map n pages of memory at vaddr
+// zero: clear the pages, so that no data leaks between processes
+static bool make_avail(void *vaddr, uint32_t n, bool zero)
 {
     // Iterate over all pages to map
     for (uint32_t page = 0; page < n; page++)
@@ -106,7 +123,7 @@ bool mem_make_avail(void *vaddr, uint32_t n)
         void *page_vaddr = (uint8_t *)vaddr + page * MEM_PAGE_SIZE;
 
         // Allocate physical memory
-        void *page_paddr = physmem_alloc();
+        void *page_paddr = zero ? physmem_alloc_zeroed() : physmem_alloc();
         if (page_paddr == PHYSMEM_NULL)
         {
             // Error allocating memory
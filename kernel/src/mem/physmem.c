@@ -9,6 +9,8 @@
 #include "boot/boot_info.h"
 #include "boot/boot.h"
 #include "panic.h"
+#include "config.h"
+#include "int/interrupts.h"
 
 // Bitmap global objects
 char *physmem_bitmap;
@@ -18,7 +20,12 @@ uint32_t physmem_first_free_page;
 // Accounting information
 uint32_t physmem_free_pages;
 
-#define MAX_SRMMAP_ENTRIES 4
+// Pool of pages already filled with zeroes
+static void *zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_n;
+static physmem_zero_stats_t zero_stats;
+
+#define MAX_SRMMAP_ENTRIES (4 + BOOT_INFO_MODULES_MAX)
 #define ISADMA_MEM_LIMIT (16 * 1024 * 1024) // 16M
 #define ISADMA_BOUNDARY_SIZE (64 * 1024)    // 64K
 
@@ -58,6 +65,7 @@ static inline bool is_page_free(uint32_t page);
 static inline void mark_page_free(uint32_t page);
 static inline void mark_page_free_nockeck(uint32_t page);
 static inline void mark_page_used(uint32_t page);
+static bool zero_page(void *paddr);
 
 /* Public functions */
 
@@ -76,6 +84,14 @@ void physmem_init()
     MAKE_SRMMAP_ENTRY(KERNEL_PHYS_ADDR,
                       (uint32_t)&_kernel_end - (uint32_t)&_kernel_start);
 
+    // Mark boot modules as software reserved, they are used in place
+    for (uint32_t i = 0; i < boot_info.modules_n; i++)
+    {
+        uint32_t start = boot_info.modules[i].addr & ~(MEM_PAGE_SIZE - 1);
+        MAKE_SRMMAP_ENTRY(start, boot_info.modules[i].addr +
+                                     boot_info.modules[i].size - start);
+    }
+
     // Compute maximum physical address
     max_addr = calc_addr_space_size();
     kprintf("Maximum physical address: %x\n", max_addr);
@@ -228,8 +244,101 @@ void *physmem_alloc_isadma(uint32_t n)
     return (void *)PHYSMEM_NULL;
 }
 
+void *physmem_alloc_zeroed()
+{
+    void *paddr = physmem_alloc_prezeroed();
+    if (paddr != PHYSMEM_NULL)
+    {
+        zero_stats.hits++;
+        return paddr;
+    }
+
+    zero_stats.misses++;
+
+    // Pool empty, zero page now
+    if ((paddr = physmem_alloc()) == PHYSMEM_NULL)
+        return PHYSMEM_NULL;
+
+    if (!zero_page(paddr))
+    {
+        physmem_free(paddr);
+        return PHYSMEM_NULL;
+    }
+
+    return paddr;
+}
+
+void *physmem_alloc_prezeroed()
+{
+    void *paddr = PHYSMEM_NULL;
+
+    uint32_t flags = cli_save();
+    if (zero_pool_n)
+        paddr = zero_pool[--zero_pool_n];
+    restore_flags(flags);
+
+    return paddr;
+}
+
+bool physmem_refill_zeroed()
+{
+    // Page tables can be allocated while zeroing,
+    // so the whole operation is done with interrupts disabled
+    uint32_t flags = cli_save();
+    bool res = false;
+
+    if (zero_pool_n >= ZERO_POOL_SIZE)
+        goto end;
+
+    void *paddr = physmem_alloc();
+    if (paddr == PHYSMEM_NULL)
+        goto end;
+
+    if (!zero_page(paddr))
+    {
+        physmem_free(paddr);
+        goto end;
+    }
+
+    zero_pool[zero_pool_n++] = paddr;
+    res = true;
+
+end:
+    restore_flags(flags);
+    return res;
+}
+
+void physmem_get_zero_stats(physmem_zero_stats_t *out)
+{
+    *out = zero_stats;
+    out->free = zero_pool_n;
+}
+
 /* Internal functions */
 
+/*
+ * Fill a physical page with zeroes through a temporary mapping
+ * Returns false if the page can't be mapped
+ */
+static bool zero_page(void *paddr)
+{
+    void *vaddr = vmem_map_range_anyk(paddr, MEM_PAGE_SIZE);
+    if (!vaddr)
+        return false;
+
+    // Clear 32 bits at a time
+    uint32_t count = MEM_PAGE_SIZE / sizeof(uint32_t);
+    void *dst = vaddr;
+    __asm__ volatile("cld\n"
+                     "rep stosl"
+                     : "+D"(dst), "+c"(count)
+                     : "a"(0)
+                     : "memory");
+
+    vmem_unmap_range_nofree(vaddr, MEM_PAGE_SIZE);
+    return true;
+}
+
 /*
  * Display available physical memory map
  */
@@ -12,6 +12,7 @@
 // Internal function prototypes
 static void vmem_int_set_ptes(void *paddr, void *vaddr, uint32_t n);
 static void vmem_int_set_pte(void *paddr, void *vaddr);
+static void vmem_int_set_pte_flags(void *paddr, void *vaddr, uint32_t flags);
 static void vmem_int_clear_ptes(void *vaddr, uint32_t n);
 static void vmem_int_clear_pte(void *vaddr);
 static void *vmem_alloc_k_alreadymapped(uint32_t n);
@@ -34,6 +35,9 @@ pde_t *cvas_pagedir;
 // Pointer to the self reference mapping of the page tables
 pte_t *cvas_pagetabs;
 
+// Loads pages on demand for vmem_validate_user_ptr_mapped()
+static bool (*page_in_handler)(void *vaddr);
+
 /* Public functions */
 
 void vmem_init(pde_t *pagedir)
@@ -82,6 +86,34 @@ bool vmem_map(void *paddr, void *vaddr, uint32_t n)
     return true;
 }
 
+bool vmem_map_user_ro(void *paddr, void *vaddr, uint32_t n)
+{
+    // Iterate over all pages to map
+    for (uint32_t page = 0; page < n; page++)
+    {
+        void *page_vaddr = (char *)vaddr + page * MEM_PAGE_SIZE;
+        void *page_paddr = (char *)paddr + page * MEM_PAGE_SIZE;
+
+        // Check if the page table for this page table entry exists,
+        // otherwise create it
+        uint32_t pde = vmem_int_pde_index(page_vaddr);
+        if ((cvas_pagedir[pde] & PDE_FLAG_PRESENT) == 0)
+        {
+            // Allocate new page directory
+            if (!vmem_int_new_page_table(pde))
+                return false;
+        }
+
+        // Set corresponding PTE, without the RW bit
+        vmem_int_set_pte_flags(page_paddr, page_vaddr,
+                               PTE_FLAG_PRESENT | PTE_USER);
+
+        vmem_int_flush_tlb();
+    }
+
+    return true;
+}
+
 void *vmem_map_range_anyk(void *paddr, uint32_t size)
 {
     void *vaddr, *paddr_pa;
@@ -287,16 +319,19 @@ void vmem_destroy_uvas()
 
 pde_t *vmem_new_vas()
 {
-    // Allocate space for a new page table
-    pde_t *pde_vaddr = mem_palloc_k(1);
-    if (!pde_vaddr)
+    // Allocate a cleared page for the new Page Directory
+    void *pde_paddr = physmem_alloc_zeroed();
+    if (pde_paddr == PHYSMEM_NULL)
         return NULL;
 
-    // Clear Page Directory
-    memset(pde_vaddr, 0, MEM_PAGE_SIZE);
+    pde_t *pde_vaddr = vmem_map_range_anyk(pde_paddr, MEM_PAGE_SIZE);
+    if (!pde_vaddr)
+    {
+        physmem_free(pde_paddr);
+        return NULL;
+    }
 
     // Set self-reference to Page Directory
-    void *pde_paddr = vmem_get_phys(pde_vaddr);
     pde_vaddr[PDE_NUM - 1] = (uint32_t)pde_paddr | PDE_FLAG_PRESENT;
 
     return pde_vaddr;
@@ -406,13 +441,20 @@ bool vmem_validate_user_ptr_mapped(void *ptr, uint32_t size)
         void *page_vaddr = (char *)start_page + i * MEM_PAGE_SIZE;
 
         // Fail early if at least one page is not mapped
-        if (vmem_get_phys(page_vaddr) == PHYSMEM_NULL)
+        // and can't be loaded on demand
+        if (vmem_get_phys(page_vaddr) == PHYSMEM_NULL &&
+            (!page_in_handler || !page_in_handler(page_vaddr)))
             return false;
     }
 
     return true;
 }
 
+void vmem_set_page_in_handler(bool (*handler)(void *vaddr))
+{
+    page_in_handler = handler;
+}
+
 /* Internal functions */
 
 /*
@@ -517,6 +559,21 @@ static void vmem_int_set_ptes(void *paddr, void *vaddr, uint32_t n)
  *    for which a page table is not assigned in the page directory
  */
 static void vmem_int_set_pte(void *paddr, void *vaddr)
+{
+    vmem_int_set_pte_flags(paddr, vaddr, PTE_FLAG_PRESENT | PTE_USER | PTE_RW);
+}
+
+/*
+ * Create PTE for one page with specific flags
+ * #### Parameters:
+ *  - void *paddr: physical address of the page (page aligned)
+ *  - void *vaddr: virtual address of the page (page aligned)
+ *  - uint32_t flags: PTE flags
+ * #### Notes:
+ *    This function panics if mapping already mapped pages and pages
+ *    for which a page table is not assigned in the page directory
+ */
+static void vmem_int_set_pte_flags(void *paddr, void *vaddr, uint32_t flags)
 {
     size_t pte_index;
     uint32_t pte;
@@ -535,7 +592,7 @@ static void vmem_int_set_pte(void *paddr, void *vaddr)
 
     // Set PTE
     pte = (uint32_t)paddr;
-    pte |= PTE_FLAG_PRESENT | PTE_USER | PTE_RW;
+    pte |= flags;
     cvas_pagetabs[pte_index] = pte;
 }
 
@@ -627,9 +684,12 @@ static inline size_t vmem_int_pde_index(void *addr)
  */
 static bool vmem_int_new_page_table(uint32_t pde)
 {
+    // Use a pre-zeroed page if there is one
+    void *page = physmem_alloc_prezeroed();
+    bool zeroed = page != PHYSMEM_NULL;
+
     // Allocate new page of physical memory
-    void *page;
-    if ((page = physmem_alloc()) == PHYSMEM_NULL)
+    if (!zeroed && (page = physmem_alloc()) == PHYSMEM_NULL)
     {
         // kprintf("[VMEM] vmem_int_new_page_table(pde=%d): physmem_alloc() failed\n", pde);
         return false;
@@ -639,7 +699,8 @@ static bool vmem_int_new_page_table(uint32_t pde)
     vmem_int_set_pde(page, pde);
 
     // Clear Page Table
-    memset((void *)(cvas_pagetabs + pde * PTE_NUM), 0x00, sizeof(pte_t) * PTE_NUM);
+    if (!zeroed)
+        memset((void *)(cvas_pagetabs + pde * PTE_NUM), 0x00, sizeof(pte_t) * PTE_NUM);
 
     // kprintf("[VMEM] Allocated new page table (PDE=%d, phys addr=%x)\n", pde, page);
 
@@ -6,6 +6,9 @@
 #include "mem/mem.h"
 #include "mem/kalloc.h"
 #include "mem/vmem.h"
+#include "blkdev/blkdev.h"
+#include "compress/lz4.h"
+#include "proc/shlib.h"
 #include "error.h"
 #include "log.h"
 
@@ -71,6 +74,12 @@ typedef struct
 #define ELF_PH_TYPE_DYN 2
 #define ELF_PH_TYPE_INTERP 3
 
+// Program header flags
+#define ELF_PF_W 0x2 // Writable segment
+// Segment payload is LZ4 compressed (OS specific flag, set by
+// scripts/elfcompress.py). The paddr field holds the compressed size
+#define ELF_PF_LZ4 0x00100000
+
 // Internal function prototypes
 int32_t check_elf_format(elf_header_t *header);
 int32_t elf_vfs_read(vfs_file_handle_t file, uint8_t *buf,
@@ -78,55 +87,254 @@ int32_t elf_vfs_read(vfs_file_handle_t file, uint8_t *buf,
 int32_t do_load_program(vfs_file_handle_t file, elf_ph_ent_t *ph_table,
                         uint32_t ph_ent_n);
 int32_t do_load_segment(vfs_file_handle_t file, elf_ph_ent_t *ph);
+static int32_t load_file_data(vfs_file_handle_t file, uint8_t *dst,
+                              uint32_t offset, uint32_t n);
+static int32_t read_headers(vfs_file_handle_t file, elf_header_t *header,
+                            elf_ph_ent_t **ph_table);
+static int32_t add_region(proc_cb_t *pcb, elf_ph_ent_t *ph);
+static int32_t load_compressed_data(vfs_file_handle_t file, uint8_t *dst,
+                                    elf_ph_ent_t *ph);
+static int32_t load_interp(vfs_file_handle_t file, elf_ph_ent_t *ph);
+static bool shares_page(elf_ph_ent_t *ph_table, uint32_t ph_ent_n, uint32_t i);
 
 int32_t elf_load(vfs_file_handle_t file, void **entry)
 {
     int32_t res;
+    elf_header_t header;
     elf_ph_ent_t *ph_table = NULL;
 
-    // Load ELF header into memory
+    // Load ELF and program headers
+    if ((res = read_headers(file, &header, &ph_table)) < 0)
+        goto fail;
+
+    // Load program
+    if ((res = do_load_program(file, ph_table, header.ph_ent_num)) < 0)
+        goto fail;
+
+    // Free program header table
+    kfree(ph_table);
+
+    // Set entry point
+    *entry = (void *)header.entry;
+
+    return 0;
+
+fail:
+    kprintf("[ELF] Fail\n");
+    // Free program header table
+    if (ph_table)
+        kfree(ph_table);
+    return res;
+}
+
+int32_t elf_load_demand(vfs_file_handle_t file, proc_cb_t *pcb, void **entry)
+{
+    int32_t res;
     elf_header_t header;
-    if ((res = elf_vfs_read(file, (uint8_t *)&header, 0, sizeof(elf_header_t),
-                            E_NOTELF)) < 0)
+    elf_ph_ent_t *ph_table = NULL;
+
+    // Load ELF and program headers
+    if ((res = read_headers(file, &header, &ph_table)) < 0)
         goto fail;
 
-    kprintf("[ELF] Header read succesfully\n");
+    // Record file backing of each segment
+    pcb->n_regions = 0;
+    for (uint32_t i = 0; i < header.ph_ent_num; i++)
+    {
+        elf_ph_ent_t *ph = &ph_table[i];
 
-    // Check ELF format
-    if ((res = check_elf_format(&header)) < 0)
+        // Ignore NULL and empty segments
+        if (ph->type == ELF_PH_TYPE_NULL ||
+            (ph->type == ELF_PH_TYPE_LOAD && !ph->memsz))
+            continue;
+
+        // Map shared library
+        if (ph->type == ELF_PH_TYPE_INTERP)
+        {
+            if ((res = load_interp(file, ph)) < 0)
+                goto fail;
+            continue;
+        }
+
+        // Fail on unsupported segment types
+        if (ph->type != ELF_PH_TYPE_LOAD)
+        {
+            res = E_ELFFMT;
+            goto fail;
+        }
+
+        // Compressed segments can't be read page by page,
+        // load them now
+        // Their pages are mapped right away, so the part of another
+        // segment in the same page would never be paged in
+        if ((ph->flags & ELF_PF_LZ4) && shares_page(ph_table, header.ph_ent_num, i))
+            res = E_ELFFMT;
+        else if (ph->flags & ELF_PF_LZ4)
+            res = do_load_segment(file, ph);
+        else
+            res = add_region(pcb, ph);
+        if (res < 0)
+            goto fail;
+    }
+
+    // Free program header table
+    kfree(ph_table);
+
+    // The process now owns the file
+    pcb->exe_file = file;
+
+    // Set entry point
+    *entry = (void *)header.entry;
+
+    return 0;
+
+fail:
+    kprintf("[ELF] Fail\n");
+    // Free program header table
+    if (ph_table)
+        kfree(ph_table);
+    pcb->n_regions = 0;
+    return res;
+}
+
+int32_t elf_page_in(proc_cb_t *pcb, void *vaddr)
+{
+    int32_t res;
+    uint8_t *page = vmem_page_aligned(vaddr);
+    bool found = false;
+
+    // Find regions the page belongs to
+    for (uint32_t i = 0; i < pcb->n_regions; i++)
+    {
+        proc_region_t *region = &pcb->regions[i];
+        if ((uint32_t)page < region->start || (uint32_t)page >= region->end)
+            continue;
+
+        // Allocate cleared page the first time a region covers it
+        // (segments can share a page)
+        if (!found)
+        {
+            if (!mem_make_avail(page, 1))
+                return E_NOMEM;
+            found = true;
+        }
+
+        // Copy the part of the page backed by the file
+        uint32_t file_start = region->vaddr;
+        uint32_t file_end = region->vaddr + region->filesz;
+        uint32_t copy_start = (uint32_t)page > file_start ? (uint32_t)page : file_start;
+        uint32_t copy_end = (uint32_t)page + MEM_PAGE_SIZE < file_end
+                                ? (uint32_t)page + MEM_PAGE_SIZE
+                                : file_end;
+        if (copy_start >= copy_end)
+            continue;
+
+        if ((res = load_file_data(pcb->exe_file, (uint8_t *)copy_start,
+                                  region->offset + (copy_start - file_start),
+                                  copy_end - copy_start)) < 0)
+            return res;
+    }
+
+#ifdef DEBUG
+    if (found)
+        kprintf("[ELF] Paged in 0x%x (PID %u)\n", page, pcb->pid);
+#endif
+
+    return found ? 0 : E_INVREQ;
+}
+
+int32_t elf_load_image(vfs_file_handle_t file, uint32_t base,
+                       uint32_t max_pages, uint8_t **image,
+                       uint32_t *n_pages, bool *writable)
+{
+    int32_t res;
+    elf_header_t header;
+    elf_ph_ent_t *ph_table = NULL;
+    uint32_t limit = base + max_pages * MEM_PAGE_SIZE;
+    uint32_t end = base;
+
+    *image = NULL;
+
+    // Load ELF and program headers
+    if ((res = read_headers(file, &header, &ph_table)) < 0)
         goto fail;
 
-    kprintf("[ELF] Format OK\n");
+    // Find the extent of the image
+    for (uint32_t i = 0; i < header.ph_ent_num; i++)
+    {
+        elf_ph_ent_t *ph = &ph_table[i];
+        if (ph->type != ELF_PH_TYPE_LOAD || !ph->memsz)
+            continue;
 
-    // Allocate space for program header table
-    uint32_t ph_table_size = sizeof(elf_ph_ent_t) * header.ph_ent_num;
-    if ((ph_table = kalloc(ph_table_size)) == NULL)
+        // Segment must be inside the image area
+        if (ph->vaddr < base || ph->vaddr >= limit ||
+            ph->memsz > limit - ph->vaddr || ph->filesz > ph->memsz)
+        {
+            res = E_ELFFMT;
+            goto fail;
+        }
+
+        if (ph->vaddr + ph->memsz > end)
+            end = ph->vaddr + ph->memsz;
+    }
+
+    if (end == base)
     {
-        res = E_NOMEM;
+        res = E_ELFFMT;
         goto fail;
     }
 
-    // Load program header table
-    // It can be found at the file offset provided by the header
-    if ((res = elf_vfs_read(file, (uint8_t *)ph_table, header.ph_offset,
-                            ph_table_size, E_ELFFMT)) < 0)
+    // The writable flags array only has room for max_pages
+    *n_pages = vmem_n_pages(end - base);
+    if (*n_pages > max_pages)
+    {
+        res = E_ELFFMT;
         goto fail;
+    }
 
-    // Load program
-    if ((res = do_load_program(file, ph_table, header.ph_ent_num)) < 0)
+    // Allocate cleared kernel memory for the whole image
+    if ((*image = mem_palloc_k(*n_pages)) == MEM_FAIL)
+    {
+        *image = NULL;
+        res = E_NOMEM;
         goto fail;
+    }
+    memset(*image, 0, *n_pages * MEM_PAGE_SIZE);
+    memset(writable, 0, max_pages * sizeof(bool));
 
-    // Free program header table
-    kfree(ph_table);
+    // Load segments
+    for (uint32_t i = 0; i < header.ph_ent_num; i++)
+    {
+        elf_ph_ent_t *ph = &ph_table[i];
+        if (ph->type != ELF_PH_TYPE_LOAD || !ph->memsz)
+            continue;
 
-    // Set entry point
-    *entry = (void *)header.entry;
+        uint8_t *dst = *image + (ph->vaddr - base);
+        if (ph->flags & ELF_PF_LZ4)
+            res = load_compressed_data(file, dst, ph);
+        else
+            res = load_file_data(file, dst, ph->offset, ph->filesz);
+        if (res < 0)
+            goto fail;
+
+        // Pages of writable segments are private to each process
+        if (ph->flags & ELF_PF_W)
+        {
+            uint32_t first = (ph->vaddr - base) / MEM_PAGE_SIZE;
+            uint32_t last = (ph->vaddr + ph->memsz - 1 - base) / MEM_PAGE_SIZE;
+            for (uint32_t p = first; p <= last; p++)
+                writable[p] = true;
+        }
+    }
 
+    kfree(ph_table);
     return 0;
 
 fail:
     kprintf("[ELF] Fail\n");
-    // Free program header table
+    if (*image)
+        mem_pfree(*image, *n_pages);
+    *image = NULL;
     if (ph_table)
         kfree(ph_table);
     return res;
@@ -189,9 +397,18 @@ int32_t do_load_program(vfs_file_handle_t file, elf_ph_ent_t *ph_table,
     // Iterate over all segment
     for (uint32_t i = 0; i < ph_ent_n; i++)
     {
-        // Ignore NULL segments
-        if (ph_table[i].type == ELF_PH_TYPE_NULL)
+        // Ignore NULL and empty segments
+        if (ph_table[i].type == ELF_PH_TYPE_NULL ||
+            (ph_table[i].type == ELF_PH_TYPE_LOAD && !ph_table[i].memsz))
+            continue;
+
+        // Map shared library
+        if (ph_table[i].type == ELF_PH_TYPE_INTERP)
+        {
+            if ((res = load_interp(file, &ph_table[i])) < 0)
+                return res;
             continue;
+        }
 
         // Fail on unsupported segment types
         if (ph_table[i].type != ELF_PH_TYPE_LOAD)
@@ -224,17 +441,219 @@ int32_t do_load_segment(vfs_file_handle_t file, elf_ph_ent_t *ph)
     if (!vmem_validate_user_ptr(page_start, n_pages * MEM_PAGE_SIZE))
         return E_ELFFMT;
 
+    // File backed part can't be larger than the segment
+    if (ph->filesz > ph->memsz)
+        return E_ELFFMT;
+
     // Allocate necessary memory
-    if (!mem_make_avail(page_start, n_pages))
+    // Pages are cleared below only where the file doesn't overwrite them
+    if (!mem_make_avail_uninit(page_start, n_pages))
         return E_NOMEM;
 
-    // Clear memory
-    memset(page_start, 0, n_pages * MEM_PAGE_SIZE);
+    uint8_t *file_end = (uint8_t *)vaddr + ph->filesz;
+    uint8_t *page_end = (uint8_t *)page_start + n_pages * MEM_PAGE_SIZE;
+
+    // Clear memory before the start of the segment
+    memset(page_start, 0, (uint8_t *)vaddr - (uint8_t *)page_start);
 
     // Load segment into memory
-    if ((res = elf_vfs_read(file, vaddr, ph->offset, ph->filesz, E_ELFFMT)) < 0)
+    if (ph->flags & ELF_PF_LZ4)
+        res = load_compressed_data(file, vaddr, ph);
+    else
+        res = load_file_data(file, vaddr, ph->offset, ph->filesz);
+    if (res < 0)
         return res;
 
+    // Clear .bss and the rest of the last page
+    memset(file_end, 0, page_end - file_end);
+
     // Succesfully loaded segment!
     return 0;
-}
\ No newline at end of file
+}
+
+// Read file data directly into its destination
+// Whole blocks are requested from the filesystem as block runs,
+// only the partial blocks at the start and end are copied through
+// the block buffer cache
+static int32_t load_file_data(vfs_file_handle_t file, uint8_t *dst,
+                              uint32_t offset, uint32_t n)
+{
+    int32_t res;
+
+    // Partial block at the start
+    uint32_t head = (BLOCK_SIZE - offset % BLOCK_SIZE) % BLOCK_SIZE;
+    if (head > n)
+        head = n;
+
+    // Whole blocks
+    uint32_t n_blocks = (n - head) / BLOCK_SIZE;
+    uint32_t middle = n_blocks * BLOCK_SIZE;
+
+    if (head && (res = elf_vfs_read(file, dst, offset, head, E_ELFFMT)) < 0)
+        return res;
+
+    if (n_blocks)
+    {
+        int64_t blocks_read = vfs_read_blocks(file, dst + head,
+                                              (offset + head) / BLOCK_SIZE, n_blocks);
+
+        // Filesystem doesn't support block reads, fall back to normal read
+        if (blocks_read == E_NOIMPL)
+        {
+            if ((res = elf_vfs_read(file, dst + head, offset + head, middle,
+                                    E_ELFFMT)) < 0)
+                return res;
+        }
+        else if (blocks_read < 0)
+            return blocks_read;
+        else if (blocks_read < n_blocks)
+            return E_ELFFMT;
+    }
+
+    // Partial block at the end
+    uint32_t tail = n - head - middle;
+    if (tail && (res = elf_vfs_read(file, dst + head + middle, offset + head + middle,
+                                    tail, E_ELFFMT)) < 0)
+        return res;
+
+    return 0;
+}
+
+// Read ELF header and program header table
+// On success, *ph_table points to a kalloc'd table which has
+// to be freed by the caller
+static int32_t read_headers(vfs_file_handle_t file, elf_header_t *header,
+                            elf_ph_ent_t **ph_table)
+{
+    int32_t res;
+
+    // Load ELF header into memory
+    if ((res = elf_vfs_read(file, (uint8_t *)header, 0, sizeof(elf_header_t),
+                            E_NOTELF)) < 0)
+        return res;
+
+    kprintf("[ELF] Header read succesfully\n");
+
+    // Check ELF format
+    if ((res = check_elf_format(header)) < 0)
+        return res;
+
+    kprintf("[ELF] Format OK\n");
+
+    // Allocate space for program header table
+    uint32_t ph_table_size = sizeof(elf_ph_ent_t) * header->ph_ent_num;
+    if ((*ph_table = kalloc(ph_table_size)) == NULL)
+        return E_NOMEM;
+
+    // Load program header table
+    // It can be found at the file offset provided by the header
+    if ((res = elf_vfs_read(file, (uint8_t *)*ph_table, header->ph_offset,
+                            ph_table_size, E_ELFFMT)) < 0)
+        return res;
+
+    return 0;
+}
+
+// Add a segment to the region table of a process
+static int32_t add_region(proc_cb_t *pcb, elf_ph_ent_t *ph)
+{
+    void *page_start = vmem_page_aligned((void *)ph->vaddr);
+    uint32_t n_pages = vmem_n_pages_pa((void *)ph->vaddr, ph->memsz);
+
+    // Check that segment is not trying to load in the KVAS
+    if (!vmem_validate_user_ptr(page_start, n_pages * MEM_PAGE_SIZE))
+        return E_ELFFMT;
+
+    // File backed part can't be larger than the segment
+    if (ph->filesz > ph->memsz)
+        return E_ELFFMT;
+
+    if (pcb->n_regions >= PROC_REGIONS_MAX)
+        return E_TOOMANY;
+
+#ifdef DEBUG
+    kprintf("[ELF] Region: vaddr: 0x%x, memsz: %u, filesz: %u\n",
+            ph->vaddr, ph->memsz, ph->filesz);
+#endif
+
+    proc_region_t *region = &pcb->regions[pcb->n_regions++];
+    region->start = (uint32_t)page_start;
+    region->end = (uint32_t)page_start + n_pages * MEM_PAGE_SIZE;
+    region->vaddr = ph->vaddr;
+    region->offset = ph->offset;
+    region->filesz = ph->filesz;
+
+    return 0;
+}
+
+// Read compressed segment payload and decompress it into its destination
+static int32_t load_compressed_data(vfs_file_handle_t file, uint8_t *dst,
+                                    elf_ph_ent_t *ph)
+{
+    int32_t res;
+    uint32_t csize = ph->paddr;
+    uint32_t n_pages = vmem_n_pages(csize);
+
+    if (!csize)
+        return E_ELFFMT;
+
+    // Temporary buffer for the compressed data
+    uint8_t *buf = mem_palloc_k(n_pages);
+    if (buf == MEM_FAIL)
+        return E_NOMEM;
+
+    if ((res = load_file_data(file, buf, ph->offset, csize)) < 0)
+        goto end;
+
+    // Decompressed data has to fill the file backed part exactly
+    if (lz4_decompress(buf, csize, dst, ph->filesz) != (int32_t)ph->filesz)
+        res = E_ELFFMT;
+
+#ifdef DEBUG
+    kprintf("[ELF] Decompressed segment: %u -> %u bytes\n", csize, ph->filesz);
+#endif
+
+end:
+    mem_pfree(buf, n_pages);
+    return res;
+}
+
+// Map the shared library requested by a PT_INTERP segment
+// into the current UVAS
+static int32_t load_interp(vfs_file_handle_t file, elf_ph_ent_t *ph)
+{
+    int32_t res;
+    char path[SHLIB_PATH_MAX + 1];
+
+    if (!ph->filesz || ph->filesz > SHLIB_PATH_MAX)
+        return E_ELFFMT;
+
+    if ((res = elf_vfs_read(file, (uint8_t *)path, ph->offset, ph->filesz,
+                            E_ELFFMT)) < 0)
+        return res;
+    path[ph->filesz] = 0;
+
+    return shlib_map(path);
+}
+
+// Check if a loadable segment has a page in common with another one
+static bool shares_page(elf_ph_ent_t *ph_table, uint32_t ph_ent_n, uint32_t i)
+{
+    elf_ph_ent_t *ph = &ph_table[i];
+    uint32_t first = ph->vaddr / MEM_PAGE_SIZE;
+    uint32_t last = (ph->vaddr + ph->memsz - 1) / MEM_PAGE_SIZE;
+
+    for (uint32_t j = 0; j < ph_ent_n; j++)
+    {
+        elf_ph_ent_t *other = &ph_table[j];
+        if (j == i || other->type != ELF_PH_TYPE_LOAD || !other->memsz)
+            continue;
+
+        uint32_t other_first = other->vaddr / MEM_PAGE_SIZE;
+        uint32_t other_last = (other->vaddr + other->memsz - 1) / MEM_PAGE_SIZE;
+        if (other_first <= last && first <= other_last)
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,245 @@
+#include "proc/fpu.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include "string.h"
+
+#include "config.h"
+#include "log.h"
+#include "panic.h"
+#include "mem/const.h"
+#include "mem/kalloc.h"
+
+// Configure debugging
+#if DEBUG_FPU == 1
+#define DEBUG
+#endif
+
+// CPUID feature bits (EDX of leaf 1)
+#define CPUID_FEAT_FPU (1 << 0)
+#define CPUID_FEAT_FXSR (1 << 24)
+#define CPUID_FEAT_SSE (1 << 25)
+
+// EFLAGS ID bit (CPUID supported if it can be toggled)
+#define EFLAGS_ID (1 << 21)
+
+// FPU save area, large enough for both FXSAVE and FNSAVE
+// FXSAVE requires 16 byte alignment
+#define FPU_AREA_SIZE 512
+#define FPU_AREA_ALIGN 16
+
+// Default MXCSR (all SSE exceptions masked)
+#define MXCSR_DEFAULT 0x1F80
+
+// Internal functions
+static bool cpuid_supported();
+static uint32_t cpuid_features();
+static void *area_of(proc_cb_t *pcb);
+static void save_ctx(void *area);
+static void restore_ctx(void *area);
+static inline uint32_t read_cr0();
+static inline void write_cr0(uint32_t val);
+static inline void set_ts();
+static inline void clts();
+
+// Global objects
+static bool fpu_present;
+static bool fxsr_present;
+static proc_cb_t *fpu_owner; // Process whose context is in the FPU
+
+// Initial FPU state for processes using the FPU for the first time
+static uint8_t initial_ctx[FPU_AREA_SIZE] __attribute__((aligned(FPU_AREA_ALIGN)));
+
+/* Public functions */
+
+void fpu_init()
+{
+    fpu_owner = NULL;
+
+    uint32_t features = cpuid_supported() ? cpuid_features() : 0;
+    fpu_present = features & CPUID_FEAT_FPU;
+    fxsr_present = features & CPUID_FEAT_FXSR;
+
+    if (!fpu_present)
+    {
+        // FPU instructions will trap with #NM and terminate the process
+        write_cr0(read_cr0() | CR0_EM);
+        kprintf("[FPU] No FPU detected\n");
+        return;
+    }
+
+    // Native FPU error reporting, trap on WAIT/FWAIT when TS is set
+    uint32_t cr0 = read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    // Enable FXSAVE/FXRSTOR and SSE exceptions
+    if (fxsr_present)
+    {
+        uint32_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if (features & CPUID_FEAT_SSE)
+            cr4 |= CR4_OSXMMEXCPT;
+        __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+    }
+
+    // Save the state of a freshly initialized FPU
+    __asm__ volatile("fninit");
+    if (features & CPUID_FEAT_SSE)
+    {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile("ldmxcsr %0" ::"m"(mxcsr));
+    }
+    save_ctx(initial_ctx);
+
+    // The first FPU instruction of any process will trap
+    set_ts();
+
+    kprintf("[FPU] FPU enabled (FXSR: %s, SSE: %s)\n",
+            fxsr_present ? "yes" : "no",
+            (features & CPUID_FEAT_SSE) ? "yes" : "no");
+}
+
+void fpu_switch(proc_cb_t *next)
+{
+    if (!fpu_present)
+        return;
+
+    // Only trap if the FPU holds the context of another process
+    if (next == fpu_owner)
+        clts();
+    else
+        set_ts();
+}
+
+bool fpu_handle_nm()
+{
+    if (!fpu_present)
+        return false;
+
+    proc_cb_t *cur = proc_cur();
+
+    clts();
+
+    // Context is already loaded
+    if (fpu_owner == cur)
+        return true;
+
+    // First FPU use by this process: allocate save area
+    if (!cur->fpu_area)
+    {
+        if (!(cur->fpu_area = kalloc(FPU_AREA_SIZE + FPU_AREA_ALIGN)))
+            return false;
+
+        memcpy(area_of(cur), initial_ctx, FPU_AREA_SIZE);
+
+#ifdef DEBUG
+        kprintf("[FPU] PID %u started using the FPU\n", cur->pid);
+#endif
+    }
+
+    // Save context of the previous owner
+    if (fpu_owner)
+        save_ctx(area_of(fpu_owner));
+
+    restore_ctx(area_of(cur));
+    fpu_owner = cur;
+
+    return true;
+}
+
+void fpu_release(proc_cb_t *pcb)
+{
+    if (fpu_owner == pcb)
+        fpu_owner = NULL;
+
+    if (pcb->fpu_area)
+    {
+        kfree(pcb->fpu_area);
+        pcb->fpu_area = NULL;
+    }
+}
+
+/* Internal functions */
+
+// Check if the CPUID instruction is supported
+static bool cpuid_supported()
+{
+    uint32_t before, after;
+
+    // Try to toggle the ID bit in EFLAGS
+    __asm__ volatile(
+        "pushfl\n"
+        "pushfl\n"
+        "popl %0\n"
+        "movl %0, %1\n"
+        "xorl %2, %1\n"
+        "pushl %1\n"
+        "popfl\n"
+        "pushfl\n"
+        "popl %1\n"
+        "popfl\n"
+        : "=&r"(before), "=&r"(after)
+        : "i"(EFLAGS_ID));
+
+    return (before ^ after) & EFLAGS_ID;
+}
+
+// Get CPU feature flags (EDX of CPUID leaf 1)
+static uint32_t cpuid_features()
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid"
+                     : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+// Get aligned save area of a process
+static void *area_of(proc_cb_t *pcb)
+{
+    return (void *)(((uint32_t)pcb->fpu_area + FPU_AREA_ALIGN - 1) &
+                    ~(FPU_AREA_ALIGN - 1));
+}
+
+// Save FPU context
+static void save_ctx(void *area)
+{
+    if (fxsr_present)
+        __asm__ volatile("fxsave (%0)" ::"r"(area) : "memory");
+    else
+        __asm__ volatile("fnsave (%0)\n"
+                         "fwait" ::"r"(area) : "memory");
+}
+
+// Restore FPU context
+static void restore_ctx(void *area)
+{
+    if (fxsr_present)
+        __asm__ volatile("fxrstor (%0)" ::"r"(area) : "memory");
+    else
+        __asm__ volatile("frstor (%0)" ::"r"(area) : "memory");
+}
+
+static inline uint32_t read_cr0()
+{
+    uint32_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t val)
+{
+    __asm__ volatile("mov %0, %%cr0" ::"r"(val));
+}
+
+static inline void set_ts()
+{
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void clts()
+{
+    __asm__ volatile("clts");
+}
@@ -16,8 +16,12 @@
 #include "log.h"
 #include "syscall/syscall.h"
 #include "fs/path.h"
-
-#define PROC_STACK_PAGES 4
+#include "clock.h"
+#include "proc/sched.h"
+#include "proc/fpu.h"
+#include "proc/elf.h"
+#include "proc/shlib.h"
+#include "mem/physmem.h"
 
 // Working director of the init process
 #define INIT_CWD "0:"
@@ -31,36 +35,72 @@
 static bool alloc_proc_stack(uint32_t n);
 static void init_proc_files(proc_file_t files[]);
 static bool find_free_file(proc_file_t files[], uint32_t *idx);
+static void close_proc_files(proc_file_t files[]);
+static void destroy_uvas();
+static proc_cb_t *alloc_pcb();
+static proc_cb_t *pool_get();
+static bool map_proc_stack(proc_cb_t *pcb);
+static void save_proc_stack(proc_cb_t *pcb);
+static void close_exe_file(proc_cb_t *pcb);
 
 // Global objects
-proc_cb_t *cur_proc;  // Current process
-slock_t cur_proc_lck; // Lock to the current process variable
-slock_t terminate_lock;
+proc_cb_t *cur_proc; // Current process
+proc_cb_t *fg_proc;  // Foreground process
+uint32_t next_pid;
+static proc_stats_t stats;
+
+// Pool of recycled processes
+// Each one keeps its kernel stack, page directory (with an empty UVAS)
+// and zeroed user stack pages
+static proc_cb_t *pool[PROC_POOL_SIZE];
+static uint32_t pool_n;
 
 void proc_init()
 {
-    // Initialize locks
-    slock_init(&cur_proc_lck);
-    slock_init(&terminate_lock);
-
     // Allocate a PCB for the init process
     proc_cb_t *pcb = kalloc(sizeof(proc_cb_t));
     if (!pcb)
         goto fail;
 
+    // Allocate kernel stack
+    if ((pcb->kstack = mem_palloc_k(PROC_KSTACK_PAGES)) == MEM_FAIL)
+        goto fail;
+
     // Set up PCB of init process
     pcb->pid = 0;                  // Init process has PID 0
     pcb->parent = NULL;            // No parent
     pcb->pagedir = vmem_cur_vas(); // Init process inherits bootstrap VAS
     strcpy(pcb->cwd, INIT_CWD);    // Current working directory
     init_proc_files(pcb->files);
+    pcb->sched_next = NULL;
+    pcb->waiter = NULL;
+    pcb->wait_queue = NULL;
+    pcb->fpu_area = NULL;
+    pcb->exe_file = -1;
+    pcb->n_regions = 0;
+    pcb->terminate_lock = false;
+    pcb->kill_pending = false;
+    pcb->stack_saved = false;
+    next_pid = 1;
+    pool_n = 0;
 
     // Allocate process stack
     if (!alloc_proc_stack(PROC_STACK_PAGES))
         goto fail;
 
+    // Map time page
+    if (!clock_map_time_page())
+        goto fail;
+
     // Set current process
     cur_proc = pcb;
+    fg_proc = pcb;
+
+    // Load pages of executables on first access
+    vmem_set_page_in_handler(proc_page_in);
+
+    // Start scheduling
+    sched_init(pcb);
 
     return;
 
@@ -68,112 +108,187 @@ fail:
     panic("PROC_INIT_NOMEM", "Out of memory while initializing process management");
 }
 
-int32_t proc_push()
+int32_t proc_create(proc_cb_t **child)
 {
-    int32_t res;
-
-    // Lazily try to get lock
-    if (!slock_try_acquire(&cur_proc_lck))
-        return E_BUSY;
+    uint64_t start = rdtsc();
 
     // Get reference to current process
     proc_cb_t *parent = cur_proc;
 
-    // Allocate a PCB for the init process
-    proc_cb_t *pcb = kalloc(sizeof(proc_cb_t));
-    if (!pcb)
-    {
-        res = E_NOMEM;
-        goto fail;
-    }
-
-    // Create new VAS for the new process
-    pde_t *new_vas = vmem_new_vas();
-    if (!new_vas)
-    {
-        res = E_NOMEM;
-        goto fail_free_pcb;
-    }
+    // Reuse a recycled process if possible
+    proc_cb_t *pcb = pool_get();
+    if (!pcb && !(pcb = alloc_pcb()))
+        return E_NOMEM;
 
     // Switch to the new address space
-    vmem_switch_vas(new_vas);
+    vmem_switch_vas(pcb->pagedir);
 
-    // Allocate process stack
+    // Map process stack and time page
     // (inside new VAS)
-    if (!alloc_proc_stack(PROC_STACK_PAGES))
+    if (!map_proc_stack(pcb) || !clock_map_time_page())
     {
-        res = E_NOMEM;
-        goto fail_delete_vas;
+        destroy_uvas();
+        vmem_switch_vas(parent->pagedir);
+        proc_free(pcb);
+        return E_NOMEM;
     }
 
     // Set up PCB
-    pcb->pid = parent->pid + 1;
+    pcb->pid = next_pid++;
     pcb->parent = parent;
-    pcb->pagedir = new_vas;
     strcpy(pcb->cwd, parent->cwd); // Inherits parent CWD
     init_proc_files(pcb->files);
-
-    // Set current process
-    cur_proc = pcb;
+    pcb->sched_next = NULL;
+    pcb->waiter = NULL;
+    pcb->wait_queue = NULL;
+    pcb->fpu_area = NULL;
+    pcb->exe_file = -1;
+    pcb->n_regions = 0;
+    pcb->terminate_lock = false;
+    pcb->kill_pending = false;
+    pcb->create_tsc = start;
 
 #ifdef DEBUG
     kprintf("[PROC] New process: PID = %u\n", pcb->pid);
 #endif
 
-    slock_release(&cur_proc_lck);
+    *child = pcb;
     return 0;
+}
 
-fail_delete_vas:
-    vmem_delete_vas(new_vas);
-fail_free_pcb:
-    kfree(pcb);
-fail:
-    slock_release(&cur_proc_lck);
-    return res;
+void proc_start(proc_cb_t *pcb)
+{
+    // Back to the address space of the current process
+    vmem_switch_vas(cur_proc->pagedir);
+
+    sched_add(pcb);
+
+    // Account exec latency
+    uint64_t cycles = rdtsc() - pcb->create_tsc;
+    stats.exec_count++;
+    stats.exec_total += cycles;
+    if (cycles > stats.exec_max)
+        stats.exec_max = cycles;
+}
+
+void proc_abort(proc_cb_t *pcb)
+{
+#ifdef DEBUG
+    kprintf("[PROC] Abort process: PID = %u\n", pcb->pid);
+#endif
+
+    // Free userspace memory of the process
+    destroy_uvas();
+    close_exe_file(pcb);
+
+    // Back to the address space of the current process
+    vmem_switch_vas(cur_proc->pagedir);
+
+    proc_free(pcb);
 }
 
-int32_t proc_pop()
+int32_t proc_wait(proc_cb_t *pcb)
 {
-    int res;
+    proc_cb_t *cur = cur_proc;
+
+    // The child takes over the foreground
+    pcb->waiter = cur;
+    fg_proc = pcb;
 
-    // Lazily try to get lock
-    if (!slock_try_acquire(&cur_proc_lck))
-        return E_BUSY;
+    // Let other processes do system calls while waiting
+    sched_unlock_kernel();
+    sched_block();
+    sched_lock_kernel();
 
+    return cur->child_status;
+}
+
+int32_t proc_exit(int32_t status)
+{
+    uint64_t start = rdtsc();
     proc_cb_t *pcb = cur_proc;
-    proc_cb_t *parent_pcb = pcb->parent;
 
 #ifdef DEBUG
     kprintf("[PROC] Destroy process: PID = %u\n", pcb->pid);
 #endif
 
     // The init process (parent == NULL) is not allowd to exit
-    if (!parent_pcb)
+    if (!pcb->parent)
+        return E_NOTPERM;
+
+    // Close files left open by the process
+    close_proc_files(pcb->files);
+    close_exe_file(pcb);
+
+    // Keep stack pages for recycling, then
+    // free userspace memory for the current process
+    save_proc_stack(pcb);
+    destroy_uvas();
+
+    // Pass exit status to the waiting parent
+    if (pcb->waiter)
     {
-        res = E_NOTPERM;
-        goto fail;
+        pcb->waiter->child_status = status;
+        sched_wake(pcb->waiter);
     }
 
-    // Free userspace memory for the current process
-    vmem_destroy_uvas();
+    // Foreground goes back to the parent
+    if (fg_proc == pcb)
+        fg_proc = pcb->waiter;
 
-    // Switch to the parent address space and delete
-    // the current processes'
-    vmem_switch_vas(parent_pcb->pagedir);
-    vmem_delete_vas(pcb->pagedir);
+    if (sched_holds_kernel())
+        sched_unlock_kernel();
+
+    // Account exit latency
+    uint64_t cycles = rdtsc() - start;
+    stats.exit_count++;
+    stats.exit_total += cycles;
+    if (cycles > stats.exit_max)
+        stats.exit_max = cycles;
+
+    // The PCB, kernel stack and page directory are freed by the
+    // scheduler once another process is running
+    sched_exit();
+
+    // Never reached
+    return E_UNKNOWN;
+}
+
+void proc_free(proc_cb_t *pcb)
+{
+    fpu_release(pcb);
 
-    // The parent process is now the current process
-    cur_proc = parent_pcb;
+    // Keep process objects for reuse
+    if (pool_n < PROC_POOL_SIZE)
+    {
+        pool[pool_n++] = pcb;
+        return;
+    }
 
-    // Free PCB
+    if (pcb->stack_saved)
+        for (size_t i = 0; i < PROC_STACK_PAGES; i++)
+            physmem_free(pcb->stack_pages[i]);
+
+    vmem_delete_vas(pcb->pagedir);
+    mem_pfree(pcb->kstack, PROC_KSTACK_PAGES);
     kfree(pcb);
+}
 
-    slock_release(&cur_proc_lck);
+bool proc_page_in(void *vaddr)
+{
+    int32_t res = elf_page_in(cur_proc, vaddr);
 
-    return 0;
-fail:
-    slock_release(&cur_proc_lck);
-    return res;
+    if (res < 0 && res != E_INVREQ)
+        kprintf("[PROC] Page in failed (PID %u, 0x%x): %s\n", cur_proc->pid,
+                vaddr, error_get_message(res));
+
+    return res == 0;
+}
+
+void proc_get_stats(proc_stats_t *out)
+{
+    *out = stats;
+    out->pool_free = pool_n;
 }
 
 proc_cb_t *proc_cur()
@@ -181,11 +296,21 @@ proc_cb_t *proc_cur()
     return cur_proc;
 }
 
+void proc_set_cur(proc_cb_t *pcb)
+{
+    cur_proc = pcb;
+}
+
+proc_cb_t *proc_fg()
+{
+    return fg_proc;
+}
+
 // Set up CPU context for process execution
 // entry: entrypoint of the program
-void proc_setup_cpu_ctx(void *entry)
+void proc_setup_cpu_ctx(proc_cb_t *pcb, void *entry)
 {
-    cpu_ctx_t *ctx = &cur_proc->cpu_ctx;
+    cpu_ctx_t *ctx = &pcb->cpu_ctx;
 
     // General registers
     ctx->eax = 0;
@@ -402,20 +527,141 @@ fail:
     pcb->cpu_ctx.eax = (uint32_t)res;
 }
 
+// Read from current position system call
+void syscall_read_next(proc_cb_t *pcb)
+{
+    int32_t res;
+
+    // Get parameters
+    uint32_t p_fd = pcb->cpu_ctx.ebx;
+    uint8_t *p_buf = (uint8_t *)pcb->cpu_ctx.ecx;
+    uint32_t p_n = pcb->cpu_ctx.edx;
+
+    // Check if file is in use
+    if (p_fd >= MAX_FILES || !pcb->files[p_fd].used)
+    {
+        res = E_NOENT;
+        goto fail;
+    }
+
+    // Validate buffer
+    if (!vmem_validate_user_ptr_mapped(p_buf, p_n))
+    {
+        dishon_exit_from_syscall();
+        return;
+    }
+
+    set_terminate_lock();
+
+    // Execute read operation
+    res = vfs_read_next(pcb->files[p_fd].vfs_handle, p_buf, p_n);
+
+fail:
+    release_terminate_lock();
+    pcb->cpu_ctx.eax = (uint32_t)res;
+}
+
+// Seek system call
+void syscall_seek(proc_cb_t *pcb)
+{
+    int64_t res;
+
+    // Get parameters
+    uint32_t p_fd = pcb->cpu_ctx.ebx;
+    int32_t p_offset = (int32_t)pcb->cpu_ctx.ecx;
+    uint32_t p_whence = pcb->cpu_ctx.edx;
+
+    // Check if file is in use
+    if (p_fd >= MAX_FILES || !pcb->files[p_fd].used)
+    {
+        res = E_NOENT;
+        goto fail;
+    }
+
+    set_terminate_lock();
+
+    vfs_file_handle_t file = pcb->files[p_fd].vfs_handle;
+
+    // Current position, restored if the new one can't be returned
+    int64_t prev = vfs_seek(file, 0, VFS_SEEK_CUR);
+    if ((res = prev) < 0)
+        goto fail;
+
+    // Execute seek operation
+    res = vfs_seek(file, p_offset, p_whence);
+
+    // The position is returned in eax
+    if (res > INT32_MAX)
+    {
+        vfs_seek(file, prev, VFS_SEEK_SET);
+        res = E_INVREQ;
+    }
+
+fail:
+    release_terminate_lock();
+    pcb->cpu_ctx.eax = (uint32_t)res;
+}
+
+// Write system call
+typedef struct __attribute__((packed))
+{
+    uint32_t fd;
+    uint8_t *buf;
+    uint32_t offset, n;
+} sc_write_params_t;
+void syscall_write(proc_cb_t *pcb)
+{
+    int32_t res;
+
+    // Get parameters
+    sc_write_params_t *params = (sc_write_params_t *)pcb->cpu_ctx.ebx;
+
+    // Validate parameters struct
+    if (!vmem_validate_user_ptr_mapped(params, sizeof(sc_write_params_t)))
+    {
+        dishon_exit_from_syscall();
+        return;
+    }
+
+    // Check if file is in use
+    if (params->fd >= MAX_FILES || !pcb->files[params->fd].used)
+    {
+        res = E_NOENT;
+        goto fail;
+    }
+
+    // Validate buffer
+    if (!vmem_validate_user_ptr_mapped(params->buf, params->n))
+    {
+        dishon_exit_from_syscall();
+        return;
+    }
+
+    set_terminate_lock();
+
+    // Execute write operation
+    res = vfs_write(pcb->files[params->fd].vfs_handle, params->buf, params->offset, params->n);
+
+fail:
+    release_terminate_lock();
+    pcb->cpu_ctx.eax = (uint32_t)res;
+}
+
 bool proc_can_terminate()
 {
-    return !slock_peek(&terminate_lock);
+    return !cur_proc->terminate_lock;
 }
 
 void set_terminate_lock()
 {
-    if (!slock_try_acquire(&terminate_lock))
+    if (cur_proc->terminate_lock)
         kprintf("[PROC] WARN!! Terminate lock already set!\n");
+    cur_proc->terminate_lock = true;
 }
 
 void release_terminate_lock()
 {
-    slock_release(&terminate_lock);
+    cur_proc->terminate_lock = false;
 }
 
 static bool alloc_proc_stack(uint32_t npages)
@@ -444,4 +690,125 @@ static bool find_free_file(proc_file_t files[], uint32_t *idx)
         }
     }
     return false;
+}
+
+// Close all files left open in a process' file array
+static void close_proc_files(proc_file_t files[])
+{
+    for (size_t i = 0; i < MAX_FILES; i++)
+    {
+        if (files[i].used)
+        {
+            vfs_close(files[i].vfs_handle);
+            files[i].used = false;
+        }
+    }
+}
+
+// Free all userspace memory of the current VAS,
+// except for the shared time page and shared library
+static void destroy_uvas()
+{
+    if (vmem_get_phys((void *)CLOCK_TIME_PAGE_ADDR) != PHYSMEM_NULL)
+        clock_unmap_time_page();
+    shlib_unmap();
+
+    vmem_destroy_uvas();
+}
+
+// Allocate a new PCB, with its kernel stack and page directory
+// Returns NULL on failure
+static proc_cb_t *alloc_pcb()
+{
+    proc_cb_t *pcb = kalloc(sizeof(proc_cb_t));
+    if (!pcb)
+        goto fail;
+
+    if ((pcb->kstack = mem_palloc_k(PROC_KSTACK_PAGES)) == MEM_FAIL)
+        goto fail_free_pcb;
+
+    if (!(pcb->pagedir = vmem_new_vas()))
+        goto fail_free_kstack;
+
+    // proc_free() must be able to release a PCB which was never set up
+    pcb->stack_saved = false;
+    pcb->fpu_area = NULL;
+
+    return pcb;
+
+fail_free_kstack:
+    mem_pfree(pcb->kstack, PROC_KSTACK_PAGES);
+fail_free_pcb:
+    kfree(pcb);
+fail:
+    return NULL;
+}
+
+// Get a process from the recycling pool
+// Returns NULL if the pool is empty
+static proc_cb_t *pool_get()
+{
+    if (!pool_n)
+    {
+        stats.pool_misses++;
+        return NULL;
+    }
+
+    stats.pool_hits++;
+    return pool[--pool_n];
+}
+
+// Map process stack in the current VAS,
+// reusing the saved stack pages if there are any
+static bool map_proc_stack(proc_cb_t *pcb)
+{
+    if (!pcb->stack_saved)
+        return alloc_proc_stack(PROC_STACK_PAGES);
+
+    // From now on the pages are owned by the UVAS
+    pcb->stack_saved = false;
+
+    for (size_t i = 0; i < PROC_STACK_PAGES; i++)
+    {
+        void *vaddr = (void *)(KERNEL_VAS_START - MEM_PAGE_SIZE * (PROC_STACK_PAGES - i));
+        if (!vmem_map(pcb->stack_pages[i], vaddr, 1))
+        {
+            // Free pages which didn't make it into the UVAS
+            for (; i < PROC_STACK_PAGES; i++)
+                physmem_free(pcb->stack_pages[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Clear process stack and remove it from the current VAS,
+// keeping its pages for the next user of the PCB
+static void save_proc_stack(proc_cb_t *pcb)
+{
+    void *vaddr = (void *)(KERNEL_VAS_START - MEM_PAGE_SIZE * PROC_STACK_PAGES);
+
+    // Stack pages could have been unmapped by the process
+    for (size_t i = 0; i < PROC_STACK_PAGES; i++)
+        if (vmem_get_phys((uint8_t *)vaddr + i * MEM_PAGE_SIZE) == PHYSMEM_NULL)
+            return;
+
+    memset(vaddr, 0, MEM_PAGE_SIZE * PROC_STACK_PAGES);
+
+    for (size_t i = 0; i < PROC_STACK_PAGES; i++)
+        pcb->stack_pages[i] = vmem_get_phys((uint8_t *)vaddr + i * MEM_PAGE_SIZE);
+
+    vmem_unmap(vaddr, PROC_STACK_PAGES);
+    pcb->stack_saved = true;
+}
+
+// Close the executable file used for demand paging
+static void close_exe_file(proc_cb_t *pcb)
+{
+    if (pcb->exe_file >= 0)
+        vfs_close(pcb->exe_file);
+
+    pcb->exe_file = -1;
+    pcb->n_regions = 0;
 }
\ No newline at end of file
@@ -0,0 +1,334 @@
+#include "proc/sched.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "log.h"
+#include "panic.h"
+#include "cpu.h"
+#include "waitq.h"
+#include "mem/const.h"
+#include "mem/gdt.h"
+#include "mem/vmem.h"
+#include "proc/fpu.h"
+#include "syscall/go_user.h"
+#include "syscall/syscall.h"
+
+// Configure debugging
+#if DEBUG_SCHED == 1
+#define DEBUG
+#endif
+
+#define TIMER_IRQ 0
+
+// Number of timer ticks a process can run in userspace
+// before being preempted
+#define SCHED_QUANTUM 2
+
+// Initial kernel stack frame of a new process,
+// in the layout restored by sched_switch_stack()
+typedef struct __attribute__((packed))
+{
+    uint32_t edi, esi, ebx, ebp;
+    uint32_t eflags;
+    uint32_t eip;      // Return address of sched_switch_stack()
+    uint32_t ret_addr; // Return address of the entry function (unused)
+} start_frame_t;
+
+// Switch kernel stack (assembly function)
+void sched_switch_stack(uint32_t *old_esp, uint32_t new_esp);
+
+// Internal function prototypes
+static void sched_tick();
+static void switch_to_next();
+static void proc_entry();
+static void reap_zombie();
+static void enqueue(proc_cb_t **head, proc_cb_t **tail, proc_cb_t *pcb);
+static proc_cb_t *dequeue(proc_cb_t **head, proc_cb_t **tail);
+
+// Global objects
+static bool active;                        // Scheduler initialized
+static proc_cb_t *ready_head, *ready_tail; // Ready queue
+static proc_cb_t *zombie;                  // Exited process to be freed
+static volatile uint32_t ticks;            // Ticks since last switch
+static volatile bool need_resched;         // Current quantum elapsed
+
+// Kernel lock
+static bool kernel_locked;
+static proc_cb_t *kernel_owner;
+static proc_cb_t *lock_head, *lock_tail; // Processes waiting for the lock
+
+/* Public functions */
+
+void sched_init(proc_cb_t *init)
+{
+    ready_head = ready_tail = NULL;
+    lock_head = lock_tail = NULL;
+    zombie = NULL;
+    ticks = 0;
+    need_resched = false;
+    kernel_locked = false;
+    kernel_owner = NULL;
+
+    // Init process is running
+    init->state = PROC_RUNNING;
+    gdt_set_kernel_stack(proc_kstack_top(init));
+
+    // Count time slices on the timer IRQ
+    interrupts_register_irq(TIMER_IRQ, sched_tick);
+
+    active = true;
+}
+
+void sched_add(proc_cb_t *pcb)
+{
+    // Set up the kernel stack so that the first switch to the process
+    // returns into proc_entry(), with interrupts disabled
+    start_frame_t *frame =
+        (start_frame_t *)(proc_kstack_top(pcb) - sizeof(start_frame_t));
+    frame->edi = 0;
+    frame->esi = 0;
+    frame->ebx = 0;
+    frame->ebp = 0;
+    frame->eflags = EFLAGS;
+    frame->eip = (uint32_t)proc_entry;
+    frame->ret_addr = 0;
+    pcb->kstack_esp = (uint32_t)frame;
+
+    sched_wake(pcb);
+}
+
+void sched_wake(proc_cb_t *pcb)
+{
+    // Can be called from interrupt handlers
+    uint32_t flags = cli_save();
+
+    if (pcb == proc_cur())
+        // Process is idling on its own stack in sched_block(),
+        // it just has to stop waiting
+        pcb->state = PROC_RUNNING;
+    else
+    {
+        pcb->state = PROC_READY;
+        enqueue(&ready_head, &ready_tail, pcb);
+    }
+
+    // Don't let the idle loop halt before running it
+    cpu_wake();
+
+    restore_flags(flags);
+}
+
+void sched_yield()
+{
+    if (!ready_head)
+        return;
+
+    // Current process goes to the back of the ready queue
+    proc_cb_t *cur = proc_cur();
+    uint32_t flags = cli_save();
+    cur->state = PROC_READY;
+    enqueue(&ready_head, &ready_tail, cur);
+    restore_flags(flags);
+
+    switch_to_next();
+}
+
+void sched_block()
+{
+    proc_cb_t *cur = proc_cur();
+    cur->state = PROC_WAITING;
+
+    // Run other processes until this one is woken up
+    // With nothing else to run, the CPU idles on the stack of this
+    // process, which isn't in the ready queue meanwhile
+    while (cur->state == PROC_WAITING)
+    {
+        if (ready_head)
+            switch_to_next();
+        else
+            cpu_idle();
+    }
+}
+
+void sched_exit()
+{
+    proc_cb_t *cur = proc_cur();
+    cur->state = PROC_ZOMBIE;
+
+    // Wait for another process to be woken up
+    while (!ready_head)
+        cpu_idle();
+
+    // The next process will free this one,
+    // as we are still running on its kernel stack
+    zombie = cur;
+    switch_to_next();
+
+    // Never reached
+    panic("SCHED_EXIT_RETURNED", "Exited process was scheduled");
+}
+
+bool sched_others_ready()
+{
+    return active && ready_head != NULL;
+}
+
+void sched_idle()
+{
+    // A process that isn't running can only get here from idle work
+    // executed on its stack, it can't be switched away from, and
+    // neither can idle and deferred work running on a process' stack
+    if (sched_others_ready() && proc_cur()->state == PROC_RUNNING &&
+        !cpu_in_idle_work())
+        sched_yield();
+    else
+        cpu_idle();
+}
+
+void sched_user_return(interrupt_context_t *ctx)
+{
+    if (!active)
+        return;
+
+    proc_cb_t *pcb = proc_cur();
+
+    // Handle termination requested while the process wasn't running
+    if (pcb->kill_pending)
+    {
+        pcb->kill_pending = false;
+        dishon_exit_from_int(ctx);
+        return;
+    }
+
+    // Preempt process if its quantum is over
+    if (need_resched)
+        sched_yield();
+}
+
+void sched_lock_kernel()
+{
+    // Sleep until the lock is free
+    while (kernel_locked)
+    {
+        enqueue(&lock_head, &lock_tail, proc_cur());
+        sched_block();
+    }
+
+    kernel_locked = true;
+    kernel_owner = proc_cur();
+}
+
+void sched_unlock_kernel()
+{
+    kernel_locked = false;
+    kernel_owner = NULL;
+
+    // Let the first waiter try to acquire the lock
+    proc_cb_t *waiter = dequeue(&lock_head, &lock_tail);
+    if (waiter)
+        sched_wake(waiter);
+}
+
+bool sched_holds_kernel()
+{
+    return kernel_locked && kernel_owner == proc_cur();
+}
+
+/* Internal functions */
+
+// Timer IRQ handler
+static void sched_tick()
+{
+    if (!active)
+        return;
+
+    if (++ticks >= SCHED_QUANTUM)
+        need_resched = true;
+}
+
+// Switch to the first process in the ready queue
+static void switch_to_next()
+{
+    proc_cb_t *prev = proc_cur();
+
+    // Processes are added to the ready queue by interrupt handlers
+    uint32_t flags = cli_save();
+    proc_cb_t *next = dequeue(&ready_head, &ready_tail);
+
+    ticks = 0;
+    need_resched = false;
+    next->state = PROC_RUNNING;
+
+    if (next != prev)
+    {
+#ifdef DEBUG
+        kprintf("[SCHED] Switch: PID %u -> PID %u\n", prev->pid, next->pid);
+#endif
+
+        // Switch address space and kernel stack
+        proc_set_cur(next);
+        vmem_switch_vas(next->pagedir);
+        gdt_set_kernel_stack(proc_kstack_top(next));
+        fpu_switch(next);
+
+        // The interrupt context belongs to the kernel stack
+        interrupt_context_t *ctx = interrupt_get_cur_ctx();
+        sched_switch_stack(&prev->kstack_esp, next->kstack_esp);
+        interrupt_set_cur_ctx(ctx);
+
+        // NOTE: we are now back in the context of prev
+        reap_zombie();
+    }
+
+    restore_flags(flags);
+}
+
+// Entry point of new processes on their kernel stack
+static void proc_entry()
+{
+    reap_zombie();
+    interrupt_set_cur_ctx(NULL);
+
+    go_userspace(&proc_cur()->cpu_ctx);
+}
+
+// Free process that has exited
+static void reap_zombie()
+{
+    if (!zombie)
+        return;
+
+    proc_free(zombie);
+    zombie = NULL;
+}
+
+// Add process to the tail of a queue
+static void enqueue(proc_cb_t **head, proc_cb_t **tail, proc_cb_t *pcb)
+{
+    pcb->sched_next = NULL;
+
+    if (*tail)
+        (*tail)->sched_next = pcb;
+    else
+        *head = pcb;
+
+    *tail = pcb;
+}
+
+// Remove process from the head of a queue
+// Returns NULL if the queue is empty
+static proc_cb_t *dequeue(proc_cb_t **head, proc_cb_t **tail)
+{
+    proc_cb_t *pcb = *head;
+    if (!pcb)
+        return NULL;
+
+    *head = pcb->sched_next;
+    if (!*head)
+        *tail = NULL;
+
+    pcb->sched_next = NULL;
+    return pcb;
+}
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "proc/shlib.h"
+
+#include <stdbool.h>
+#include "string.h"
+
+#include "config.h"
+#include "log.h"
+#include "error.h"
+#include "mem/mem.h"
+#include "mem/vmem.h"
+#include "fs/vfs.h"
+#include "proc/elf.h"
+
+// Configure debugging
+#if DEBUG_ELF == 1
+#define DEBUG
+#endif
+
+// Loaded shared library
+static char lib_path[SHLIB_PATH_MAX + 1];
+static uint8_t *image = NULL; // Kernel copy of the image
+static uint32_t n_pages;
+static bool writable[SHLIB_MAX_PAGES];
+
+// Internal function prototypes
+static int32_t load_lib(const char *path);
+
+/* Public functions */
+
+int32_t shlib_map(const char *path)
+{
+    int32_t res;
+
+    // Load library on first use
+    if (!image)
+    {
+        if ((res = load_lib(path)) < 0)
+            return res;
+    }
+    else if (strcmp(path, lib_path) != 0)
+        return E_NOIMPL;
+
+    for (uint32_t i = 0; i < n_pages; i++)
+    {
+        uint8_t *vaddr = (uint8_t *)SHLIB_ADDR + i * MEM_PAGE_SIZE;
+        uint8_t *page = image + i * MEM_PAGE_SIZE;
+
+        if (writable[i])
+        {
+            // Private copy of the initial data
+            if (!mem_make_avail_uninit(vaddr, 1))
+                return E_NOMEM;
+            memcpy(vaddr, page, MEM_PAGE_SIZE);
+        }
+        else if (!vmem_map_user_ro(vmem_get_phys(page), vaddr, 1))
+            return E_NOMEM;
+    }
+
+    return 0;
+}
+
+void shlib_unmap()
+{
+    if (!image)
+        return;
+
+    // Only unmap pages actually backed by the shared image
+    for (uint32_t i = 0; i < n_pages; i++)
+    {
+        uint8_t *vaddr = (uint8_t *)SHLIB_ADDR + i * MEM_PAGE_SIZE;
+        if (!writable[i] &&
+            vmem_get_phys(vaddr) == vmem_get_phys(image + i * MEM_PAGE_SIZE))
+            vmem_unmap(vaddr, 1);
+    }
+}
+
+/* Internal functions */
+
+// Load the shared library image into kernel memory
+static int32_t load_lib(const char *path)
+{
+    int32_t res;
+
+    if (strlen(path) > SHLIB_PATH_MAX)
+        return E_INVREQ;
+
+    vfs_file_handle_t file;
+    if ((file = vfs_open(path, 0)) < 0)
+        return file;
+
+    res = elf_load_image(file, SHLIB_ADDR, SHLIB_MAX_PAGES, &image,
+                         &n_pages, writable);
+    vfs_close(file);
+    if (res < 0)
+        return res;
+
+    strcpy(lib_path, path);
+
+#ifdef DEBUG
+    uint32_t n_shared = 0;
+    for (uint32_t i = 0; i < n_pages; i++)
+        n_shared += !writable[i];
+    kprintf("[SHLIB] Loaded %s: %u pages (%u shared)\n", path, n_pages,
+            n_shared);
+#endif
+
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include "config.h"
 #include "syscall/go_user.h"
 #include "proc/proc.h"
+#include "proc/sched.h"
 #include "log.h"
 #include "mem/const.h"
 #include "mem/vmem.h"
@@ -22,6 +23,12 @@
 
 #define MSG_N 64
 
+// Maximum number of entries in a system call batch
+#define BATCH_MAX 64
+
+// Batch flags
+#define BATCH_STOP_ON_ERROR (1 << 0) // Stop at the first negative result
+
 // Configure debugging
 #if DEBUG_SYSCALL == 1
 #define DEBUG
@@ -33,6 +40,8 @@
  *  - 0x0100: Get system time
  *  - 0x0101: Get local time
  *  - 0x0110: Delay (ms)
+ * == 0x03XX ---- Batch
+ *  - 0x0300: Execute batch of system calls
  */
 
 // System call numbers
@@ -48,11 +57,15 @@ typedef enum
     SYSCALL_CONSOLE_READLINE = 0x0201,
     SYSCALL_CONSOLE_GETCHAR = 0x0202,
 
+    // Batch system call
+    SYSCALL_BATCH = 0x0300,
+
     // Process management system calls
     SYSCALL_EXIT = 0x1000,
     SYSCALL_EXEC = 0x1001,
     SYSCALL_CHANGE_CWD = 0x1002,
     SYSCALL_GET_CWD = 0x1003,
+    SYSCALL_SPAWN = 0x1004,
 
     // Filesystem syscalls
     SYSCALL_MOUNT = 0x1100,
@@ -60,8 +73,11 @@ typedef enum
     SYSCALL_OPEN = 0x1110,
     SYSCALL_CLOSE = 0x1111,
     SYSCALL_READ = 0x1112,
-    // SYSCALL_WRITE = 0x1113,
+    SYSCALL_WRITE = 0x1113,
     SYSCALL_READDIR = 0x1114,
+    SYSCALL_SYNC = 0x1115,
+    SYSCALL_READ_NEXT = 0x1116,
+    SYSCALL_SEEK = 0x1117,
 } syscall_n_t;
 
 void iret_to_kernel(interrupt_context_t *int_ctx, void *dst);
@@ -74,11 +90,17 @@ void syscall_console_readline(proc_cb_t *pcb);
 void syscall_console_getchar(proc_cb_t *pcb);
 void syscall_exit(proc_cb_t *pcb);
 void syscall_exec(proc_cb_t *pcb);
+void syscall_spawn(proc_cb_t *pcb);
+static int32_t load_child(proc_cb_t *pcb, proc_cb_t **child);
 void syscall_change_cwd(proc_cb_t *pcb);
 void syscall_mount(proc_cb_t *pcb);
 void syscall_unmount(proc_cb_t *pcb);
+void syscall_sync(proc_cb_t *pcb);
 void syscall_get_cwd(proc_cb_t *pcb);
+void syscall_batch(proc_cb_t *pcb);
 void dishonorable_exit_handler();
+void page_fault_handler();
+static bool dispatch_batch_entry(proc_cb_t *pcb, syscall_n_t syscall_n);
 
 // This function is executed in the intererupt handler of the
 // system call interrupt. It copies the current CPU context into the
@@ -94,35 +116,31 @@ void dishon_exit_from_int(interrupt_context_t *int_ctx)
     iret_to_kernel(int_ctx, dishonorable_exit_handler);
 }
 
+void page_fault_from_int(interrupt_context_t *int_ctx, void *addr)
+{
+    proc_cur()->fault_addr = addr;
+    iret_to_kernel(int_ctx, page_fault_handler);
+}
+
 // Handle a dishonorable exit from a process
 // This function is executed when a process tries to do womething
 // it shouldn't, and has to be immediately terminated
-// The parent process will receive E_TERM as the exec() call result
+// The parent process will receive -100 as the exit status
+// NOTE: does not return
 void dishon_exit_from_syscall()
 {
     char msg[MSG_N];
     int32_t res;
 
     // Exit from current process
-    if ((res = proc_pop()) < 0)
-    {
-        // Failure
-
-        // There's nothing we can do but panic
-        snprintf(msg, MSG_N, "Error in dishonorable exit handler: %s\n",
-                 error_get_message(res));
-        panic("DISHONORABLE_EXIT_ERR", msg);
-
-        // Will never reach here
-    }
-
-    // Recover new current proces
-    proc_cb_t *pcb = proc_cur();
-
-    // This will appear to the parent process as the result from the
-    // exec() call
-    pcb->cpu_ctx.eax = 0;              // Because the exit call was succesful
-    pcb->cpu_ctx.ebx = (uint32_t)-100; // TODO: define process return codes
+    // TODO: define process return codes
+    res = proc_exit(-100);
+
+    // Failure
+    // There's nothing we can do but panic
+    snprintf(msg, MSG_N, "Error in dishonorable exit handler: %s\n",
+             error_get_message(res));
+    panic("DISHONORABLE_EXIT_ERR", msg);
 }
 
 // Return from interrupt to kernel mode
@@ -152,8 +170,9 @@ void iret_to_kernel(interrupt_context_t *int_ctx, void *dst)
     int_ctx->es = GDT_SEGMENT_KDATA;
     int_ctx->fs = GDT_SEGMENT_KDATA;
     int_ctx->gs = GDT_SEGMENT_KDATA;
-    int_ctx->esp = (uint32_t)&kernel_stack_top;
-    int_ctx->ebp = (uint32_t)&kernel_stack_top;
+    // Each process has its own kernel stack
+    int_ctx->esp = proc_kstack_top(pcb);
+    int_ctx->ebp = proc_kstack_top(pcb);
 }
 
 // Actual system call handler, executed OUTSIDE of the interrupt
@@ -162,6 +181,9 @@ void syscall_handler()
 {
     proc_cb_t *pcb = proc_cur();
 
+    // System calls are executed one at a time
+    sched_lock_kernel();
+
     // Syscall number is in EAX
     syscall_n_t syscall_n = pcb->cpu_ctx.eax;
 
@@ -193,6 +215,11 @@ void syscall_handler()
         syscall_console_getchar(pcb);
         break;
 
+        // Batch syscall
+    case SYSCALL_BATCH:
+        syscall_batch(pcb);
+        break;
+
         // Process management syscalls
     case SYSCALL_EXIT:
         syscall_exit(pcb);
@@ -206,6 +233,9 @@ void syscall_handler()
     case SYSCALL_GET_CWD:
         syscall_get_cwd(pcb);
         break;
+    case SYSCALL_SPAWN:
+        syscall_spawn(pcb);
+        break;
 
         // Filesystem system calls
     case SYSCALL_MOUNT:
@@ -223,9 +253,21 @@ void syscall_handler()
     case SYSCALL_READ:
         syscall_read(pcb);
         break;
+    case SYSCALL_WRITE:
+        syscall_write(pcb);
+        break;
     case SYSCALL_READDIR:
         syscall_readdir(pcb);
         break;
+    case SYSCALL_SYNC:
+        syscall_sync(pcb);
+        break;
+    case SYSCALL_READ_NEXT:
+        syscall_read_next(pcb);
+        break;
+    case SYSCALL_SEEK:
+        syscall_seek(pcb);
+        break;
 
     default:
         // Unknown system call
@@ -233,9 +275,14 @@ void syscall_handler()
         dishon_exit_from_syscall();
     }
 
-    // Recover new current process, as it could have been changed
-    // by the system call
-    pcb = proc_cur();
+    // Termination requested while the process was in a system call
+    if (pcb->kill_pending)
+    {
+        pcb->kill_pending = false;
+        dishon_exit_from_syscall();
+    }
+
+    sched_unlock_kernel();
 
     // Return to process
     go_userspace(&pcb->cpu_ctx);
@@ -254,7 +301,10 @@ void syscall_delay_ms(proc_cb_t *pcb)
     // Get parameters
     uint32_t time = pcb->cpu_ctx.ebx;
 
+    // Other processes can do system calls in the meantime
+    sched_unlock_kernel();
     clock_delay_ms(time);
+    sched_lock_kernel();
 }
 
 // Console write syscall
@@ -289,7 +339,10 @@ void syscall_console_readline(proc_cb_t *pcb)
         return;
     }
 
+    // Other processes can do system calls while waiting for input
+    sched_unlock_kernel();
     int32_t res = console_readline(buf, n);
+    sched_lock_kernel();
 
     // Set return value
     pcb->cpu_ctx.eax = res;
@@ -298,7 +351,10 @@ void syscall_console_readline(proc_cb_t *pcb)
 // Console getchar syscall
 void syscall_console_getchar(proc_cb_t *pcb)
 {
+    // Other processes can do system calls while waiting for input
+    sched_unlock_kernel();
     uint32_t res = (uint32_t)_g_console_getchar();
+    sched_lock_kernel();
 
     // Set return value
     pcb->cpu_ctx.eax = res;
@@ -310,113 +366,53 @@ void syscall_exit(proc_cb_t *pcb)
     int32_t retval = pcb->cpu_ctx.ebx;
     int32_t res;
 
-    set_terminate_lock();
-
     // Exit from current process
-    if ((res = proc_pop()) < 0)
-    {
-        // Failure
-        // Return to current process
-
-        release_terminate_lock();
-
-        // Return value to caller process
-        pcb->cpu_ctx.eax = (uint32_t)res;
-        return;
-    }
+    // On success, retval is passed to the parent as the exec() status
+    // and this call doesn't return
+    res = proc_exit(retval);
 
-    // Recover new current proces
-    pcb = proc_cur();
-
-    release_terminate_lock();
-
-    // This will appear to the parent process as the result from the
-    // exec() call
-    pcb->cpu_ctx.eax = 0;
-    pcb->cpu_ctx.ebx = (uint32_t)retval;
+    // Failure
+    // Return value to caller process
+    pcb->cpu_ctx.eax = (uint32_t)res;
 }
 
 // Exec syscall
+// Runs a child process and waits for it to exit
 void syscall_exec(proc_cb_t *pcb)
 {
     int32_t res;
+    proc_cb_t *child;
 
-    // Get parameters
-    char *p_path = (char *)pcb->cpu_ctx.ebx;
-    uint32_t p_n = pcb->cpu_ctx.ecx;
-
-    // Validate path pointer
-    if (!vmem_validate_user_ptr_mapped(p_path, p_n))
-    {
-        dishon_exit_from_syscall();
-        return;
-    }
-
-    // Check length of path
-    if (p_n > PATH_MAX)
-    {
-        res = E_INVREQ;
-        goto fail;
-    }
-
-    // Copy pointer to kernel memory
-    char path[PATH_MAX + 1];
-    memcpy(path, p_path, p_n);
-    path[p_n] = 0;
-
-    // Resolve relative path
-    char abspath[PATH_MAX + 1];
-    if (!path_resolve_relative(abspath, pcb->cwd, path))
-    {
-        res = E_NOENT;
-        goto fail;
-    }
-
-    set_terminate_lock();
-
-    // Open file
-    vfs_file_handle_t file;
-    if ((file = vfs_open(abspath, 0)) < 0)
-    {
-        res = file;
+    if ((res = load_child(pcb, &child)) < 0)
         goto fail;
-    }
-
-    kprintf("[SYSCALL] Exec: file opened: %s\n", abspath);
 
-    // Create new process
-    if ((res = proc_push()) < 0)
-    {
-        // Failure
-        // Return to current process
-        goto fail_closefile;
-    }
+    // Wait for the child process to exit
+    int32_t status = proc_wait(child);
 
-    // NOTE: We are now in the context of the new process
-
-    // Load ELF
-    void *entry;
-    if ((res = elf_load(file, &entry)) < 0)
-        goto fail_destroyproc;
+    // Success!
+    pcb->cpu_ctx.eax = 0;
+    pcb->cpu_ctx.ebx = (uint32_t)status;
+    return;
 
-    // Close executable file
-    vfs_close(file);
+fail:
+    // Return value to caller process
+    pcb->cpu_ctx.eax = (uint32_t)res;
+}
 
-    // Here would be where we set up the args and other things
-    // Passed to the new process
+// Spawn syscall
+// Runs a child process in the background
+void syscall_spawn(proc_cb_t *pcb)
+{
+    int32_t res;
+    proc_cb_t *child;
 
-    // Set up process CPU context
-    proc_setup_cpu_ctx(entry);
+    if ((res = load_child(pcb, &child)) < 0)
+        goto fail;
 
-    release_terminate_lock();
+    // Return PID of the child
+    res = (int32_t)child->pid;
 
-    return;
-fail_closefile:
-    vfs_close(file);
-fail_destroyproc:
-    proc_pop();
 fail:
-    release_terminate_lock();
     // Return value to caller process
     pcb->cpu_ctx.eax = (uint32_t)res;
 }
@@ -588,12 +584,272 @@ fail:
     pcb->cpu_ctx.eax = res;
 }
 
+// Sync syscall
+// Writes modified data of all filesystems to their devices
+void syscall_sync(proc_cb_t *pcb)
+{
+    set_terminate_lock();
+
+    int32_t res = vfs_sync();
+
+    release_terminate_lock();
+    // Set result
+    pcb->cpu_ctx.eax = res;
+}
+
+// Batch syscall
+// Executes an array of system calls in order with a single trap,
+// writing the result of each one in its entry
+typedef struct __attribute__((packed))
+{
+    uint32_t syscall_n;
+    int32_t res;
+
+    // Parameters
+    // For read, write and readdir, they have the same layout as
+    // the respective parameter struct
+    uint32_t params[4];
+} sc_batch_entry_t;
+void syscall_batch(proc_cb_t *pcb)
+{
+    int32_t res;
+
+    // Get parameters
+    sc_batch_entry_t *p_entries = (sc_batch_entry_t *)pcb->cpu_ctx.ebx;
+    uint32_t p_n = pcb->cpu_ctx.ecx;
+    uint32_t p_flags = pcb->cpu_ctx.edx;
+
+    // Check number of entries
+    if (p_n > BATCH_MAX)
+    {
+        res = E_INVREQ;
+        goto fail;
+    }
+
+    // Validate entries array
+    if (!vmem_validate_user_ptr_mapped(p_entries, p_n * sizeof(sc_batch_entry_t)))
+    {
+        dishon_exit_from_syscall();
+        return;
+    }
+
+    // Execute entries
+    uint32_t i;
+    for (i = 0; i < p_n; i++)
+    {
+        sc_batch_entry_t *entry = &p_entries[i];
+
+        // Set up registers as if the system call was issued directly
+        // Result defaults to 0 for system calls that don't return one
+        pcb->cpu_ctx.eax = 0;
+        if (entry->syscall_n == SYSCALL_READ || entry->syscall_n == SYSCALL_WRITE ||
+            entry->syscall_n == SYSCALL_READDIR)
+        {
+            pcb->cpu_ctx.ebx = (uint32_t)entry->params;
+        }
+        else
+        {
+            pcb->cpu_ctx.ebx = entry->params[0];
+            pcb->cpu_ctx.ecx = entry->params[1];
+            pcb->cpu_ctx.edx = entry->params[2];
+        }
+
+        if (!dispatch_batch_entry(pcb, entry->syscall_n))
+            pcb->cpu_ctx.eax = (uint32_t)E_INVREQ;
+
+        // The process was terminated by the system call,
+        // its memory is gone
+        if (proc_cur() != pcb)
+            return;
+
+        entry->res = (int32_t)pcb->cpu_ctx.eax;
+
+        // Stop at first error if requested
+        if ((p_flags & BATCH_STOP_ON_ERROR) && entry->res < 0)
+        {
+            i++;
+            break;
+        }
+    }
+
+    // Restore parameter registers
+    pcb->cpu_ctx.ebx = (uint32_t)p_entries;
+    pcb->cpu_ctx.ecx = p_n;
+    pcb->cpu_ctx.edx = p_flags;
+
+    // Return number of executed entries
+    res = i;
+
+fail:
+    // Set result
+    pcb->cpu_ctx.eax = res;
+}
+
 // Called by handle_dishonoraable_exit, not syscall
 void dishonorable_exit_handler()
 {
+    // Process could have been interrupted outside of a system call
+    if (!sched_holds_kernel())
+        sched_lock_kernel();
+
+    // Never returns
     dishon_exit_from_syscall();
+}
 
-    // Return to process
+// Called by page_fault_from_int, not syscall
+// Loads the faulting page and restarts the faulting instruction
+void page_fault_handler()
+{
     proc_cb_t *pcb = proc_cur();
+
+    // Reading the executable needs the filesystem
+    sched_lock_kernel();
+
+    // Access outside of the process' memory
+    if (!proc_page_in(pcb->fault_addr))
+    {
+        kprintf("[PROC] Page fault at 0x%x\n", pcb->fault_addr);
+        dishon_exit_from_syscall();
+    }
+
+    // Termination requested while the page was loaded
+    if (pcb->kill_pending)
+    {
+        pcb->kill_pending = false;
+        dishon_exit_from_syscall();
+    }
+
+    sched_unlock_kernel();
+
+    // Return to process
     go_userspace(&pcb->cpu_ctx);
 }
+
+// Dispatch a system call from a batch
+// Only system calls that can't change the current process are allowed
+// Returns false if the system call can't be batched
+static bool dispatch_batch_entry(proc_cb_t *pcb, syscall_n_t syscall_n)
+{
+    switch (syscall_n)
+    {
+    case SYSCALL_CONSOLE_WRITE:
+        syscall_console_write(pcb);
+        break;
+    case SYSCALL_CONSOLE_READLINE:
+        syscall_console_readline(pcb);
+        break;
+    case SYSCALL_CONSOLE_GETCHAR:
+        syscall_console_getchar(pcb);
+        break;
+    case SYSCALL_OPEN:
+        syscall_open(pcb);
+        break;
+    case SYSCALL_CLOSE:
+        syscall_close(pcb);
+        break;
+    case SYSCALL_READ:
+        syscall_read(pcb);
+        break;
+    case SYSCALL_WRITE:
+        syscall_write(pcb);
+        break;
+    case SYSCALL_READDIR:
+        syscall_readdir(pcb);
+        break;
+    case SYSCALL_READ_NEXT:
+        syscall_read_next(pcb);
+        break;
+    case SYSCALL_SEEK:
+        syscall_seek(pcb);
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+// Create a child process and load an executable into it
+// The path to the executable is passed in ebx (pointer) and ecx (length)
+// On success, the child is ready to be scheduled
+// Returns 0 on success, < 0 on failure
+static int32_t load_child(proc_cb_t *pcb, proc_cb_t **child)
+{
+    int32_t res;
+
+    // Get parameters
+    char *p_path = (char *)pcb->cpu_ctx.ebx;
+    uint32_t p_n = pcb->cpu_ctx.ecx;
+
+    // Validate path pointer
+    if (!vmem_validate_user_ptr_mapped(p_path, p_n))
+        dishon_exit_from_syscall();
+
+    // Check length of path
+    if (p_n > PATH_MAX)
+        return E_INVREQ;
+
+    // Copy pointer to kernel memory
+    char path[PATH_MAX + 1];
+    memcpy(path, p_path, p_n);
+    path[p_n] = 0;
+
+    // Resolve relative path
+    char abspath[PATH_MAX + 1];
+    if (!path_resolve_relative(abspath, pcb->cwd, path))
+        return E_NOENT;
+
+    set_terminate_lock();
+
+    // Open file
+    vfs_file_handle_t file;
+    if ((file = vfs_open(abspath, 0)) < 0)
+    {
+        res = file;
+        goto fail;
+    }
+
+#ifdef DEBUG
+    kprintf("[SYSCALL] Exec: file opened: %s\n", abspath);
+#endif
+
+    // Create new process
+    if ((res = proc_create(child)) < 0)
+        goto fail_closefile;
+
+    // NOTE: We are now in the address space of the new process
+
+    // Load ELF
+    void *entry;
+#if ELF_DEMAND_PAGING == 1
+    res = elf_load_demand(file, *child, &entry);
+#else
+    res = elf_load(file, &entry);
+#endif
+    if (res < 0)
+        goto fail_abortproc;
+
+    // Close executable file, unless the process keeps it for demand paging
+    if ((*child)->exe_file != file)
+        vfs_close(file);
+
+    // Here would be where we set up the args and other things
+    // Passed to the new process
+
+    // Set up process CPU context
+    proc_setup_cpu_ctx(*child, entry);
+
+    // Back to the current process, child is ready to run
+    proc_start(*child);
+
+    release_terminate_lock();
+    return 0;
+
+fail_abortproc:
+    proc_abort(*child);
+fail_closefile:
+    vfs_close(file);
+fail:
+    release_terminate_lock();
+    return res;
+}
\ No newline at end of file
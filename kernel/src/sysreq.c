@@ -6,9 +6,19 @@
 #include "int/interrupts.h"
 #include "syscall/syscall.h"
 #include "proc/proc.h"
+#include "clock.h"
+#include "log.h"
+#include "int/workq.h"
+#include "mem/physmem.h"
+#include "blkdev/blkdev.h"
 
 // Internal functions
 void kbd_event_receiver(kbd_event_t e);
+static void log_idle_time();
+static void log_workq_stats();
+static void log_proc_stats();
+static void log_zero_pool_stats();
+static void log_blkdev_cache_stats();
 
 void sysreq_init()
 {
@@ -37,12 +47,137 @@ void kbd_event_receiver(kbd_event_t e)
         // Trigger kernel panic
         panic("USER_REQUEST", "User requested kernel panic");
 
+    // Ctrl + Alt + I
+    if ((e.keysym == KS_i || e.keysym == KS_I) && e.mod.ctrl &&
+        e.mod.alt && !e.mod.shift)
+        // Log CPU idle time
+        log_idle_time();
+
+    // Ctrl + Alt + W
+    if ((e.keysym == KS_w || e.keysym == KS_W) && e.mod.ctrl &&
+        e.mod.alt && !e.mod.shift)
+        // Log deferred work queue statistics
+        log_workq_stats();
+
+    // Ctrl + Alt + P
+    if ((e.keysym == KS_p || e.keysym == KS_P) && e.mod.ctrl &&
+        e.mod.alt && !e.mod.shift)
+        // Log process management statistics
+        log_proc_stats();
+
+    // Ctrl + Alt + Z
+    if ((e.keysym == KS_z || e.keysym == KS_Z) && e.mod.ctrl &&
+        e.mod.alt && !e.mod.shift)
+        // Log zeroed page pool statistics
+        log_zero_pool_stats();
+
+    // Ctrl + Alt + B
+    if ((e.keysym == KS_b || e.keysym == KS_B) && e.mod.ctrl &&
+        e.mod.alt && !e.mod.shift)
+        // Log block layer statistics
+        log_blkdev_cache_stats();
+
     // Ctrl + C
     if ((e.keysym == KS_c || e.keysym == KS_C) && e.mod.ctrl && !e.mod.alt &&
         !e.mod.shift)
     {
+        // Terminate foreground process
         // Ignore CTRL + C in init process
-        if (proc_cur()->parent && proc_can_terminate())
-            dishon_exit_from_int(interrupt_get_cur_ctx());
+        proc_cb_t *fg = proc_fg();
+        if (fg->parent)
+        {
+            // Keyboard events are processed as deferred work, which
+            // normally runs at the end of the keyboard interrupt
+            interrupt_context_t *ctx = interrupt_get_cur_ctx();
+            if (ctx && fg == proc_cur() && proc_can_terminate())
+                dishon_exit_from_int(ctx);
+            else
+                // Terminate it as soon as it's safe to
+                fg->kill_pending = true;
+        }
     }
+}
+
+// Log time spent idle by the CPU since boot
+static void log_idle_time()
+{
+    uint32_t system = clock_get_system();
+    uint32_t idle = clock_get_idle();
+    uint32_t percent = system ? (uint64_t)idle * 100 / system : 0;
+
+    kprintf("[SYSREQ] CPU idle: %u ms of %u ms (%u%%)\n", idle, system, percent);
+}
+
+// Log statistics of the deferred work queues
+static void log_workq_stats()
+{
+    static const char *names[WORKQ_N] = {"timer", "kbd"};
+
+    for (size_t i = 0; i < WORKQ_N; i++)
+    {
+        workq_stats_t stats;
+        workq_get_stats(i, &stats);
+
+        uint32_t avg = stats.executed ? stats.total_latency / stats.executed : 0;
+        kprintf("[SYSREQ] Workq %s: executed=%u dropped=%u max_pending=%u "
+                "latency avg=%u ms max=%u ms\n",
+                names[i], stats.executed, stats.dropped, stats.max_pending,
+                avg, stats.max_latency);
+    }
+}
+
+// Log exec/exit latencies and process pool usage
+static void log_proc_stats()
+{
+    proc_stats_t stats;
+    proc_get_stats(&stats);
+
+    // Latencies are printed in thousands of cycles
+    uint32_t exec_avg = stats.exec_count ? stats.exec_total / stats.exec_count / 1000 : 0;
+    uint32_t exit_avg = stats.exit_count ? stats.exit_total / stats.exit_count / 1000 : 0;
+
+    kprintf("[SYSREQ] Exec: count=%u latency avg=%u kcycles max=%u kcycles\n",
+            stats.exec_count, exec_avg, (uint32_t)(stats.exec_max / 1000));
+    kprintf("[SYSREQ] Exit: count=%u latency avg=%u kcycles max=%u kcycles\n",
+            stats.exit_count, exit_avg, (uint32_t)(stats.exit_max / 1000));
+    kprintf("[SYSREQ] Process pool: hits=%u misses=%u free=%u\n",
+            stats.pool_hits, stats.pool_misses, stats.pool_free);
+}
+
+// Log hit rate of the zeroed page pool
+static void log_zero_pool_stats()
+{
+    physmem_zero_stats_t stats;
+    physmem_get_zero_stats(&stats);
+
+    uint32_t total = stats.hits + stats.misses;
+    uint32_t percent = total ? (uint64_t)stats.hits * 100 / total : 0;
+
+    kprintf("[SYSREQ] Zeroed page pool: hits=%u misses=%u (%u%% hit rate) free=%u\n",
+            stats.hits, stats.misses, percent, stats.free);
+}
+
+// Log block buffer cache and request queue statistics
+static void log_blkdev_cache_stats()
+{
+    blkdev_cache_stats_t stats;
+    blkdev_get_cache_stats(&stats);
+
+    uint32_t total = stats.hits + stats.misses;
+    uint32_t percent = total ? (uint64_t)stats.hits * 100 / total : 0;
+
+    kprintf("[SYSREQ] Buffer cache: hits=%u misses=%u (%u%% hit rate) evictions=%u "
+            "flushed=%u write errors=%u prefetched=%u\n",
+            stats.hits, stats.misses, percent, stats.evictions,
+            stats.flushed, stats.write_errors, stats.prefetched);
+
+    blkdev_queue_stats_t qstats;
+    blkdev_get_queue_stats(&qstats);
+
+    uint32_t avg = qstats.completed ? qstats.total_latency / qstats.completed : 0;
+
+    kprintf("[SYSREQ] Block queue: depth=%u (max %u) completed=%u merged=%u "
+            "dispatches=%u latency=%ums avg %ums max\n",
+            qstats.depth, qstats.max_depth, qstats.completed, qstats.merged,
+            qstats.dispatches, avg, qstats.max_latency);
 }
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include "waitq.h"
+
+#include "int/interrupts.h"
+#include "int/workq.h"
+#include "clock.h"
+#include "proc/sched.h"
+#include "proc/proc.h"
+#include "mem/physmem.h"
+#include "blkdev/blkdev.h"
+
+// Internal function prototypes
+static bool wait_flag(waitq_t *wq, uint32_t timeout);
+
+// Global objects
+static volatile bool cpu_halted;
+static volatile bool wake_pending; // Process woken up since the last halt
+static bool idle_working;          // Idle work running further down the stack
+static proc_cb_t *sleepers; // Processes sleeping on wait queues
+
+/* Public functions */
+
+void waitq_init(waitq_t *wq)
+{
+    wq->signaled = false;
+}
+
+void waitq_clear(waitq_t *wq)
+{
+    wq->signaled = false;
+}
+
+void waitq_signal(waitq_t *wq)
+{
+    uint32_t flags = cli_save();
+
+    wq->signaled = true;
+
+    // Waits on the flag check it again instead of halting
+    cpu_wake();
+
+    // Wake up all processes sleeping on the wait queue
+    proc_cb_t **link = &sleepers;
+    while (*link)
+    {
+        proc_cb_t *pcb = *link;
+        if (pcb->wait_queue == wq)
+        {
+            *link = pcb->wait_next;
+            pcb->wait_woken = true;
+            sched_wake(pcb);
+        }
+        else
+            link = &pcb->wait_next;
+    }
+
+    restore_flags(flags);
+}
+
+bool waitq_wait(waitq_t *wq, uint32_t timeout)
+{
+    proc_cb_t *pcb = proc_cur();
+
+    // No process to put to sleep yet, or waiting inside idle or
+    // deferred work, which can't switch processes
+    if (!pcb || pcb->state != PROC_RUNNING || cpu_in_idle_work())
+        return wait_flag(wq, timeout);
+
+    cli();
+    if (wq->signaled)
+    {
+        sti();
+        return true;
+    }
+
+    // From now on, only the signal wakes up the process
+    // The flag can be cleared by the next waiter before this one runs
+    pcb->wait_queue = wq;
+    pcb->wait_woken = false;
+    pcb->wait_deadline = timeout == WAITQ_FOREVER ? 0 : clock_get_system() + timeout;
+    pcb->wait_next = sleepers;
+    sleepers = pcb;
+
+    // Let other processes run, or halt the CPU, until the signal
+    // or the timeout wakes this one up
+    // Interrupts are still disabled, so the wake up can't come before
+    // the process is blocked
+    sched_block();
+
+    cli();
+    bool res = pcb->wait_woken;
+    pcb->wait_queue = NULL;
+    sti();
+
+    return res;
+}
+
+void waitq_check_timeouts(uint64_t time)
+{
+    proc_cb_t **link = &sleepers;
+    while (*link)
+    {
+        proc_cb_t *pcb = *link;
+        if (pcb->wait_deadline && time > pcb->wait_deadline)
+        {
+            *link = pcb->wait_next;
+            sched_wake(pcb);
+        }
+        else
+            link = &pcb->wait_next;
+    }
+}
+
+void cpu_idle()
+{
+    // Idle and deferred work that waits for something ends up here
+    // again, it can only halt until the next interrupt
+    if (!cpu_in_idle_work())
+    {
+        idle_working = true;
+
+        // Callers check their wait condition with interrupts disabled,
+        // but the work can take a whole driver request, during which
+        // interrupts must be served
+        sti();
+
+        // Nobody is waiting on queued block requests right now,
+        // so this is the time to serve them
+        // Otherwise use idle time to prepare zeroed pages,
+        // one at a time to keep wake-up latency low
+        bool worked = blkdev_run_queues() || physmem_refill_zeroed();
+
+        // Run deferred work instead of sleeping, as it
+        // could be what the caller is waiting for
+        cli();
+        if (!worked && workq_pending())
+        {
+            workq_run();
+            worked = true;
+        }
+        sti();
+
+        idle_working = false;
+
+        if (worked)
+            return;
+    }
+
+    // Interrupts are only disabled from the last check to the HLT
+    cli();
+
+    // A process has been woken up, or a wait queue signaled, while the
+    // work above was running: the caller has to check again
+    if (wake_pending)
+    {
+        wake_pending = false;
+        sti();
+        return;
+    }
+
+    cpu_halted = true;
+
+    // STI takes effect after the next instruction, so no interrupt
+    // can be lost between the two
+    __asm__ volatile("sti; hlt" ::: "memory");
+
+    cpu_halted = false;
+}
+
+bool cpu_is_idle()
+{
+    return cpu_halted;
+}
+
+bool cpu_in_idle_work()
+{
+    return idle_working || workq_running();
+}
+
+void cpu_wake()
+{
+    wake_pending = true;
+}
+
+/* Internal functions */
+
+// Wait for the flag of a wait queue to be set, without
+// switching processes
+static bool wait_flag(waitq_t *wq, uint32_t timeout)
+{
+    uint64_t start = clock_get_system();
+
+    while (true)
+    {
+        cli();
+
+        if (wq->signaled)
+        {
+            sti();
+            return true;
+        }
+
+        if (timeout != WAITQ_FOREVER && clock_get_system() - start > timeout)
+        {
+            sti();
+            return false;
+        }
+
+        cpu_idle();
+    }
+}
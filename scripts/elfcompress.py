@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+#
+# Compress the loadable segments of a GOOS executable with LZ4.
+#
+# The file is rewritten in place: every PT_LOAD segment whose payload
+# gets smaller is stored as an LZ4 block, marked with the ELF_PF_LZ4
+# program header flag. The compressed size goes in p_paddr, p_filesz
+# keeps the uncompressed size. Section headers are dropped, the kernel
+# doesn't use them.
+#
+# Compressed segments are decompressed whole at exec time instead of
+# being paged in on demand, trading memory and startup time for disk
+# space. Segments sharing a page with another loadable segment are left
+# uncompressed, the kernel rejects them.
+#
+# Usage: elfcompress.py <file> [<output>]
+
+import struct
+import sys
+
+ELF_PF_LZ4 = 0x00100000
+PT_LOAD = 1
+PAGE_SIZE = 4096
+
+EHDR_FMT = "<16sHHIIIIIHHHHHH"
+PHDR_FMT = "<IIIIIIII"
+EHDR_SIZE = struct.calcsize(EHDR_FMT)
+PHDR_SIZE = struct.calcsize(PHDR_FMT)
+
+# LZ4 block format parameters
+MIN_MATCH = 4
+LAST_LITERALS = 5  # Last bytes of a block are always literals
+MF_LIMIT = 12  # Last match must start this far from the end
+MAX_OFFSET = 0xFFFF
+HASH_LOG = 16
+
+
+def write_length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def write_sequence(out, literals, match_len, offset):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+    if match_len:
+        token |= min(match_len - MIN_MATCH, 15)
+    out.append(token)
+    if lit_len >= 15:
+        write_length(out, lit_len - 15)
+    out += literals
+    if match_len:
+        out += struct.pack("<H", offset)
+        if match_len - MIN_MATCH >= 15:
+            write_length(out, match_len - MIN_MATCH - 15)
+
+
+def lz4_compress(data):
+    """Greedy single-pass LZ4 block compressor"""
+    n = len(data)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    match_limit = n - MF_LIMIT
+    end_limit = n - LAST_LITERALS
+
+    while pos < match_limit:
+        key = data[pos:pos + MIN_MATCH]
+        cand = table.get(key)
+        table[key] = pos
+
+        if cand is None or pos - cand > MAX_OFFSET:
+            pos += 1
+            continue
+
+        # Extend match forwards
+        length = MIN_MATCH
+        while pos + length < end_limit and \
+                data[cand + length] == data[pos + length]:
+            length += 1
+
+        write_sequence(out, data[anchor:pos], length, pos - cand)
+        pos += length
+        anchor = pos
+
+    # Trailing literals
+    write_sequence(out, data[anchor:], 0, 0)
+    return bytes(out)
+
+
+def page_range(ph):
+    first = ph[2] // PAGE_SIZE
+    last = (ph[2] + ph[5] - 1) // PAGE_SIZE
+    return first, last
+
+
+def shares_page(phdrs, ph):
+    """Check if a loadable segment has a page in common with another one"""
+    first, last = page_range(ph)
+    for other in phdrs:
+        if other is ph or other[0] != PT_LOAD or not other[5]:
+            continue
+        other_first, other_last = page_range(other)
+        if other_first <= last and first <= other_last:
+            return True
+    return False
+
+
+def compress_elf(data):
+    ehdr = list(struct.unpack_from(EHDR_FMT, data, 0))
+    ident, phoff, phentsize, phnum = ehdr[0], ehdr[5], ehdr[9], ehdr[10]
+
+    if ident[:4] != b"\x7fELF" or ident[4] != 1 or ident[5] != 1:
+        raise ValueError("not a little endian 32 bit ELF file")
+    if phentsize != PHDR_SIZE:
+        raise ValueError("unexpected program header size")
+
+    phdrs = [list(struct.unpack_from(PHDR_FMT, data, phoff + i * PHDR_SIZE))
+             for i in range(phnum)]
+
+    # Program headers follow the ELF header directly
+    body = bytearray()
+    data_start = EHDR_SIZE + phnum * PHDR_SIZE
+    saved = 0
+
+    for ph in phdrs:
+        p_type, p_offset, _, _, p_filesz, _, p_flags, _ = ph
+        if p_filesz == 0:
+            ph[1] = 0
+            continue
+
+        payload = data[p_offset:p_offset + p_filesz]
+        ph[1] = data_start + len(body)
+
+        if p_type == PT_LOAD and not p_flags & ELF_PF_LZ4 and \
+                not shares_page(phdrs, ph):
+            packed = lz4_compress(payload)
+            if len(packed) < len(payload):
+                saved += len(payload) - len(packed)
+                ph[3] = len(packed)
+                ph[6] = p_flags | ELF_PF_LZ4
+                payload = packed
+
+        body += payload
+
+    # Drop section headers
+    ehdr[5] = EHDR_SIZE
+    ehdr[6] = 0
+    ehdr[11] = ehdr[12] = ehdr[13] = 0
+
+    out = bytearray(struct.pack(EHDR_FMT, *ehdr))
+    for ph in phdrs:
+        out += struct.pack(PHDR_FMT, *ph)
+    out += body
+    return bytes(out), saved
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(f"Usage: {sys.argv[0]} <file> [<output>]", file=sys.stderr)
+        sys.exit(1)
+
+    src = sys.argv[1]
+    dst = sys.argv[2] if len(sys.argv) == 3 else src
+
+    with open(src, "rb") as f:
+        data = f.read()
+
+    try:
+        out, saved = compress_elf(data)
+    except (ValueError, struct.error) as e:
+        print(f"{src}: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    with open(dst, "wb") as f:
+        f.write(out)
+
+    print(f"{src}: {len(data)} -> {len(out)} bytes ({saved} saved by LZ4)")
+
+
+if __name__ == "__main__":
+    main()
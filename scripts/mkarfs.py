@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+#
+# Build a read-only archive filesystem (arfs) image.
+#
+# Each source is a file or a directory, added to the image at the given
+# path, or under its own name at the root. Directories are added with
+# everything inside them.
+#
+# The image starts with a header, followed by the index, the names and
+# the file data. The root directory is the first index entry. The
+# children of each directory are contiguous in the index, sorted by
+# name, so the kernel can binary search them.
+#
+# Usage: mkarfs.py <output> <source>[:<path>]...
+#
+# Example: mkarfs.py goos.arfs userland/programs/bin:bin \
+#                    userland/libc/libc.elf:lib/libc
+
+import os
+import struct
+import sys
+
+MAGIC = b"ARFS"
+VERSION = 1
+
+TYPE_FILE = 0
+TYPE_DIR = 1
+
+HEADER_FMT = "<4sIIIIII"
+ENTRY_FMT = "<IIII"
+HEADER_SIZE = struct.calcsize(HEADER_FMT)
+ENTRY_SIZE = struct.calcsize(ENTRY_FMT)
+
+FILENAME_MAX = 64  # Same as the kernel
+DATA_ALIGN = 16
+
+
+class Node:
+    def __init__(self, name, src=None):
+        self.name = name
+        self.src = src  # None for directories
+        self.children = {}
+
+
+def add_path(root, src, path):
+    """Add a file or directory tree at path inside the archive"""
+    parts = [p for p in path.split("/") if p]
+    if not parts:
+        raise ValueError(f"{src}: empty destination path")
+
+    for name in parts:
+        if len(name.encode()) > FILENAME_MAX:
+            raise ValueError(f"{name}: name longer than {FILENAME_MAX} bytes")
+
+    # Create parent directories
+    node = root
+    for name in parts[:-1]:
+        node = node.children.setdefault(name, Node(name))
+        if node.src is not None:
+            raise ValueError(f"{path}: {name} is a file")
+
+    name = parts[-1]
+    if name in node.children:
+        raise ValueError(f"{path}: already in the archive")
+
+    if os.path.isdir(src):
+        node.children[name] = Node(name)
+        for child in sorted(os.listdir(src)):
+            add_path(root, os.path.join(src, child), f"{path}/{child}")
+    elif os.path.isfile(src):
+        node.children[name] = Node(name, src)
+    else:
+        raise ValueError(f"{src}: not a file or directory")
+
+
+def build_image(root):
+    # Breadth first, so the children of each directory are contiguous
+    order = [root]
+    first_child = {}
+    i = 0
+    while i < len(order):
+        node = order[i]
+        if node.src is None:
+            first_child[id(node)] = len(order)
+            order += sorted(node.children.values(),
+                            key=lambda n: n.name.encode())
+        i += 1
+
+    # Names, the root has the empty one
+    names = bytearray()
+    name_offsets = []
+    for node in order:
+        name_offsets.append(len(names))
+        names += node.name.encode() + b"\0"
+
+    index_offset = HEADER_SIZE
+    names_offset = index_offset + len(order) * ENTRY_SIZE
+    data_offset = names_offset + len(names)
+
+    data = bytearray()
+    entries = []
+    for node, name in zip(order, name_offsets):
+        if node.src is None:
+            entries.append((name, TYPE_DIR, first_child[id(node)],
+                            len(node.children)))
+            continue
+
+        with open(node.src, "rb") as f:
+            payload = f.read()
+
+        # Keep file data aligned
+        data += bytes(-(data_offset + len(data)) % DATA_ALIGN)
+        entries.append((name, TYPE_FILE, data_offset + len(data),
+                        len(payload)))
+        data += payload
+
+    image_size = data_offset + len(data)
+
+    out = bytearray(struct.pack(HEADER_FMT, MAGIC, VERSION, len(order),
+                                index_offset, names_offset, len(names),
+                                image_size))
+    for entry in entries:
+        out += struct.pack(ENTRY_FMT, *entry)
+    out += names
+    out += data
+    return bytes(out), len(order)
+
+
+def main():
+    if len(sys.argv) < 3:
+        print(f"Usage: {sys.argv[0]} <output> <source>[:<path>]...",
+              file=sys.stderr)
+        sys.exit(1)
+
+    dst = sys.argv[1]
+    root = Node("")
+
+    try:
+        for arg in sys.argv[2:]:
+            src, _, path = arg.partition(":")
+            add_path(root, src, path or os.path.basename(src.rstrip("/")))
+        out, n_entries = build_image(root)
+    except (ValueError, OSError) as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+
+    with open(dst, "wb") as f:
+        f.write(out)
+
+    print(f"{dst}: {n_entries} entries, {len(out)} bytes")
+
+
+if __name__ == "__main__":
+    main()
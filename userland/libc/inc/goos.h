@@ -14,6 +14,16 @@
 // File open options
 #define FOPT_DIR (1 << 0)   // Want directory from open()
 #define FOPT_WRITE (1 << 1) // Want to be able to write to file
+#define FOPT_CREATE (1 << 2) // Create the file if it doesn't exist
+                             // (with FOPT_WRITE, or FOPT_DIR for a directory)
+
+// Seek origins
+#define SEEK_SET 0 // Start of the file
+#define SEEK_CUR 1 // Current position
+#define SEEK_END 2 // End of the file
+
+// Address of the read-only time page shared by the kernel
+#define TIME_PAGE_ADDR 0xBFFF0000
 
 //// Types
 
@@ -35,6 +45,31 @@ typedef struct
     uint32_t size;               // Size of file
 } dirent_t;
 
+// Time page
+// NOTE: seq is odd while the kernel is updating the page.
+//       Readers must retry if seq is odd or changes during the read
+typedef struct
+{
+    volatile uint32_t seq;
+    volatile uint64_t system_time;       // System clock (ms)
+    volatile uint32_t local_time_offset; // Local time - system time (s)
+} time_page_t;
+
+// Maximum number of entries in a system call batch
+#define BATCH_MAX 64
+
+// Batch flags
+#define BATCH_STOP_ON_ERROR (1 << 0) // Stop at the first failed entry
+
+// System call batch entry
+// Fill with the _g_batch_*() functions, then submit with _g_batch()
+typedef struct __attribute__((packed))
+{
+    uint32_t syscall_n;
+    int32_t res; // Result of the system call, set by the kernel
+    uint32_t params[4];
+} batch_entry_t;
+
 //// System calls
 
 /*
@@ -92,6 +127,15 @@ int32_t _g_exit(int32_t status);
  */
 int32_t _g_exec(const char *path, int32_t *status);
 
+/*
+ * Execute child process in the background
+ * The child runs concurrently with the caller
+ * #### Parameters:
+ *   - path: null-terminatd path to the executable
+ * #### Returns: PID of the child process on success, < 0 on failure
+ */
+int32_t _g_spawn(const char *path);
+
 /*
  * Change process current working directory
  * #### Parameters:
@@ -122,6 +166,12 @@ int32_t _g_mount(uint32_t mp, const char *dev, const char *fs_type);
  */
 int32_t _g_unmount(uint32_t mp);
 
+/*
+ * Write modified data of all filesystems to their devices
+ * Modified data is otherwise written a few seconds later, or on unmount
+ */
+int32_t _g_sync();
+
 /*
  * Open file
  * #### Parameters:
@@ -148,6 +198,40 @@ int32_t _g_close(fd_t fd);
  */
 int32_t _g_read(fd_t fd, uint8_t *buf, uint32_t offset, uint32_t n);
 
+/*
+ * Read from the current position of a file, and advance it
+ * Reading a file from start to end this way lets the kernel read ahead
+ * #### Parameters:
+ *   - fd: file descriptor
+ *   - buf: buffer to place data
+ *   - n: maximum number of bytes to read
+ * NOTE: when the result is < n, no more bytes available
+ */
+int32_t _g_read_next(fd_t fd, uint8_t *buf, uint32_t n);
+
+/*
+ * Set the current position of a file
+ * #### Parameters:
+ *   - fd: file descriptor
+ *   - offset: offset in bytes from the origin
+ *   - whence: origin (SEEK_SET, SEEK_CUR or SEEK_END)
+ * #### Returns: new position, or error
+ * NOTE: positions past 2 GiB can't be returned, such seeks fail and
+ *       leave the position unchanged
+ */
+int32_t _g_seek(fd_t fd, int32_t offset, uint32_t whence);
+
+/*
+ * Write to file
+ * The file must be opened with FOPT_WRITE
+ * #### Parameters:
+ *   - fd: file descriptor
+ *   - buf: data to write
+ *   - offset: offset from start in bytes, at most the file size
+ *   - n: number of bytes to write
+ */
+int32_t _g_write(fd_t fd, const uint8_t *buf, uint32_t offset, uint32_t n);
+
 /*
  * Read directory entries
  * #### Parameters:
@@ -159,6 +243,33 @@ int32_t _g_read(fd_t fd, uint8_t *buf, uint32_t offset, uint32_t n);
  */
 int32_t _g_readdir(fd_t fd, dirent_t *buf, uint32_t offset, uint32_t n);
 
+/*
+ * Execute a batch of system calls with a single trap
+ * The entries are executed in order, and the result of each one
+ * is written in its res field
+ * #### Parameters:
+ *   - entries: array of batch entries
+ *   - n: number of entries (at most BATCH_MAX)
+ *   - flags: batch flags
+ * #### Returns: number of entries executed
+ */
+int32_t _g_batch(batch_entry_t *entries, uint32_t n, uint32_t flags);
+
+/*
+ * Batch entry constructors
+ * Same parameters as the respective system call, plus the entry to fill
+ */
+void _g_batch_console_write(batch_entry_t *e, const char *str, uint32_t n);
+void _g_batch_console_readline(batch_entry_t *e, char *str, uint32_t n);
+void _g_batch_console_getchar(batch_entry_t *e);
+void _g_batch_open(batch_entry_t *e, const char *path, uint32_t fopts);
+void _g_batch_close(batch_entry_t *e, fd_t fd);
+void _g_batch_read(batch_entry_t *e, fd_t fd, uint8_t *buf, uint32_t offset, uint32_t n);
+void _g_batch_read_next(batch_entry_t *e, fd_t fd, uint8_t *buf, uint32_t n);
+void _g_batch_seek(batch_entry_t *e, fd_t fd, int32_t offset, uint32_t whence);
+void _g_batch_write(batch_entry_t *e, fd_t fd, const uint8_t *buf, uint32_t offset, uint32_t n);
+void _g_batch_readdir(batch_entry_t *e, fd_t fd, dirent_t *buf, uint32_t offset, uint32_t n);
+
 ////// System errors
 #define E_UNKNOWN -1   // Unknown error
 #define E_NOIMPL -2    // Not implemented
@@ -176,6 +287,7 @@ int32_t _g_readdir(fd_t fd, dirent_t *buf, uint32_t offset, uint32_t n);
 #define E_NOTPERM -14  // Not permitted
 #define E_INVREQ -15   // Invalid request
 #define E_MDCHNG -16   // Media changed
+#define E_NOSPC -17    // No space left on device
 
 // Get message string for an error
 char *error_get_message(int32_t err);
\ No newline at end of file
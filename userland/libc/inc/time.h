@@ -13,6 +13,12 @@ typedef uint32_t time_t;
  */
 time_t time(time_t *tloc);
 
+/*
+ * Get time since system boot in milliseconds
+ * #### Returns: system clock value (ms)
+ */
+uint64_t uptime_ms();
+
 /*
  * Sleep seconds
  */
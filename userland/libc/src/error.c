@@ -35,6 +35,8 @@ char *error_get_message(int32_t err)
         return "invalid request";
     case E_MDCHNG:
         return "media changed";
+    case E_NOSPC:
+        return "no space left";
     case E_UNKNOWN:
     default:
 
@@ -8,8 +8,11 @@
 
 int puts(const char *s)
 {
-    _g_console_write(s, strlen(s));
-    _g_console_write("\n", 1);
+    // Write string and newline with a single system call
+    batch_entry_t batch[2];
+    _g_batch_console_write(&batch[0], s, strlen(s));
+    _g_batch_console_write(&batch[1], "\n", 1);
+    _g_batch(batch, 2, 0);
     return 0;
 }
 
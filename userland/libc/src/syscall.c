@@ -23,11 +23,15 @@ typedef enum
     SYSCALL_CONSOLE_READLINE = 0x0201,
     SYSCALL_CONSOLE_GETCHAR = 0x0202,
 
+    // Batch system call
+    SYSCALL_BATCH = 0x0300,
+
     // Process management system calls
     SYSCALL_EXIT = 0x1000,
     SYSCALL_EXEC = 0x1001,
     SYSCALL_CHANGE_CWD = 0x1002,
     SYSCALL_GET_CWD = 0x1003,
+    SYSCALL_SPAWN = 0x1004,
 
     // Filesystem syscalls
     SYSCALL_MOUNT = 0x1100,
@@ -35,8 +39,11 @@ typedef enum
     SYSCALL_OPEN = 0x1110,
     SYSCALL_CLOSE = 0x1111,
     SYSCALL_READ = 0x1112,
-    // SYSCALL_WRITE = 0x1113,
+    SYSCALL_WRITE = 0x1113,
     SYSCALL_READDIR = 0x1114,
+    SYSCALL_SYNC = 0x1115,
+    SYSCALL_READ_NEXT = 0x1116,
+    SYSCALL_SEEK = 0x1117,
 } syscall_n_t;
 
 // Internal function prototyes
@@ -82,6 +89,12 @@ int32_t _g_exec(const char *path, int32_t *status)
     return syscall_2_2(SYSCALL_EXEC, (uint32_t)path, n, (uint32_t *)status);
 }
 
+int32_t _g_spawn(const char *path)
+{
+    uint32_t n = strlen(path);
+    return syscall_2_1(SYSCALL_SPAWN, (uint32_t)path, n);
+}
+
 int32_t _g_change_cwd(const char *path)
 {
     uint32_t n = strlen(path);
@@ -118,6 +131,11 @@ int32_t _g_unmount(uint32_t mp)
     return syscall_1_1(SYSCALL_UNMOUNT, mp);
 }
 
+int32_t _g_sync()
+{
+    return syscall_0_1(SYSCALL_SYNC);
+}
+
 int32_t _g_open(const char *path, uint32_t fopts)
 {
     uint32_t n = strlen(path);
@@ -145,7 +163,36 @@ int32_t _g_read(fd_t fd, uint8_t *buf, uint32_t offset, uint32_t n)
         .n = n,
     };
 
-    return syscall_1_1(SYSCALL_READDIR, (uint32_t)&params);
+    return syscall_1_1(SYSCALL_READ, (uint32_t)&params);
+}
+
+int32_t _g_read_next(fd_t fd, uint8_t *buf, uint32_t n)
+{
+    return syscall_3_1(SYSCALL_READ_NEXT, (uint32_t)fd, (uint32_t)buf, n);
+}
+
+int32_t _g_seek(fd_t fd, int32_t offset, uint32_t whence)
+{
+    return syscall_3_1(SYSCALL_SEEK, (uint32_t)fd, (uint32_t)offset, whence);
+}
+
+typedef struct __attribute__((packed))
+{
+    uint32_t fd;
+    const uint8_t *buf;
+    uint32_t offset, n;
+} sc_write_params_t;
+
+int32_t _g_write(fd_t fd, const uint8_t *buf, uint32_t offset, uint32_t n)
+{
+    volatile sc_write_params_t params = {
+        .fd = fd,
+        .buf = buf,
+        .offset = offset,
+        .n = n,
+    };
+
+    return syscall_1_1(SYSCALL_WRITE, (uint32_t)&params);
 }
 
 typedef struct __attribute__((packed))
@@ -167,6 +214,90 @@ int32_t _g_readdir(fd_t fd, dirent_t *buf, uint32_t offset, uint32_t n)
     return syscall_1_1(SYSCALL_READDIR, (uint32_t)&params);
 }
 
+int32_t _g_batch(batch_entry_t *entries, uint32_t n, uint32_t flags)
+{
+    return syscall_3_1(SYSCALL_BATCH, (uint32_t)entries, n, flags);
+}
+
+void _g_batch_console_write(batch_entry_t *e, const char *str, uint32_t n)
+{
+    e->syscall_n = SYSCALL_CONSOLE_WRITE;
+    e->params[0] = (uint32_t)str;
+    e->params[1] = n;
+}
+
+void _g_batch_console_readline(batch_entry_t *e, char *str, uint32_t n)
+{
+    e->syscall_n = SYSCALL_CONSOLE_READLINE;
+    e->params[0] = (uint32_t)str;
+    e->params[1] = n;
+}
+
+void _g_batch_console_getchar(batch_entry_t *e)
+{
+    e->syscall_n = SYSCALL_CONSOLE_GETCHAR;
+}
+
+void _g_batch_open(batch_entry_t *e, const char *path, uint32_t fopts)
+{
+    e->syscall_n = SYSCALL_OPEN;
+    e->params[0] = (uint32_t)path;
+    e->params[1] = strlen(path);
+    e->params[2] = fopts;
+}
+
+void _g_batch_close(batch_entry_t *e, fd_t fd)
+{
+    e->syscall_n = SYSCALL_CLOSE;
+    e->params[0] = (uint32_t)fd;
+}
+
+// NOTE: the parameters have the same layout as sc_read_params_t
+void _g_batch_read(batch_entry_t *e, fd_t fd, uint8_t *buf, uint32_t offset, uint32_t n)
+{
+    e->syscall_n = SYSCALL_READ;
+    e->params[0] = (uint32_t)fd;
+    e->params[1] = (uint32_t)buf;
+    e->params[2] = offset;
+    e->params[3] = n;
+}
+
+void _g_batch_read_next(batch_entry_t *e, fd_t fd, uint8_t *buf, uint32_t n)
+{
+    e->syscall_n = SYSCALL_READ_NEXT;
+    e->params[0] = (uint32_t)fd;
+    e->params[1] = (uint32_t)buf;
+    e->params[2] = n;
+}
+
+void _g_batch_seek(batch_entry_t *e, fd_t fd, int32_t offset, uint32_t whence)
+{
+    e->syscall_n = SYSCALL_SEEK;
+    e->params[0] = (uint32_t)fd;
+    e->params[1] = (uint32_t)offset;
+    e->params[2] = whence;
+}
+
+// NOTE: the parameters have the same layout as sc_write_params_t
+void _g_batch_write(batch_entry_t *e, fd_t fd, const uint8_t *buf, uint32_t offset, uint32_t n)
+{
+    e->syscall_n = SYSCALL_WRITE;
+    e->params[0] = (uint32_t)fd;
+    e->params[1] = (uint32_t)buf;
+    e->params[2] = offset;
+    e->params[3] = n;
+}
+
+// NOTE: the parameters have the same layout as sc_readdir_params_t
+void _g_batch_readdir(batch_entry_t *e, fd_t fd, dirent_t *buf, uint32_t offset, uint32_t n)
+{
+    e->syscall_n = SYSCALL_READDIR;
+    e->params[0] = (uint32_t)fd;
+    e->params[1] = (uint32_t)buf;
+    e->params[2] = offset;
+    e->params[3] = n;
+}
+
 /* Internal functions */
 
 // Generic system call with no parameters and a return value
@@ -2,10 +2,30 @@
 
 #include "goos.h"
 
+// Internal function prototypes
+static void read_time_page(uint64_t *system_time, uint32_t *local_time_offset);
+
+// Time page shared by the kernel
+static const time_page_t *time_page = (const time_page_t *)TIME_PAGE_ADDR;
+
 time_t time(time_t *tloc)
 {
     tloc = tloc; // Ignore
-    return _g_get_local_time();
+
+    uint64_t system_time;
+    uint32_t local_time_offset;
+    read_time_page(&system_time, &local_time_offset);
+
+    return system_time / 1000 + local_time_offset;
+}
+
+uint64_t uptime_ms()
+{
+    uint64_t system_time;
+    uint32_t local_time_offset;
+    read_time_page(&system_time, &local_time_offset);
+
+    return system_time;
 }
 
 void sleep(time_t time)
@@ -15,5 +35,30 @@ void sleep(time_t time)
 
 void msleep(uint32_t ms)
 {
+    // Nothing to wait for
+    if (ms == 0)
+        return;
+
     _g_delay_ms(ms);
-}
\ No newline at end of file
+}
+
+/* Internal functions */
+
+// Read a consistent snapshot of the time page
+static void read_time_page(uint64_t *system_time, uint32_t *local_time_offset)
+{
+    uint32_t seq;
+
+    do
+    {
+        // Wait for the kernel to finish updating the page
+        while ((seq = time_page->seq) & 1)
+            __asm__ volatile("pause");
+        __asm__ volatile("" ::: "memory");
+
+        *system_time = time_page->system_time;
+        *local_time_offset = time_page->local_time_offset;
+
+        __asm__ volatile("" ::: "memory");
+    } while (time_page->seq != seq);
+}
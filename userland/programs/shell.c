@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include "string.h"
 #include "parse.h"
+#include "mini-printf.h"
 
 #define CONSOLE_HEIGHT 25
 #define CONSOLE_WIDTH 80
@@ -13,6 +14,7 @@
 #define MAX_LINE 256
 
 #define LS_BUF_N 24 // Matched to number of lines
+#define LS_LINE_MAX 128
 
 // Colors
 #define COLOR_RESET "\033[0m"
@@ -57,8 +59,10 @@ static void builtin_cd(uint32_t argc, argv_t *argv);
 static void builtin_exit(uint32_t argc, argv_t *argv);
 static void builtin_unmount(uint32_t argc, argv_t *argv);
 static void builtin_mount(uint32_t argc, argv_t *argv);
+static void builtin_sync(uint32_t argc, argv_t *argv);
 static void builtin_ls(uint32_t argc, argv_t *argv);
-static void builtin_ls_display_dirent(dirent_t *dirent);
+static uint32_t builtin_ls_format_dirent(char *buf, dirent_t *dirent);
+static void builtin_ls_flush(batch_entry_t *batch, uint32_t *n);
 static bool enter_or_quit();
 
 // Builtin command table
@@ -79,6 +83,10 @@ static builtin_cmd_t builtin_cmds[] = {
         .cmd = "mount",
         .func = builtin_mount,
     },
+    {
+        .cmd = "sync",
+        .func = builtin_sync,
+    },
     {
         .cmd = "ls",
         .func = builtin_ls,
@@ -267,8 +275,16 @@ static void execute_program(uint32_t argc, argv_t *argv)
     // Get command
     char *cmd = argv[0];
 
+    // Trailing "&": run program in the background
+    bool background = argc > 1 && strcmp(argv[argc - 1], "&") == 0;
+
     int32_t res, status;
-    if ((res = _g_exec(cmd, &status)) < 0)
+    if (background)
+        res = _g_spawn(cmd);
+    else
+        res = _g_exec(cmd, &status);
+
+    if (res < 0)
     {
         if (res == E_NOENT || res == E_NOTELF || res == E_WRONGTYPE)
             // Command not found
@@ -279,6 +295,12 @@ static void execute_program(uint32_t argc, argv_t *argv)
         return;
     }
 
+    if (background)
+    {
+        printf("Started process %d\n", res);
+        return;
+    }
+
     // Print process exit value
     putss(COLOR_RESET); // Reset color
     printf("\nProcess exited with status %d\n", status);
@@ -364,6 +386,18 @@ static void builtin_unmount(uint32_t argc, argv_t *argv)
     }
 }
 
+// "sync" builtin command
+static void builtin_sync(uint32_t argc, argv_t *argv)
+{
+    // Execute sync
+    int32_t res;
+    if ((res = _g_sync()) < 0)
+    {
+        printf("sync: %serror%s: %s\n", COLOR_HI_RED, COLOR_RESET, error_get_message(res));
+        return;
+    }
+}
+
 // "mount" builtin command
 static void builtin_mount(uint32_t argc, argv_t *argv)
 {
@@ -432,6 +466,11 @@ static void builtin_ls(uint32_t argc, argv_t *argv)
     dirent_t dir_buf[LS_BUF_N];
     uint32_t offset = 0;
 
+    // Output lines are written to the console in batches
+    char line_buf[LS_BUF_N][LS_LINE_MAX];
+    batch_entry_t batch[LS_BUF_N];
+    uint32_t batch_n = 0;
+
     uint32_t total_bytes = 0;
     uint32_t lines_printed = 0;
 
@@ -453,12 +492,15 @@ static void builtin_ls(uint32_t argc, argv_t *argv)
         // Display result
         for (size_t i = 0; i < res; i++)
         {
-            builtin_ls_display_dirent(&dir_buf[i]);
+            uint32_t len = builtin_ls_format_dirent(line_buf[batch_n], &dir_buf[i]);
+            _g_batch_console_write(&batch[batch_n], line_buf[batch_n], len);
+            batch_n++;
             total_bytes += dir_buf[i].size;
 
             // Stop outout when scrolling out of view
             if (lines_printed >= CONSOLE_HEIGHT - 1)
             {
+                builtin_ls_flush(batch, &batch_n);
                 lines_printed = 0;
                 if (!enter_or_quit())
                 {
@@ -469,6 +511,9 @@ static void builtin_ls(uint32_t argc, argv_t *argv)
             lines_printed++;
         }
 
+        // Write lines before reading more entries
+        builtin_ls_flush(batch, &batch_n);
+
         offset += res;
 
     } while (res >= LS_BUF_N);
@@ -481,7 +526,9 @@ end:
     _g_close(fd);
 }
 
-static void builtin_ls_display_dirent(dirent_t *dirent)
+// Format a directory entry line for ls
+// Returns length of the line
+static uint32_t builtin_ls_format_dirent(char *buf, dirent_t *dirent)
 {
 
     char *color = COLOR_RESET;
@@ -494,7 +541,15 @@ static void builtin_ls_display_dirent(dirent_t *dirent)
         post = "/";
     }
 
-    printf("%c %6u %s%s%s%s\n", type, dirent->size, color, dirent->name, COLOR_RESET, post);
+    return snprintf(buf, LS_LINE_MAX, "%c %6u %s%s%s%s\n", type, dirent->size, color, dirent->name, COLOR_RESET, post);
+}
+
+// Write batched ls output lines to the console
+static void builtin_ls_flush(batch_entry_t *batch, uint32_t *n)
+{
+    if (*n)
+        _g_batch(batch, *n, 0);
+    *n = 0;
 }
 
 // Ask user to press enter to continue, Q to quit